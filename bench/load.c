@@ -0,0 +1,74 @@
+/* Script startup benchmark: loads count scripts, then unloads them, and reports
+ * the time per load and unload and the memory each script uses once loaded.
+ * This is done with the state pool and then without it.
+ *
+ * make bench
+ * bench/load [count] [script]   (from the repo root; the script defaults to bench/startup.lua)
+ */
+
+#include <libretro_script.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static bool run(const char* label, const char* path, retro_script_id_t* ids, int count)
+{
+    const double start = now_ms();
+    for (int i = 0; i < count; ++i)
+    {
+        ids[i] = retro_script_load_lua(path);
+        if (!ids[i])
+        {
+            fprintf(stderr, "could not load %s: %s\n", path, retro_script_get_error());
+            return false;
+        }
+    }
+    const double loaded = now_ms();
+    
+    size_t bytes = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        struct retro_script_memory_stats stats;
+        if (retro_script_get_memory_stats(ids[i], &stats)) bytes += stats.live_bytes;
+    }
+    
+    for (int i = 0; i < count; ++i)
+    {
+        retro_script_unload(ids[i]);
+    }
+    const double unloaded = now_ms();
+    
+    printf("%-10s load %.3f ms, unload %.3f ms, %.1f KiB per script\n", label,
+        (loaded - start) / count, (unloaded - loaded) / count, bytes / 1024.0 / count);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const int count = argc > 1 ? atoi(argv[1]) : 200;
+    const char* path = argc > 2 ? argv[2] : "bench/startup.lua";
+    if (count <= 0) return 1;
+    
+    retro_script_id_t* ids = malloc(sizeof(retro_script_id_t) * count);
+    if (!ids || !retro_script_init()) return 1;
+    
+    // the pool holds as many states as there are scripts, prebuilt so they aren't timed.
+    // (a first run warms up the allocator and file cache.)
+    retro_script_set_state_pool_size((uint32_t)count);
+    bool ok = run("warmup", path, ids, count);
+    ok = ok && run("pooled", path, ids, count);
+    retro_script_set_state_pool_size(0);
+    ok = ok && run("unpooled", path, ids, count);
+    
+    retro_script_deinit();
+    free(ids);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,4 @@
+-- does next to nothing when loaded, so that loading it measures script startup.
+local retro = require "retro"
+local frames = 0
+retro.every(1, function() frames = frames + 1 end)
@@ -1,7 +1,15 @@
+#ifdef RETRO_SCRIPT_LUAJIT
+
+#include "lua_luajit_compat.h"
+
+#else
+
 #include "lua_5.4.3_sym_def.h"
 
 #include "lua-5.4.3/lua.h"
 #include "lua-5.4.3/lauxlib.h"
 #include "lua-5.4.3/lualib.h"
 
-#include "lua_5.4.3_sym_undef.h"
\ No newline at end of file
+#include "lua_5.4.3_sym_undef.h"
+
+#endif
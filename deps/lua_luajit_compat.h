@@ -0,0 +1,167 @@
+#ifndef RETRO_SCRIPT_LUAJIT_COMPAT
+#define RETRO_SCRIPT_LUAJIT_COMPAT
+
+/* Used instead of the vendored lua 5.4.3 when building with LUAJIT=1.
+ * Provides the parts of the lua 5.4 API which libretro_script uses, on top of LuaJIT's 5.1 API.
+ * Differences:
+ *   - numbers are doubles; integers are numbers with no fractional part, exact only up to 2^53.
+ *   - there is no extra space. a state's script is found through the heap given to its allocator
+ *     (see script_thread_binding), so scripts cannot share a lua state.
+ *   - hooks (and so the watchdog and job preemption) do not run in JIT-compiled code.
+ *   - a hook is set for the whole lua state rather than per coroutine, so while a job runs,
+ *     its preemption count applies to all of the script's threads.
+ *   - package.searchers is package.loaders.
+ *   - generational/incremental gc modes are ignored.
+ *   - there is no utf8 library.
+ * LuaJIT must be built with LJ_GC64 (the default on 64-bit) so that lua_newstate accepts an allocator.
+ */
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <math.h>
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#define LUA_GNAME "_G"
+#define LUA_LOADED_TABLE "_LOADED"
+#define LUA_PRELOAD_TABLE "_PRELOAD"
+
+// not supported; lua_gc ignores these.
+#define LUA_GCGEN 10
+#define LUA_GCINC 11
+
+typedef unsigned long long lua_Unsigned;
+
+static inline int retro_script_compat_absindex(lua_State* L, int idx)
+{
+    return (idx > 0 || idx <= LUA_REGISTRYINDEX) ? idx : lua_gettop(L) + idx + 1;
+}
+#define lua_absindex(L, idx) retro_script_compat_absindex(L, idx)
+
+// getters return the type of the value pushed, as in 5.3+.
+#define lua_getfield(L, idx, k) (lua_getfield(L, idx, k), lua_type(L, -1))
+#define lua_rawget(L, idx) (lua_rawget(L, idx), lua_type(L, -1))
+#define lua_rawgeti(L, idx, n) (lua_rawgeti(L, idx, n), lua_type(L, -1))
+#undef lua_getglobal
+#define lua_getglobal(L, name) lua_getfield(L, LUA_GLOBALSINDEX, name)
+
+#define lua_pushglobaltable(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
+#define lua_rawlen(L, idx) lua_objlen(L, idx)
+#define lua_dump(L, writer, data, strip) lua_dump(L, writer, data)
+
+static inline int retro_script_compat_isinteger(lua_State* L, int idx)
+{
+    if (lua_type(L, idx) != LUA_TNUMBER) return 0;
+    const lua_Number n = lua_tonumber(L, idx);
+    return n >= -9223372036854775808.0 && n < 9223372036854775808.0 && floor(n) == n;
+}
+#define lua_isinteger(L, idx) retro_script_compat_isinteger(L, idx)
+
+static inline void retro_script_compat_rotate(lua_State* L, int idx, int n)
+{
+    idx = lua_absindex(L, idx);
+    for (; n > 0; --n) lua_insert(L, idx);
+    for (; n < 0; ++n)
+    {
+        lua_pushvalue(L, idx);
+        lua_remove(L, idx);
+    }
+}
+#define lua_rotate(L, idx, n) retro_script_compat_rotate(L, idx, n)
+
+static inline int retro_script_compat_rawgetp(lua_State* L, int idx, const void* p)
+{
+    idx = lua_absindex(L, idx);
+    lua_pushlightuserdata(L, (void*)p);
+    return lua_rawget(L, idx);
+}
+#define lua_rawgetp(L, idx, p) retro_script_compat_rawgetp(L, idx, p)
+
+static inline void retro_script_compat_rawsetp(lua_State* L, int idx, const void* p)
+{
+    idx = lua_absindex(L, idx);
+    lua_pushlightuserdata(L, (void*)p);
+    lua_insert(L, -2);
+    lua_rawset(L, idx);
+}
+#define lua_rawsetp(L, idx, p) retro_script_compat_rawsetp(L, idx, p)
+
+static inline int retro_script_compat_resume(lua_State* co, lua_State* from, int nargs, int* nresults)
+{
+    (void)from;
+    const int status = lua_resume(co, nargs);
+    *nresults = (status == LUA_OK || status == LUA_YIELD) ? lua_gettop(co) : 0;
+    return status;
+}
+#define lua_resume(co, from, nargs, nresults) retro_script_compat_resume(co, from, nargs, nresults)
+
+// (5.4's lua_gc takes a variable number of arguments; only the first is used here.)
+static inline int retro_script_compat_gc(lua_State* L, int what, int data, ...)
+{
+    if (what == LUA_GCGEN || what == LUA_GCINC) return 0;
+    return lua_gc(L, what, data);
+}
+#define lua_gc(L, ...) retro_script_compat_gc(L, __VA_ARGS__, 0)
+
+static inline const char* retro_script_compat_tolstring(lua_State* L, int idx, size_t* len)
+{
+    idx = lua_absindex(L, idx);
+    lua_getglobal(L, "tostring");
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 1);
+    if (!lua_isstring(L, -1)) luaL_error(L, "'tostring' must return a string");
+    return lua_tolstring(L, -1, len);
+}
+#define luaL_tolstring(L, idx, len) retro_script_compat_tolstring(L, idx, len)
+
+static inline int retro_script_compat_getsubtable(lua_State* L, int idx, const char* name)
+{
+    idx = lua_absindex(L, idx);
+    if (lua_getfield(L, idx, name) == LUA_TTABLE) return 1;
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, idx, name);
+    return 0;
+}
+#define luaL_getsubtable(L, idx, name) retro_script_compat_getsubtable(L, idx, name)
+
+static inline void retro_script_compat_requiref(lua_State* L, const char* name, lua_CFunction open, int global)
+{
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    lua_getfield(L, -1, name);
+    if (!lua_toboolean(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_pushcfunction(L, open);
+        lua_pushstring(L, name);
+        lua_call(L, 1, 1);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, name);
+    }
+    lua_remove(L, -2);
+    if (global)
+    {
+        lua_pushvalue(L, -1);
+        lua_setglobal(L, name);
+    }
+}
+#define luaL_requiref(L, name, open, global) retro_script_compat_requiref(L, name, open, global)
+
+// (LuaJIT opens the coroutine library along with the base library.)
+static inline int retro_script_compat_open_coroutine(lua_State* L)
+{
+    lua_getglobal(L, LUA_COLIBNAME);
+    return 1;
+}
+#define luaopen_coroutine retro_script_compat_open_coroutine
+
+#ifndef luaL_newlib
+#define luaL_newlib(L, l) (lua_createtable(L, 0, sizeof(l) / sizeof((l)[0]) - 1), luaL_setfuncs(L, l, 0))
+#endif
+
+#endif
@@ -56,16 +56,40 @@ RETRO_SCRIPT_API uint32_t retro_script_init();
 // there is otherwise no need to call it when a core is unloaded or loaded.
 RETRO_SCRIPT_API void retro_script_deinit();
 
-// returns error text if an error occured, or nullptr if no error.
+// returns error text if an error occured on the calling thread, or nullptr if no error.
 RETRO_SCRIPT_API const char* retro_script_get_error();
 
+// a context holds the state for one emulator instance: its core, memory map, scripts and settings.
+// every function here acts on the calling thread's current context, which is a default context
+// unless another has been made current; so a process can run several instances, each on its own
+// thread, by creating a context per instance and making it current on that thread.
+// this includes the intercepted core functions, and the callbacks the core makes through them,
+// so each instance's core should be run on a thread where its context is current.
+// logging, the error handlers and error policy, and the state pool are shared by all contexts.
+typedef struct retro_script_context retro_script_context_t;
+
+// returns NULL if not enough memory.
+RETRO_SCRIPT_API retro_script_context_t* retro_script_context_create();
+
+// unloads the context's scripts and frees it. the default context cannot be destroyed.
+RETRO_SCRIPT_API void retro_script_context_destroy(retro_script_context_t*);
+
+// sets the calling thread's current context. NULL restores the default context.
+RETRO_SCRIPT_API void retro_script_context_make_current(retro_script_context_t*);
+RETRO_SCRIPT_API retro_script_context_t* retro_script_context_get_current();
+
+// same as retro_script_init, but for the given context.
+RETRO_SCRIPT_API uint32_t retro_script_context_init(retro_script_context_t*);
+
 #define RETRO_SCRIPT_DECLT(name) decl_##name##_t
 #define RETRO_SCRIPT_INTERCEPT(rtype, name, ...) \
 typedef rtype (RETRO_CALLCONV *RETRO_SCRIPT_DECLT(name))(__VA_ARGS__); \
-RETRO_SCRIPT_API RETRO_SCRIPT_DECLT(name) retro_script_intercept_##name(RETRO_SCRIPT_DECLT(name));
+RETRO_SCRIPT_API RETRO_SCRIPT_DECLT(name) retro_script_intercept_##name(RETRO_SCRIPT_DECLT(name)); \
+RETRO_SCRIPT_API RETRO_SCRIPT_DECLT(name) retro_script_context_intercept_##name(retro_script_context_t*, RETRO_SCRIPT_DECLT(name));
 
 // these intercept replacements should all be called before retro_init
 // example usage: core.retro_set_environment = retro_script_intercept_retro_set_environment(core.retro_set_environment)
+// the retro_script_context_intercept_* variants intercept for the given context instead of the current one.
 RETRO_SCRIPT_INTERCEPT(void, retro_set_environment, retro_environment_t);
 RETRO_SCRIPT_INTERCEPT(void*, retro_get_memory_data, unsigned id);
 RETRO_SCRIPT_INTERCEPT(size_t, retro_get_memory_size, unsigned id);
@@ -92,17 +116,267 @@ struct lua_State;
 typedef int (RETRO_CALLCONV *retro_script_setup_lua_t)(struct lua_State* L);
 RETRO_SCRIPT_API retro_script_id_t retro_script_load_lua_special(const char* path_to_script, retro_script_setup_lua_t);
 
+// same as the above, but for the given context.
+RETRO_SCRIPT_API retro_script_id_t retro_script_context_load_lua(retro_script_context_t*, const char* path_to_script);
+RETRO_SCRIPT_API retro_script_id_t retro_script_context_load_lua_special(retro_script_context_t*, const char* path_to_script, retro_script_setup_lua_t);
+
+// unloads a script, releasing its lua state and any breakpoints it set.
+// if called during a frame (e.g. from a callback), the script stops running
+// immediately but is freed at the end of the frame.
+// returns false if no such script.
+RETRO_SCRIPT_API bool retro_script_unload(retro_script_id_t);
+RETRO_SCRIPT_API bool retro_script_context_unload(retro_script_context_t*, retro_script_id_t);
+
+// a disabled script keeps its state, but none of its callbacks, timers, jobs or breakpoints run.
+// enabling a script also re-enables it if it was disabled for exceeding its instruction budget.
+// returns false if no such script.
+RETRO_SCRIPT_API bool retro_script_set_enabled(retro_script_id_t, bool enabled);
+
+// writes the ids of up to max loaded scripts to ids, in load order.
+// returns the number of loaded scripts, which may be greater than max.
+RETRO_SCRIPT_API size_t retro_script_list(retro_script_id_t* ids, size_t max);
+
+// lua states of unloaded scripts are reset and kept in a pool, so that loading a
+// script needn't build a new state and open its libraries. sets how many are kept
+// (default 4), creating states now up to that count. 0 disables pooling.
+RETRO_SCRIPT_API void retro_script_set_state_pool_size(uint32_t count);
+
+// scripts loaded after this is enabled share a single lua state, instead of each having
+// their own. each still has its own globals and retro table, but libraries and modules
+// loaded with require are shared. this saves memory and load time when running many small scripts.
+// memory limits and stats of scripts in the shared state apply to the whole state.
+// (not available when built with LuaJIT.)
+RETRO_SCRIPT_API void retro_script_set_shared_vm(bool enabled);
+
 // set callback to be invoked on a lua error during pcall.
 // preferably, should not print anything, should just manipulate the error on the stack and return.
 typedef int (*lua_CFunction) (struct lua_State *L);
 RETRO_SCRIPT_API void retro_script_set_lua_error_handler(lua_CFunction);
 RETRO_SCRIPT_API lua_CFunction retro_script_get_lua_error_handler(void);
 
+// status code passed to the uncaught error handler when a script exceeds its instruction budget.
+#define RETRO_SCRIPT_ERR_BUDGET 0x100
+
 // invoked if a lua error from a script reaches top-level without being caught.
 // default is to print the error.
 typedef void (*retro_script_lua_uncaught_error_cb) (retro_script_id_t script_id, int lua_status_code, const char* error_msg);
 RETRO_SCRIPT_API void retro_script_set_lua_uncaught_error_handler(retro_script_lua_uncaught_error_cb cb);
 
+// if deduplicate is set (the default), an error which repeats (from the same callback and
+// location) is only reported in full the first time, with a stack trace; after that, only a
+// summary is reported when it has occurred 2, 4, 8, 16... times.
+// a retro.on_run_* callback which fails max_consecutive_errors times in a row is removed,
+// which is also reported. 0 (the default) means never.
+RETRO_SCRIPT_API void retro_script_set_error_policy(bool deduplicate, uint32_t max_consecutive_errors);
+
+typedef enum retro_script_log_level
+{
+    RETRO_SCRIPT_LOG_DEBUG = 0,
+    RETRO_SCRIPT_LOG_INFO = 1,
+    RETRO_SCRIPT_LOG_WARN = 2,
+    RETRO_SCRIPT_LOG_ERROR = 3,
+} retro_script_log_level_t;
+
+// messages from retro.log are queued without blocking, and written out by a background thread.
+// if the queue is full, messages are dropped, and the number dropped is logged later.
+// messages longer than 240 bytes are truncated.
+// messages below this level are discarded. default is RETRO_SCRIPT_LOG_DEBUG.
+RETRO_SCRIPT_API void retro_script_set_log_level(retro_script_log_level_t level);
+
+// appends log messages to the given file, or to stdout (the default) if path is NULL.
+// returns false if the file could not be opened.
+RETRO_SCRIPT_API bool retro_script_set_log_file(const char* path);
+
+// if set, log messages are passed to this callback instead of being written out.
+// it is called from the background thread, and must not call other retro_script_*log* functions.
+typedef void (*retro_script_log_cb)(retro_script_id_t script_id, retro_script_log_level_t level, const char* msg);
+RETRO_SCRIPT_API void retro_script_set_log_callback(retro_script_log_cb cb);
+
+// if enabled, print in scripts loaded afterward is queued like retro.log at the info level.
+RETRO_SCRIPT_API void retro_script_set_print_to_log(bool enabled);
+
+// writes out any queued log messages now.
+RETRO_SCRIPT_API void retro_script_log_flush();
+
+// records a timeline of frames, the core's retro_run, script callbacks, breakpoints, jobs,
+// gc steps and script loads to the file at path (replacing it), in chrome's trace event format,
+// which chrome://tracing and https://ui.perfetto.dev can open. events are queued without blocking
+// and written out by a background thread. a NULL path stops tracing, finishing the file.
+// tracing is shared by all contexts, and goes on across cores; a trace not stopped is finished
+// at process exit. returns false if the file could not be opened.
+RETRO_SCRIPT_API bool retro_script_set_trace_file(const char* path);
+
+// each script allocates lua memory from its own heap.
+struct retro_script_memory_stats
+{
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t limit_bytes; // 0 if unlimited
+    uint64_t alloc_count;
+    uint64_t realloc_count;
+    uint64_t free_count;
+    uint64_t failed_count; // allocations refused because of the limit
+};
+
+// sets a hard limit on a script's lua memory, in bytes. 0 means unlimited.
+// allocations over the limit fail, raising a lua memory error (LUA_ERRMEM) in the script.
+// if script_id is 0, sets the default limit for scripts loaded afterward.
+RETRO_SCRIPT_API void retro_script_set_memory_limit(retro_script_id_t script_id, size_t limit_bytes);
+
+// returns false if no such script.
+RETRO_SCRIPT_API bool retro_script_get_memory_stats(retro_script_id_t script_id, struct retro_script_memory_stats* out);
+
+typedef enum retro_script_gc_mode
+{
+    // lua's default: the collector runs whenever allocation debt triggers it,
+    // which may be in the middle of a callback.
+    RETRO_SCRIPT_GC_AUTO = 0,
+    
+    // automatic collection is stopped; instead, bounded collector steps
+    // are run for each script after each frame (after retro.on_run_end callbacks).
+    // each step also does the work for what the script allocated since its last one.
+    RETRO_SCRIPT_GC_FRAME = 1,
+} retro_script_gc_mode_t;
+
+// applies to all scripts, including those loaded afterward.
+// generational: use lua's generational collector instead of the incremental one.
+// step_kb: size of each incremental step, in KiB. 0 for lua's default.
+// budget_usec: time per frame spent stepping, shared across all scripts (frame mode only).
+//   if 0, each script gets a single step per frame.
+RETRO_SCRIPT_API void retro_script_set_gc_mode(retro_script_gc_mode_t mode, bool generational, uint32_t step_kb, uint32_t budget_usec);
+
+// limits how many lua instructions a script may execute in one callback, and while loading.
+// going over the budget aborts the call with RETRO_SCRIPT_ERR_BUDGET.
+// budgets are checked about every 1000 instructions. 0 means unlimited.
+// lua finalizers set with setmetatable are held to the callback budget, also while unloading.
+// if script_id is 0, sets the defaults for scripts loaded afterward.
+RETRO_SCRIPT_API void retro_script_set_instruction_budget(retro_script_id_t script_id, uint64_t callback_budget, uint64_t load_budget);
+
+// a script is disabled after this many callback budget overruns, which is reported to the
+// uncaught error handler. overruns are forgiven once the callback which last overran returns
+// within its budget, so only repeated overruns count. 0 means never. default is 3.
+RETRO_SCRIPT_API void retro_script_set_max_budget_overruns(uint32_t count);
+
+// time allowed for each frame, in microseconds, measured from the start of retro_run.
+// callbacks registered with retro.on_run_deferred only run while the frame is within
+// this deadline; the rest are carried over to the next frame. at least one deferred
+// callback runs per frame. 0 (the default) runs every deferred callback every frame.
+RETRO_SCRIPT_API void retro_script_set_frame_deadline(uint32_t usec);
+
+// tells scripts how fast the frontend is running the core, e.g. 10 while fast-forwarding at 10x,
+// in which case it is taken to present one frame in ten. callbacks which scripts registered to run
+// only on presented frames are skipped on the others. default is 1 (every frame is presented).
+RETRO_SCRIPT_API void retro_script_set_speed_hint(float multiplier);
+
+// number of lua instructions a retro.job runs before being preempted until the next slice.
+// jobs get slices after deferred callbacks, while the frame is within the frame deadline;
+// at least one job gets a slice each frame. default is 100000.
+RETRO_SCRIPT_API void retro_script_set_job_slice(uint32_t instructions);
+
+// runs script work which can wait until after the frame, for up to budget_usec microseconds,
+// e.g. while the frontend would otherwise sleep until vsync: retro.on_run_deferred callbacks which
+// the frame had no time for (see retro_script_set_frame_deadline), gc steps, retro.job slices,
+// and writing out queued log messages. call between frames, after retro_run.
+// observers still running from the frame are not waited for; their scripts are passed over
+// (leaving any of their deferred callbacks to the next frame).
+// returns true if all the work was done, or false if time ran out (as it will while jobs are running)
+// or observers' work was passed over.
+RETRO_SCRIPT_API bool retro_script_idle(uint32_t budget_usec);
+
+// scripts which call retro.set_observer() are observers: their retro.on_run_end callbacks run
+// on worker threads, reading a snapshot of memory taken just after the core's retro_run, and
+// writing to memory fails. they run after retro_run returns, and are waited for at the start
+// of the next retro_run, or before any function here modifies a script.
+// the uncaught error handler and lua error handler may be called from these threads.
+// sets the number of worker threads (default 2). 0 runs observers at the end of retro_run instead.
+RETRO_SCRIPT_API void retro_script_set_observer_threads(uint32_t count);
+
+// watches each script's file, and any lua files it requires, for changes (linux only).
+// a changed script is recompiled in the background, then reloaded at the start of the
+// next frame, keeping its id; see retro.on_reload. if the new version fails to compile or
+// load, the error is reported and the old version keeps running. scripts already loaded
+// are watched from then on, but modules they have already required only once they reload.
+// stopped by retro_script_deinit. returns false if not supported.
+RETRO_SCRIPT_API bool retro_script_set_hot_reload(bool enabled);
+
+typedef enum retro_script_profile_mode
+{
+    RETRO_SCRIPT_PROFILE_OFF = 0,
+    
+    // the lua call stack is recorded every sample_period instructions.
+    RETRO_SCRIPT_PROFILE_SAMPLE = 1,
+    
+    // the lua call stack is recorded on every line executed. much slower.
+    RETRO_SCRIPT_PROFILE_EXACT = 2,
+} retro_script_profile_mode_t;
+
+// starts profiling a script, discarding its previous profile, or stops (keeping the profile) if mode is off.
+// sample_period is in lua instructions; 0 for the default (10000). see also retro.profile_start.
+// returns false if no such script, or out of memory.
+RETRO_SCRIPT_API bool retro_script_set_profiling(retro_script_id_t, retro_script_profile_mode_t mode, uint32_t sample_period);
+
+// writes a script's profile as "folded stacks", as read by flamegraph.pl, speedscope, etc.:
+// a line for each call stack seen, with its functions from outermost to innermost separated by ';',
+// followed by a space and its weight (instructions in sample mode, lines in exact mode).
+// like snprintf, writes at most size bytes including the terminating NUL, and returns the full length.
+RETRO_SCRIPT_API size_t retro_script_get_profile_folded(retro_script_id_t, char* buffer, size_t size);
+
+typedef enum retro_script_callback_kind
+{
+    RETRO_SCRIPT_CALLBACK_RUN_BEGIN = 0,
+    RETRO_SCRIPT_CALLBACK_RUN_END = 1,
+    RETRO_SCRIPT_CALLBACK_RUN_DEFERRED = 2,
+    
+    // breakpoints, watchpoints and steps.
+    RETRO_SCRIPT_CALLBACK_BREAKPOINT = 3,
+    
+    RETRO_SCRIPT_CALLBACK_KIND_COUNT
+} retro_script_callback_kind_t;
+
+// times are wall time (monotonic clock), in microseconds.
+struct retro_script_callback_stats
+{
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total_usec;
+    uint64_t max_usec;
+};
+
+struct retro_script_stats
+{
+    // indexed by retro_script_callback_kind_t.
+    struct retro_script_callback_stats callbacks[RETRO_SCRIPT_CALLBACK_KIND_COUNT];
+    
+    // lua memory in use. 0 for scripts in the shared lua state.
+    size_t heap_bytes;
+};
+
+struct retro_script_global_stats
+{
+    // frames run, and time spent in the intercepted retro_run.
+    uint64_t frames;
+    uint64_t frame_usec;
+    uint64_t frame_max_usec;
+    
+    // of the frame time, that spent in the core's retro_run (not counting breakpoint callbacks),
+    // and the rest: script callbacks, timers, jobs, gc, etc.
+    uint64_t core_usec;
+    uint64_t script_usec;
+    
+    // totals for the scripts currently loaded; max_usec is the max of any.
+    struct retro_script_stats scripts;
+};
+
+// gets a script's callback statistics, collected since it was loaded or the stats were reset.
+// a reloaded script keeps its stats. returns false if no such script.
+RETRO_SCRIPT_API bool retro_script_get_stats(retro_script_id_t, struct retro_script_stats* out);
+
+// gets statistics for all scripts, and for frames.
+RETRO_SCRIPT_API void retro_script_get_global_stats(struct retro_script_global_stats* out);
+
+// resets the statistics of every script, and of frames.
+RETRO_SCRIPT_API void retro_script_reset_stats(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,410 @@
+#include "bus.h"
+#include "store.h"
+#include "script_list.h"
+#include "observer.h"
+#include "log.h"
+#include "context.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define BUS_DEFAULT_CAPACITY 64
+#define BUS_MAX_CAPACITY 0x10000
+
+// shared between the subscribers it was queued for.
+typedef struct bus_message
+{
+    atomic_uint refs;
+    retro_script_value value;
+} bus_message;
+
+typedef struct bus_subscription
+{
+    uint32_t id;
+    script_state_t* script;
+    int ref; // registry ref to callback
+    bool cancelled;
+    
+    // ring of messages waiting to be delivered.
+    bus_message** ring;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    
+    // messages dropped because the ring was full, since last delivery.
+    uint32_t dropped;
+    
+    struct bus_subscription* next;
+} bus_subscription;
+
+typedef struct bus_topic
+{
+    uint32_t hash;
+    size_t len;
+    bus_subscription* subscriptions;
+    struct bus_topic* next;
+    char name[];
+} bus_topic;
+
+typedef struct bus_state
+{
+    bus_topic* topics;
+    uint32_t next_id;
+} bus_state;
+
+static void bus_state_init(void* state)
+{
+    ((bus_state*)state)->next_id = 1;
+}
+
+static void bus_state_destroy(void* state);
+
+CONTEXT_STATE(bus_state, bus, bus_state_init, bus_state_destroy)
+
+static void message_release(bus_message* message)
+{
+    if (atomic_fetch_sub(&message->refs, 1) == 1)
+    {
+        retro_script_value_free(&message->value);
+        free(message);
+    }
+}
+
+static void subscription_free(bus_subscription* sub, bool unref)
+{
+    for (; sub->count > 0; sub->count--)
+    {
+        message_release(sub->ring[sub->head]);
+        sub->head = (sub->head + 1) % sub->capacity;
+    }
+    if (unref) luaL_unref(sub->script->L, LUA_REGISTRYINDEX, sub->ref);
+    free(sub->ring);
+    free(sub);
+}
+
+static void bus_state_destroy(void* state)
+{
+    // (scripts have already been destroyed, and their lua states with them.)
+    bus_topic* topic = ((bus_state*)state)->topics;
+    while (topic)
+    {
+        bus_topic* next = topic->next;
+        while (topic->subscriptions)
+        {
+            bus_subscription* sub = topic->subscriptions;
+            topic->subscriptions = sub->next;
+            subscription_free(sub, false);
+        }
+        free(topic);
+        topic = next;
+    }
+    ((bus_state*)state)->topics = NULL;
+}
+
+static bus_topic* topic_find(bus_state* state, const char* name, size_t len)
+{
+    const uint32_t hash = retro_script_fnv1a(name, len);
+    for (bus_topic* topic = state->topics; topic; topic = topic->next)
+    {
+        if (topic->hash == hash && topic->len == len && memcmp(topic->name, name, len) == 0) return topic;
+    }
+    return NULL;
+}
+
+// adds the message to the subscriber's ring, dropping the oldest if it is full.
+static void subscription_enqueue(bus_subscription* sub, bus_message* message)
+{
+    if (sub->count == sub->capacity)
+    {
+        message_release(sub->ring[sub->head]);
+        sub->head = (sub->head + 1) % sub->capacity;
+        sub->count--;
+        sub->dropped++;
+    }
+    atomic_fetch_add(&message->refs, 1);
+    sub->ring[(sub->head + sub->count) % sub->capacity] = message;
+    sub->count++;
+}
+
+// lua args: value (light userdata), topic (light userdata)
+//      ret: value, topic name
+// (run protected, as pushing the value allocates.)
+static int push_message(lua_State* L)
+{
+    retro_script_value const* value = (retro_script_value const*)lua_touserdata(L, 1);
+    bus_topic const* topic = (bus_topic const*)lua_touserdata(L, 2);
+    retro_script_value_push(L, value);
+    lua_pushlstring(L, topic->name, topic->len);
+    return 2;
+}
+
+static void subscription_deliver(bus_topic* topic, bus_subscription* sub)
+{
+    script_state_t* script = sub->script;
+    lua_State* L = script->L;
+    
+    if (sub->dropped)
+    {
+        char msg[256];
+        const int len = snprintf(msg, sizeof(msg), "dropped %u messages to topic \"%.*s\" (subscriber fell behind)", sub->dropped, (int)(topic->len > 128 ? 128 : topic->len), topic->name);
+        retro_script_log_write(script->id, RETRO_SCRIPT_LOG_WARN, msg, len > 0 ? (size_t)len : 0);
+        sub->dropped = 0;
+    }
+    
+    // (only messages already queued; the callback may publish more.)
+    for (uint32_t n = sub->count; n > 0 && sub->count > 0 && !sub->cancelled && !script->disabled; --n)
+    {
+        bus_message* message = sub->ring[sub->head];
+        sub->head = (sub->head + 1) % sub->capacity;
+        sub->count--;
+        
+        lua_rawgeti(L, LUA_REGISTRYINDEX, sub->ref);
+        lua_pushcfunction(L, push_message);
+        lua_pushlightuserdata(L, &message->value);
+        lua_pushlightuserdata(L, topic);
+        int status = lua_pcall(L, 2, 2, 0);
+        if (status == LUA_OK)
+        {
+            status = retro_script_lua_pcall(L, 2, 0);
+        }
+        if (status != LUA_OK)
+        {
+            retro_script_on_uncaught_error(L, status);
+        }
+        lua_settop(L, 0);
+        message_release(message);
+    }
+}
+
+// frees cancelled subscriptions, and topics which no longer have any.
+static void bus_sweep(bus_state* state)
+{
+    bus_topic** topic_entry = &state->topics;
+    while (*topic_entry)
+    {
+        bus_topic* topic = *topic_entry;
+        bus_subscription** entry = &topic->subscriptions;
+        while (*entry)
+        {
+            bus_subscription* sub = *entry;
+            if (sub->cancelled)
+            {
+                *entry = sub->next;
+                subscription_free(sub, true);
+            }
+            else
+            {
+                entry = &sub->next;
+            }
+        }
+        
+        if (topic->subscriptions)
+        {
+            topic_entry = &topic->next;
+        }
+        else
+        {
+            *topic_entry = topic->next;
+            free(topic);
+        }
+    }
+}
+
+void retro_script_bus_deliver()
+{
+    bus_state* state = bus();
+    
+    // (callbacks may subscribe, adding to the end of these lists, but only cancel subscriptions.)
+    for (bus_topic* topic = state->topics; topic; topic = topic->next)
+    {
+        for (bus_subscription* sub = topic->subscriptions; sub; sub = sub->next)
+        {
+            if (sub->count > 0 && !sub->script->observer) subscription_deliver(topic, sub);
+        }
+    }
+    bus_sweep(state);
+}
+
+void retro_script_bus_deliver_to(script_state_t* script)
+{
+    // (observers run in parallel, but each only touches its own subscriptions.)
+    for (bus_topic* topic = bus()->topics; topic; topic = topic->next)
+    {
+        for (bus_subscription* sub = topic->subscriptions; sub; sub = sub->next)
+        {
+            if (sub->script == script && sub->count > 0) subscription_deliver(topic, sub);
+        }
+    }
+}
+
+bool retro_script_bus_pending(script_state_t* script)
+{
+    for (bus_topic* topic = bus()->topics; topic; topic = topic->next)
+    {
+        for (bus_subscription* sub = topic->subscriptions; sub; sub = sub->next)
+        {
+            if (sub->script == script && sub->count > 0 && !sub->cancelled) return true;
+        }
+    }
+    return false;
+}
+
+void retro_script_bus_clear(script_state_t* script)
+{
+    for (bus_topic* topic = bus()->topics; topic; topic = topic->next)
+    {
+        bus_subscription** entry = &topic->subscriptions;
+        while (*entry)
+        {
+            bus_subscription* sub = *entry;
+            if (sub->script == script)
+            {
+                // (a script in the shared lua state must unref; otherwise the state is being discarded.)
+                *entry = sub->next;
+                subscription_free(sub, script->shared.enabled);
+            }
+            else
+            {
+                entry = &sub->next;
+            }
+        }
+    }
+}
+
+void retro_script_bus_transfer(script_state_t* from, script_state_t* to)
+{
+    for (bus_topic* topic = bus()->topics; topic; topic = topic->next)
+    {
+        for (bus_subscription* sub = topic->subscriptions; sub; sub = sub->next)
+        {
+            if (sub->script == from) sub->script = to;
+        }
+    }
+}
+
+// lua args: topic, value
+//      ret: number of subscribers the message was queued for
+int retro_script_luafunc_publish(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.publish");
+    
+    // (observers still running from the frame may be reading their subscriptions.)
+    retro_script_observers_wait();
+    
+    size_t len;
+    const char* name = luaL_checklstring(L, 1, &len);
+    luaL_checkany(L, 2);
+    
+    bus_topic* topic = topic_find(bus(), name, len);
+    if (!topic || !topic->subscriptions)
+    {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+    
+    // the value is copied once, however many subscribers there are.
+    bus_message* message = alloc(bus_message);
+    if (!message) return luaL_error(L, "unable to allocate message");
+    const char* error;
+    if (!retro_script_value_from_lua(L, 2, &message->value, &error))
+    {
+        free(message);
+        if (error) return luaL_argerror(L, 2, error);
+        return luaL_error(L, "unable to allocate message");
+    }
+    
+    // (held here until queued for everyone.)
+    atomic_init(&message->refs, 1);
+    lua_Integer queued = 0;
+    for (bus_subscription* sub = topic->subscriptions; sub; sub = sub->next)
+    {
+        if (sub->cancelled) continue;
+        subscription_enqueue(sub, message);
+        queued++;
+    }
+    message_release(message);
+    
+    lua_pushinteger(L, queued);
+    return 1;
+}
+
+// lua args: topic, callback, [capacity]
+//      ret: subscription id
+int retro_script_luafunc_subscribe(lua_State* L)
+{
+    bus_state* state = bus();
+    retro_script_observer_check(L, "retro.subscribe");
+    retro_script_observers_wait();
+    size_t len;
+    const char* name = luaL_checklstring(L, 1, &len);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    const lua_Integer capacity = luaL_optinteger(L, 3, BUS_DEFAULT_CAPACITY);
+    luaL_argcheck(L, capacity >= 1 && capacity <= BUS_MAX_CAPACITY, 3, "capacity out of range");
+    lua_settop(L, 2);
+    
+    bus_topic* topic = topic_find(state, name, len);
+    if (!topic)
+    {
+        topic = (bus_topic*)malloc(sizeof(bus_topic) + len);
+        if (!topic) return luaL_error(L, "unable to allocate topic");
+        topic->hash = retro_script_fnv1a(name, len);
+        topic->len = len;
+        topic->subscriptions = NULL;
+        memcpy(topic->name, name, len);
+        topic->next = state->topics;
+        state->topics = topic;
+    }
+    
+    bus_subscription* sub = alloc(bus_subscription);
+    bus_message** ring = malloc_array(bus_message*, capacity);
+    if (!sub || !ring)
+    {
+        // (an empty topic is freed on the next sweep.)
+        free(sub);
+        free(ring);
+        return luaL_error(L, "unable to allocate subscription");
+    }
+    
+    memset(sub, 0, sizeof(bus_subscription));
+    sub->id = state->next_id++;
+    sub->script = script_find_lua(L);
+    sub->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    sub->ring = ring;
+    sub->capacity = (uint32_t)capacity;
+    
+    // subscribers are delivered to in the order they subscribed.
+    bus_subscription** entry = &topic->subscriptions;
+    while (*entry) entry = &(*entry)->next;
+    *entry = sub;
+    
+    lua_pushinteger(L, sub->id);
+    return 1;
+}
+
+// lua args: subscription id
+//      ret: true if unsubscribed
+int retro_script_luafunc_unsubscribe(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.unsubscribe");
+    retro_script_observers_wait();
+    const uint32_t id = (uint32_t)luaL_checkinteger(L, 1);
+    script_state_t* script = script_find_lua(L);
+    
+    for (bus_topic* topic = bus()->topics; topic; topic = topic->next)
+    {
+        for (bus_subscription* sub = topic->subscriptions; sub; sub = sub->next)
+        {
+            if (sub->id != id) continue;
+            const bool found = sub->script == script && !sub->cancelled;
+            
+            // freed at the end of the next delivery.
+            if (found) sub->cancelled = true;
+            lua_pushboolean(L, found);
+            return 1;
+        }
+    }
+    lua_pushboolean(L, false);
+    return 1;
+}
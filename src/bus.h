@@ -0,0 +1,32 @@
+#pragma once
+
+/* Messages between scripts: retro.publish, retro.subscribe.
+ * A published value is copied once (see store.h) and queued in a ring buffer
+ * for each subscriber. Queued messages are delivered at the end of the frame
+ * by the retro_run interceptor, or to observers along with their on_run_end callbacks.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+struct lua_State;
+
+// delivers queued messages to all scripts except observers.
+void retro_script_bus_deliver();
+
+// delivers queued messages to the given script. (used for observers.)
+void retro_script_bus_deliver_to(script_state_t*);
+
+// true if the script has messages waiting.
+bool retro_script_bus_pending(script_state_t*);
+
+// removes all subscriptions belonging to the given script.
+void retro_script_bus_clear(script_state_t*);
+
+// gives all subscriptions belonging to one script to another.
+void retro_script_bus_transfer(script_state_t* from, script_state_t* to);
+
+// lua functions
+int retro_script_luafunc_publish(struct lua_State* L);
+int retro_script_luafunc_subscribe(struct lua_State* L);
+int retro_script_luafunc_unsubscribe(struct lua_State* L);
@@ -0,0 +1,131 @@
+#include "context.h"
+#include "script_list.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+
+// how many modules can register state.
+#define MAX_CONTEXT_STATES 24
+
+// each module's state is aligned to this.
+#define CONTEXT_STATE_ALIGN 16
+
+#define ALIGN_UP(n) (((n) + CONTEXT_STATE_ALIGN - 1) & ~(size_t)(CONTEXT_STATE_ALIGN - 1))
+
+static struct
+{
+    size_t offset;
+    context_state_cb_t init;
+    context_state_cb_t destroy;
+} registered[MAX_CONTEXT_STATES];
+static size_t registered_count = 0;
+static size_t states_size = 0;
+
+static _Atomic(retro_script_context_t*) default_context = NULL;
+
+THREAD_LOCAL retro_script_context_t* retro_script_context_bound = NULL;
+
+size_t retro_script_context_register(size_t size, context_state_cb_t init, context_state_cb_t destroy)
+{
+    assert(registered_count < MAX_CONTEXT_STATES);
+    assert(!atomic_load(&default_context));
+    registered[registered_count].offset = states_size;
+    registered[registered_count].init = init;
+    registered[registered_count].destroy = destroy;
+    registered_count++;
+    states_size += ALIGN_UP(size);
+    return registered[registered_count - 1].offset;
+}
+
+static retro_script_context_t* context_create()
+{
+    // the states follow the context, in the same allocation.
+    const size_t header = ALIGN_UP(sizeof(retro_script_context_t));
+    retro_script_context_t* context = (retro_script_context_t*)calloc(1, header + states_size);
+    if (!context) return NULL;
+    context->states = (char*)context + header;
+    for (size_t i = 0; i < registered_count; ++i)
+    {
+        if (registered[i].init) registered[i].init(context->states + registered[i].offset);
+    }
+    return context;
+}
+
+retro_script_context_t* retro_script_context_default()
+{
+    retro_script_context_t* context = atomic_load(&default_context);
+    if (context) return context;
+    
+    // (if another thread gets there first, its context is used instead.)
+    retro_script_context_t* created = context_create();
+    assert(created);
+    if (!atomic_compare_exchange_strong(&default_context, &context, created))
+    {
+        free(created);
+        return context;
+    }
+    return created;
+}
+
+RETRO_SCRIPT_API retro_script_context_t* retro_script_context_create()
+{
+    // (the default context is created first, so registration is known to be complete.)
+    retro_script_context_default();
+    return context_create();
+}
+
+RETRO_SCRIPT_API void retro_script_context_destroy(retro_script_context_t* context)
+{
+    if (!context || context == atomic_load(&default_context)) return;
+    
+    retro_script_context_t* previous = retro_script_context_bound;
+    retro_script_context_bound = context;
+    retro_script_deinit();
+    
+    // (scripts can be loaded without the context ever being initialized.)
+    script_clear_all();
+    for (size_t i = registered_count; i-- > 0;)
+    {
+        if (registered[i].destroy) registered[i].destroy(context->states + registered[i].offset);
+    }
+    retro_script_context_bound = (previous == context) ? NULL : previous;
+    free(context);
+}
+
+RETRO_SCRIPT_API void retro_script_context_make_current(retro_script_context_t* context)
+{
+    retro_script_context_bound = context;
+}
+
+RETRO_SCRIPT_API retro_script_context_t* retro_script_context_get_current()
+{
+    return retro_script_context();
+}
+
+RETRO_SCRIPT_API retro_script_id_t retro_script_context_load_lua(retro_script_context_t* context, const char* path_to_script)
+{
+    retro_script_context_t* previous = retro_script_context_bound;
+    retro_script_context_bound = context;
+    const retro_script_id_t id = retro_script_load_lua(path_to_script);
+    retro_script_context_bound = previous;
+    return id;
+}
+
+RETRO_SCRIPT_API retro_script_id_t retro_script_context_load_lua_special(retro_script_context_t* context, const char* path_to_script, retro_script_setup_lua_t setup)
+{
+    retro_script_context_t* previous = retro_script_context_bound;
+    retro_script_context_bound = context;
+    const retro_script_id_t id = retro_script_load_lua_special(path_to_script, setup);
+    retro_script_context_bound = previous;
+    return id;
+}
+
+RETRO_SCRIPT_API bool retro_script_context_unload(retro_script_context_t* context, retro_script_id_t id)
+{
+    retro_script_context_t* previous = retro_script_context_bound;
+    retro_script_context_bound = context;
+    const bool result = retro_script_unload(id);
+    retro_script_context_bound = previous;
+    return result;
+}
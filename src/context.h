@@ -0,0 +1,41 @@
+#pragma once
+
+/* Each emulator instance has a context, holding the state of every module for that instance.
+ * Modules declare their part of it with CONTEXT_STATE, and reach it through the calling
+ * thread's current context (see retro_script_context_make_current), which is the
+ * default context unless another was made current.
+ */
+
+#include "libretro_script.h"
+#include "util.h"
+
+typedef void (*context_state_cb_t)(void* state);
+
+struct retro_script_context
+{
+    // each module's state, at the offset it was registered at.
+    char* states;
+};
+
+// the context made current on this thread, or NULL.
+extern THREAD_LOCAL retro_script_context_t* retro_script_context_bound;
+
+// returns the default context, creating it if needed.
+retro_script_context_t* retro_script_context_default();
+
+// returns the calling thread's current context.
+static FORCEINLINE retro_script_context_t* retro_script_context()
+{
+    retro_script_context_t* context = retro_script_context_bound;
+    return context ? context : retro_script_context_default();
+}
+
+// reserves size bytes (zeroed, then passed to init) in each context, returning their offset.
+// init and destroy may be NULL. must be called before any context is created.
+size_t retro_script_context_register(size_t size, context_state_cb_t init, context_state_cb_t destroy);
+
+// declares the module's state of the given type, accessed by calling name().
+#define CONTEXT_STATE(type, name, init, destroy) \
+    static size_t name##_offset; \
+    INITIALIZER(_register_##name) { name##_offset = retro_script_context_register(sizeof(type), init, destroy); } \
+    static FORCEINLINE type* name() { return (type*)(retro_script_context()->states + name##_offset); }
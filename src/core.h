@@ -4,8 +4,8 @@
 #include "util.h"
 #include <hcdebug.h>
 
-// TODO: clear these on deinit
-extern struct core_t
+// each context has its own; see context.h
+struct core_t
 {
     // these are set by the front-end
     RETRO_SCRIPT_DECLT(retro_set_environment) retro_set_environment;
@@ -28,19 +28,21 @@ extern struct core_t
         hc_DebuggerIf debugger;
         void* userdata;
     } hc;
-} retro_script_core;
-#define core retro_script_core
+};
+struct core_t* retro_script_core();
+#define core (*retro_script_core())
 
 typedef void (* breakpoint_cb_t)(void* ud, hc_SubscriptionID, hc_Event const*);
 
-extern struct frontend_callbacks_t
+struct frontend_callbacks_t
 {
     retro_environment_t retro_environment;
     retro_input_poll_t retro_input_poll;
     retro_input_state_t retro_input_state;
     breakpoint_cb_t breakpoint_cb;
-} retro_script_callbacks;
-#define frontend_callbacks retro_script_callbacks
+};
+struct frontend_callbacks_t* retro_script_callbacks();
+#define frontend_callbacks (*retro_script_callbacks())
 
 typedef void (*core_init_cb_t)();
 
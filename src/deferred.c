@@ -0,0 +1,138 @@
+#include "deferred.h"
+#include "libretro_script.h"
+#include "script.h"
+#include "script_list.h"
+#include "observer.h"
+#include "context.h"
+#include "util.h"
+
+typedef struct deferred_state
+{
+    uint32_t frame_deadline_usec;
+    
+    // the next deferred callback to run.
+    struct
+    {
+        retro_script_id_t script_id;
+        int index; // 1-based
+    } cursor;
+    
+    // callbacks yet to run for the last frame.
+    int remaining;
+} deferred_state;
+
+static void deferred_state_init(void* state)
+{
+    ((deferred_state*)state)->cursor.index = 1;
+}
+
+CONTEXT_STATE(deferred_state, deferred, deferred_state_init, NULL)
+
+uint64_t retro_script_frame_deadline(uint64_t frame_start)
+{
+    const uint32_t frame_deadline_usec = deferred()->frame_deadline_usec;
+    return frame_deadline_usec ? frame_start + frame_deadline_usec : 0;
+}
+
+bool retro_script_before_deadline(uint64_t deadline)
+{
+    return !deadline || retro_script_time_usec() < deadline;
+}
+
+bool retro_script_frame_within_deadline(uint64_t frame_start)
+{
+    return retro_script_before_deadline(retro_script_frame_deadline(frame_start));
+}
+
+// runs the remaining callbacks, from the cursor, until the deadline.
+static void run_from_cursor(uint64_t deadline, bool at_least_one)
+{
+    deferred_state* state = deferred();
+    int script_count = 0;
+    SCRIPT_ITERATE(script)
+    {
+        script_count++;
+    }
+    
+    script_state_t* script = script_find(state->cursor.script_id);
+    int index = state->cursor.index;
+    if (!script)
+    {
+        script = script_first();
+        index = 1;
+    }
+    
+    bool may_stop = !at_least_one;
+    int skipped = 0; // (a callback may disable its script, leaving fewer to run.)
+    while (script && state->remaining > 0 && skipped <= script_count)
+    {
+        // an observer still running on a worker is passed over, with the rest of its callbacks.
+        // (its lua state cannot be touched, so they are counted from the start of the frame.)
+        if (retro_script_observer_busy(script))
+        {
+            const int passed = script->deferred_count - index + 1;
+            if (passed > 0) state->remaining -= (passed < state->remaining) ? passed : state->remaining;
+            script = script->next ? script->next : script_first();
+            index = 1;
+            skipped++;
+            continue;
+        }
+        
+        if (index > retro_script_cb_count(script, script->refs.on_run_deferred))
+        {
+            script = script->next ? script->next : script_first();
+            index = 1;
+            skipped++;
+            continue;
+        }
+        skipped = 0;
+        
+        // at least one callback runs each frame, so none are starved indefinitely.
+        if (may_stop && !retro_script_before_deadline(deadline))
+        {
+            break;
+        }
+        
+        retro_script_execute_cb_at(script, script->refs.on_run_deferred, index++);
+        may_stop = true;
+        state->remaining--;
+    }
+    if (!script || skipped > script_count) state->remaining = 0;
+    
+    state->cursor.script_id = script ? script->id : 0;
+    state->cursor.index = index;
+}
+
+void retro_script_run_deferred(uint64_t frame_start)
+{
+    deferred_state* state = deferred();
+    state->remaining = 0;
+    if (!state->frame_deadline_usec)
+    {
+        SCRIPT_ITERATE(script)
+        {
+            retro_script_execute_cb(script, script->refs.on_run_deferred);
+        }
+        return;
+    }
+    
+    // each callback runs at most once per frame.
+    SCRIPT_ITERATE(script)
+    {
+        script->deferred_count = retro_script_cb_count(script, script->refs.on_run_deferred);
+        state->remaining += script->deferred_count;
+    }
+    run_from_cursor(retro_script_frame_deadline(frame_start), true);
+}
+
+bool retro_script_run_deferred_idle(uint64_t deadline)
+{
+    deferred_state* state = deferred();
+    if (state->remaining > 0) run_from_cursor(deadline, false);
+    return state->remaining == 0;
+}
+
+RETRO_SCRIPT_API void retro_script_set_frame_deadline(uint32_t usec)
+{
+    deferred()->frame_deadline_usec = usec;
+}
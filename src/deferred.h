@@ -0,0 +1,26 @@
+#pragma once
+
+/* Deferred callbacks (retro.on_run_deferred) run after the frame, for
+ * as long as the frame deadline set by the frontend allows. Callbacks
+ * which do not fit are carried over to the next frame, in round-robin order.
+ */
+
+#include <stdint.h>
+
+#include <stdbool.h>
+
+// frame_start is the time the frame began, from retro_script_time_usec.
+void retro_script_run_deferred(uint64_t frame_start);
+
+// runs the callbacks which the last frame had no time for, until the deadline.
+// returns true if none are left.
+bool retro_script_run_deferred_idle(uint64_t deadline);
+
+// the time by which the frame should end, or 0 if there is no frame deadline.
+uint64_t retro_script_frame_deadline(uint64_t frame_start);
+
+// false if the deadline (from retro_script_time_usec, or 0 for none) has passed.
+bool retro_script_before_deadline(uint64_t deadline);
+
+// false if the frame has run past the frontend's frame deadline.
+bool retro_script_frame_within_deadline(uint64_t frame_start);
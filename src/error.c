@@ -2,8 +2,9 @@
 #include "error.h"
 #include "util.h"
 
-static int error_managed = 0;
-static const char* error_text = NULL;
+// each thread has its own error, so instances on different threads don't see each other's.
+static THREAD_LOCAL int error_managed = 0;
+static THREAD_LOCAL const char* error_text = NULL;
 
 void retro_script_clear_error()
 {
@@ -24,6 +25,7 @@ void retro_script_set_error(const char* s)
     }
     else
     {
+        retro_script_clear_error();
         error_text = retro_script_strdup(s);
         if (error_text)
         {
@@ -0,0 +1,122 @@
+#include "error_filter.h"
+#include "util.h"
+
+#include <ctype.h>
+
+// each script keeps at most this many distinct errors; more are reported in full.
+#define ERROR_FILTER_MAX_RECORDS 32
+
+// summaries are truncated to this length.
+#define ERROR_FILTER_MAX_SUMMARY 256
+
+static bool enabled = true;
+static uint32_t max_consecutive = 0;
+
+bool retro_script_error_filter_enabled()
+{
+    return enabled;
+}
+
+uint32_t retro_script_error_filter_max_consecutive()
+{
+    return max_consecutive;
+}
+
+// length of the message's first line.
+static size_t first_line_length(const char* msg)
+{
+    const char* end = strchr(msg, '\n');
+    return end ? (size_t)(end - msg) : strlen(msg);
+}
+
+// length of the "chunk:line:" prefix lua gives error messages,
+// or of the first line if there is none.
+static size_t location_length(const char* msg)
+{
+    const size_t len = first_line_length(msg);
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (msg[i] != ':' || !isdigit((unsigned char)msg[i + 1])) continue;
+        size_t j = i + 1;
+        while (j < len && isdigit((unsigned char)msg[j])) ++j;
+        if (j < len && msg[j] == ':') return j + 1;
+    }
+    return len;
+}
+
+retro_script_error_record* retro_script_error_filter_find(script_state_t* script, const char* msg)
+{
+    const uint32_t hash = retro_script_fnv1a(msg, location_length(msg));
+    for (retro_script_error_record* record = script->errors.records; record; record = record->next)
+    {
+        if (record->callback == script->errors.current && record->hash == hash)
+        {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+retro_script_error_record* retro_script_error_filter_add(script_state_t* script, const char* msg)
+{
+    retro_script_error_record* record = retro_script_error_filter_find(script, msg);
+    if (!record)
+    {
+        if (script->errors.record_count >= ERROR_FILTER_MAX_RECORDS) return NULL;
+        record = alloc(retro_script_error_record);
+        if (!record) return NULL;
+        const size_t len = first_line_length(msg);
+        record->summary = retro_script_strndup(msg, len < ERROR_FILTER_MAX_SUMMARY ? len : ERROR_FILTER_MAX_SUMMARY);
+        if (!record->summary)
+        {
+            free(record);
+            return NULL;
+        }
+        record->callback = script->errors.current;
+        record->hash = retro_script_fnv1a(msg, location_length(msg));
+        record->count = 0;
+        record->consecutive = 0;
+        record->next = script->errors.records;
+        script->errors.records = record;
+        script->errors.record_count++;
+    }
+    
+    record->count++;
+    if (record->consecutive++ == 0) script->errors.failing++;
+    return record;
+}
+
+void retro_script_error_filter_succeeded(script_state_t* script)
+{
+    // (most scripts have no failing callbacks, so this is usually skipped.)
+    if (script->errors.failing == 0) return;
+    for (retro_script_error_record* record = script->errors.records; record; record = record->next)
+    {
+        if (record->callback == script->errors.current && record->consecutive > 0)
+        {
+            record->consecutive = 0;
+            script->errors.failing--;
+        }
+    }
+}
+
+void retro_script_error_filter_clear(script_state_t* script)
+{
+    retro_script_error_record* record = script->errors.records;
+    while (record)
+    {
+        retro_script_error_record* next = record->next;
+        free(record->summary);
+        free(record);
+        record = next;
+    }
+    script->errors.records = NULL;
+    script->errors.record_count = 0;
+    script->errors.failing = 0;
+}
+
+RETRO_SCRIPT_API void retro_script_set_error_policy(bool deduplicate, uint32_t max_consecutive_errors)
+{
+    enabled = deduplicate;
+    max_consecutive = max_consecutive_errors;
+}
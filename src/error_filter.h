@@ -0,0 +1,42 @@
+#pragma once
+
+/* Deduplication of uncaught errors.
+ * Errors are recorded per script, keyed on the callback which raised them
+ * and the location in the error message, so that a callback failing every
+ * frame is reported (with a stack trace) once, and then only summarized.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+typedef struct retro_script_error_record
+{
+    // function or coroutine the error came from.
+    const void* callback;
+    uint32_t hash;
+    
+    // first line of the first error message.
+    char* summary;
+    
+    uint32_t count;
+    uint32_t consecutive;
+    struct retro_script_error_record* next;
+} retro_script_error_record;
+
+bool retro_script_error_filter_enabled();
+
+// after this many consecutive errors, a callback is disabled. 0 means never.
+uint32_t retro_script_error_filter_max_consecutive();
+
+// returns the record for the given error from the script's current callback,
+// or NULL if it has not occurred before.
+retro_script_error_record* retro_script_error_filter_find(script_state_t*, const char* msg);
+
+// counts an occurrence of the given error from the script's current callback.
+// returns NULL if the error could not be recorded (e.g. too many distinct errors).
+retro_script_error_record* retro_script_error_filter_add(script_state_t*, const char* msg);
+
+// resets the consecutive error counts for the script's current callback.
+void retro_script_error_filter_succeeded(script_state_t*);
+
+void retro_script_error_filter_clear(script_state_t*);
@@ -0,0 +1,212 @@
+#include "gc.h"
+#include "script_list.h"
+#include "shared.h"
+#include "observer.h"
+#include "trace.h"
+#include "deferred.h"
+#include "context.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+
+#include <limits.h>
+
+// lua's defaults (LUAI_GCPAUSE, LUAI_GENMINORMUL, LUAI_GCSTEPSIZE)
+#define GC_PAUSE 200
+#define GC_GENMINORMUL 20
+#define GC_DEFAULT_STEPSIZE_LOG2 13
+
+typedef struct gc_state
+{
+    retro_script_gc_mode_t mode;
+    bool generational;
+    int stepsize_log2;
+    uint32_t budget_usec;
+    
+    // script id to resume stepping from, so that no script is starved
+    // when the budget runs out.
+    retro_script_id_t cursor;
+} gc_state;
+
+static void gc_state_init(void* state)
+{
+    ((gc_state*)state)->mode = RETRO_SCRIPT_GC_AUTO;
+    ((gc_state*)state)->stepsize_log2 = GC_DEFAULT_STEPSIZE_LOG2;
+}
+
+CONTEXT_STATE(gc_state, gc, gc_state_init, NULL)
+
+static FORCEINLINE size_t gc_count_kb(lua_State* L)
+{
+    return lua_gc(L, LUA_GCCOUNT);
+}
+
+// memory usage (in KiB) at which the next collection should begin.
+static size_t gc_threshold_kb(size_t count_kb)
+{
+    return (count_kb / 100) * (gc()->generational ? 100 + GC_GENMINORMUL : GC_PAUSE) + 1;
+}
+
+void retro_script_gc_setup(script_state_t* script)
+{
+    lua_State* L = script->L;
+    if (gc()->generational)
+    {
+        lua_gc(L, LUA_GCGEN, 0, 0);
+    }
+    else
+    {
+        lua_gc(L, LUA_GCINC, 0, 0, gc()->stepsize_log2);
+    }
+    
+    if (gc()->mode == RETRO_SCRIPT_GC_FRAME)
+    {
+        lua_gc(L, LUA_GCSTOP);
+    }
+    else
+    {
+        lua_gc(L, LUA_GCRESTART);
+    }
+    
+    script->gc.in_cycle = false;
+    script->gc.threshold_kb = gc_threshold_kb(gc_count_kb(L));
+}
+
+// performs one bounded step on the given script.
+// returns false if the script has no more gc work to do this frame.
+static bool gc_step(script_state_t* script)
+{
+    lua_State* L = script->L;
+    if (!script->gc.in_cycle)
+    {
+        const size_t count_kb = gc_count_kb(L);
+        if (count_kb < script->gc.threshold_kb) return false;
+        script->gc.in_cycle = true;
+        script->gc.stepped_kb = count_kb;
+    }
+    
+    // incremental: a 'basic' step, of size set by LUA_GCINC, plus work for whatever the
+    // script allocated since its last step, so that the collector keeps up with it.
+    // generational: one young collection, or a major one if enough memory has
+    // accumulated. (the step needs positive debt for lua to consider a major collection.)
+    TRACE_BEGIN("gc_step", "script", script->id);
+    bool cycle_complete = true;
+    if (gc()->generational)
+    {
+        lua_gc(L, LUA_GCSTEP, 1);
+    }
+    else
+    {
+        const size_t count_kb = gc_count_kb(L);
+        const size_t debt_kb = (count_kb > script->gc.stepped_kb) ? count_kb - script->gc.stepped_kb : 0;
+        cycle_complete = lua_gc(L, LUA_GCSTEP, 0);
+        if (!cycle_complete && debt_kb) cycle_complete = lua_gc(L, LUA_GCSTEP, debt_kb > INT_MAX ? INT_MAX : (int)debt_kb);
+        script->gc.stepped_kb = gc_count_kb(L);
+    }
+    TRACE_END("gc_step");
+    if (cycle_complete)
+    {
+        script->gc.in_cycle = false;
+        script->gc.threshold_kb = gc_threshold_kb(gc_count_kb(L));
+        return false;
+    }
+    return true;
+}
+
+// steps scripts round-robin, from the cursor, until none has work left or the deadline passes.
+// if once, each script gets at most one step. returns false if work is left.
+static bool gc_steps(uint64_t deadline, bool once, bool observers)
+{
+    gc_state* state = gc();
+    bool work_remaining = true;
+    bool passed_over = false;
+    
+    while (work_remaining)
+    {
+        work_remaining = false;
+        
+        // scripts in the shared lua state are collected together, through the host.
+        script_state_t* host = retro_script_shared_host();
+        if (host) work_remaining |= gc_step(host);
+        
+        // round-robin, beginning at the cursor.
+        script_state_t* first = script_find(state->cursor);
+        if (!first) first = script_first();
+        script_state_t* script = first;
+        while (script)
+        {
+            if (observers && retro_script_observer_busy(script))
+            {
+                // (still running on a worker; its step there may not have been its last.)
+                passed_over = true;
+            }
+            else if (!script->shared.enabled && (observers || !script->observer))
+            {
+                work_remaining |= gc_step(script);
+            }
+            
+            script = script->next ? script->next : script_first();
+            if (!retro_script_before_deadline(deadline))
+            {
+                state->cursor = script->id;
+                return false;
+            }
+            if (script == first) break;
+        }
+        
+        if (once) break;
+    }
+    return !work_remaining && !passed_over;
+}
+
+void retro_script_gc_frame_step()
+{
+    gc_state* state = gc();
+    if (state->mode != RETRO_SCRIPT_GC_FRAME) return;
+    
+    // without a budget, each script gets one step per frame.
+    const uint64_t deadline = state->budget_usec ? retro_script_time_usec() + state->budget_usec : 0;
+    gc_steps(deadline, !state->budget_usec, false);
+}
+
+bool retro_script_gc_idle(uint64_t deadline)
+{
+    // (observers which are done with their frame are collected here too.)
+    if (gc()->mode == RETRO_SCRIPT_GC_FRAME) return gc_steps(deadline, false, true);
+    
+    // in auto mode, scripts pay off some allocation debt now, rather than during a callback.
+    script_state_t* host = retro_script_shared_host();
+    if (host) lua_gc(host->L, LUA_GCSTEP, 0);
+    SCRIPT_ITERATE(script)
+    {
+        if (!retro_script_before_deadline(deadline)) return false;
+        if (!script->shared.enabled && !retro_script_observer_busy(script)) lua_gc(script->L, LUA_GCSTEP, 0);
+    }
+    return true;
+}
+
+void retro_script_gc_observer_step(script_state_t* script)
+{
+    if (gc()->mode == RETRO_SCRIPT_GC_FRAME) gc_step(script);
+}
+
+RETRO_SCRIPT_API void retro_script_set_gc_mode(retro_script_gc_mode_t mode, bool generational, uint32_t step_kb, uint32_t budget_usec)
+{
+    retro_script_observers_wait();
+    gc_state* state = gc();
+    state->mode = mode;
+    state->generational = generational;
+    state->budget_usec = budget_usec;
+    state->stepsize_log2 = GC_DEFAULT_STEPSIZE_LOG2;
+    if (step_kb)
+    {
+        state->stepsize_log2 = 10;
+        while (((uint64_t)1 << state->stepsize_log2) < (uint64_t)step_kb * 1024) state->stepsize_log2++;
+    }
+    
+    SCRIPT_ITERATE(script)
+    {
+        if (!script->shared.enabled) retro_script_gc_setup(script);
+    }
+    if (retro_script_shared_host()) retro_script_gc_setup(retro_script_shared_host());
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+/* Scheduling of lua garbage collection.
+ * In frame mode, automatic collection is stopped for every script and
+ * the collector is instead stepped between frames, within a time budget
+ * shared by all scripts.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+// applies the current gc mode to the given script.
+void retro_script_gc_setup(script_state_t*);
+
+// runs the per-frame gc steps. does nothing unless in frame mode.
+// observer scripts are skipped; see retro_script_gc_observer_step.
+void retro_script_gc_frame_step();
+
+// runs gc steps between frames, for every script, until the deadline (from retro_script_time_usec).
+// returns false if the deadline passed with work left.
+bool retro_script_gc_idle(uint64_t deadline);
+
+// runs an observer script's gc step for the frame, on the thread running the observer.
+// does nothing unless in frame mode.
+void retro_script_gc_observer_step(script_state_t*);
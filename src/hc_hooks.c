@@ -1,6 +1,9 @@
 #include "hc_hooks.h"
 #include "core.h"
 #include "hashmap.h"
+#include "context.h"
+#include "trace.h"
+#include "probes.h"
 
 #include <hcdebug.h>
 
@@ -10,30 +13,39 @@ typedef struct breakpoint_entry
     retro_script_breakpoint_cb cb;
 } breakpoint_entry;
 
-static struct retro_script_hashmap* breakpoint_hashmap = NULL;
+typedef struct hc_hooks_state
+{
+    struct retro_script_hashmap* breakpoint_hashmap;
+} hc_hooks_state;
+
+CONTEXT_STATE(hc_hooks_state, hooks, NULL, NULL)
 
 ON_INIT()
 {
-    if (breakpoint_hashmap) retro_script_hashmap_destroy(breakpoint_hashmap);
-    breakpoint_hashmap = retro_script_hashmap_create(sizeof(breakpoint_entry));
+    if (hooks()->breakpoint_hashmap) retro_script_hashmap_destroy(hooks()->breakpoint_hashmap);
+    hooks()->breakpoint_hashmap = retro_script_hashmap_create(sizeof(breakpoint_entry));
 }
 
 // clear all scripts when a core is unloaded
 ON_DEINIT()
 {
-    if (breakpoint_hashmap) retro_script_hashmap_destroy(breakpoint_hashmap);
+    if (hooks()->breakpoint_hashmap) retro_script_hashmap_destroy(hooks()->breakpoint_hashmap);
+    hooks()->breakpoint_hashmap = NULL;
 }
 
 static void on_breakpoint(void* ud, hc_SubscriptionID id, hc_Event const* event)
 {
     // check if this is one of ours...
     breakpoint_entry* entry = (breakpoint_entry*)(
-        retro_script_hashmap_get(breakpoint_hashmap, id)
+        retro_script_hashmap_get(hooks()->breakpoint_hashmap, id)
     );
     
     if (entry)
     {
+        PROBE1(breakpoint, id);
+        TRACE_BEGIN("breakpoint", "id", (uint32_t)id);
         entry->cb(entry->userdata, id, event);
+        TRACE_END("breakpoint");
     }
     
     // otherwise, forward breakpoint callback to frontend
@@ -49,7 +61,7 @@ int retro_script_hc_register_breakpoint(retro_script_hc_breakpoint_userdata cons
     if (!retro_script_hc_get_debugger()) return 1;
     
     breakpoint_entry* entry = (breakpoint_entry*)(
-        retro_script_hashmap_add(breakpoint_hashmap, breakpoint_id)
+        retro_script_hashmap_add(hooks()->breakpoint_hashmap, breakpoint_id)
     );
     
     if (!entry) return 1;
@@ -61,7 +73,23 @@ int retro_script_hc_register_breakpoint(retro_script_hc_breakpoint_userdata cons
 int retro_script_hc_unregister_breakpoint(hc_SubscriptionID breakpoint_id)
 {
     if (!retro_script_hc_get_debugger()) return 1;
-    return !retro_script_hashmap_remove(breakpoint_hashmap, breakpoint_id);
+    return !retro_script_hashmap_remove(hooks()->breakpoint_hashmap, breakpoint_id);
+}
+
+static int unregister_if_owned(size_t id, void* data, void* ud)
+{
+    breakpoint_entry* entry = (breakpoint_entry*)data;
+    if (entry->userdata.values[0].ptr != ud) return 0;
+    
+    hc_DebuggerIf* debugger = retro_script_hc_get_debugger();
+    if (debugger->v1.unsubscribe) debugger->v1.unsubscribe((hc_SubscriptionID)id);
+    return 1;
+}
+
+void retro_script_hc_unregister_breakpoints_for(void const* ptr)
+{
+    if (!hooks()->breakpoint_hashmap || !retro_script_hc_get_debugger()) return;
+    retro_script_hashmap_foreach(hooks()->breakpoint_hashmap, unregister_if_owned, (void*)ptr);
 }
 
 static void init_debugger(hc_DebuggerIf* debugger)
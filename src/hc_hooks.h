@@ -22,4 +22,7 @@ typedef struct retro_script_hc_breakpoint_userdata
 
 typedef void (*retro_script_breakpoint_cb)(retro_script_hc_breakpoint_userdata, hc_SubscriptionID breakpoint_id, hc_Event const*);
 int retro_script_hc_register_breakpoint(retro_script_hc_breakpoint_userdata const*, hc_SubscriptionID breakpoint_id, retro_script_breakpoint_cb); // returns 1 if failure
-int retro_script_hc_unregister_breakpoint(hc_SubscriptionID breakpoint_id); // returns 1 if failure
\ No newline at end of file
+int retro_script_hc_unregister_breakpoint(hc_SubscriptionID breakpoint_id); // returns 1 if failure
+
+// unsubscribes and unregisters all breakpoints whose first userdata slot is ptr.
+void retro_script_hc_unregister_breakpoints_for(void const* ptr);
\ No newline at end of file
@@ -1,9 +1,11 @@
 #include "hc_luafuncs.h"
 #include "hc_hooks.h"
-#include "hashmap.h"
 #include "core.h"
 #include "hc_registers.h"
 #include "script.h"
+#include "script_list.h"
+#include "observer.h"
+#include "stats.h"
 
 #include <libretro.h>
 #include <hcdebug.h>
@@ -17,43 +19,28 @@
 
 #define nargs(L) (lua_gettop(L))
 
-// caches tables representing hc objects like cpus and memory regions
-// TODO: this should be per-script.
-static struct retro_script_hashmap* lua_table_cache = NULL;
-
-ON_INIT()
-{
-    if (lua_table_cache) retro_script_hashmap_destroy(lua_table_cache);
-    lua_table_cache = retro_script_hashmap_create(sizeof(lua_Integer));
-}
-
-ON_DEINIT()
-{
-    if (lua_table_cache) retro_script_hashmap_destroy(lua_table_cache);
-}
+// registry field caching tables representing hc objects like cpus and memory regions,
+// keyed by light userdata.
+#define LUA_TABLE_CACHE "retro_script.hc_tables"
 
 // retrieves a unique persistent lua table for the given pointer
 // returns 0 if table already existed.
 static bool lua_table_for_data(lua_State* L, void const* ptr)
 {
-    uintptr_t v = (uintptr_t)ptr;
-    lua_Integer* refptr = retro_script_hashmap_get(lua_table_cache, v);
-    if (refptr == NULL)
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_TABLE_CACHE);
+    if (lua_rawgetp(L, -1, ptr) == LUA_TNIL)
     {
-        // add a hashmap entry
-        refptr = retro_script_hashmap_add(lua_table_cache, v);
-        
         // create lua table. Duplicate it so a copy stays on the stack afterward.
+        lua_pop(L, 1);
         lua_newtable(L);
         lua_pushvalue(L, -1);
-        
-        // set the hashmap entry to a ref for this table.
-        *refptr = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_rawsetp(L, -3, ptr);
+        lua_remove(L, -2);
         return 1;
     }
     else
     {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, *refptr);
+        lua_remove(L, -2);
         return 0;
     }
 }
@@ -204,14 +191,21 @@ DEFINE_HC_MEMORY_ACCESS(double, number);
 // returns breakpoint id or -1
 static hc_SubscriptionID breakpoint_register(lua_State* L, hc_Subscription const* s, retro_script_breakpoint_cb cb)
 {
+    retro_script_observer_check(L, "setting breakpoints");
+    
+    // (NULL if the lua state was not created for a script, e.g. the shared host.)
+    const script_state_t* script = script_find_lua(L);
+    if (!script) luaL_error(L, "breakpoints can only be set by a script");
+    
     lua_pushvalue(L, -1);
     uintptr_t ref = luaL_ref(L, LUA_REGISTRYINDEX);
     
     const hc_SubscriptionID id = debugger->v1.subscribe(s);
     if (id < 0) return -1;
     
+    // (L may be a coroutine, which could be collected before the breakpoint fires.)
     retro_script_hc_breakpoint_userdata u;
-    u.values[0].ptr = L;
+    u.values[0].ptr = script->L;
     u.values[1].u64 = ref;
     retro_script_hc_register_breakpoint(&u, id, cb);
     
@@ -219,13 +213,20 @@ static hc_SubscriptionID breakpoint_register(lua_State* L, hc_Subscription const
     return id;
 }
 
+// calls the function with the given ref, passing the argc values on top of the stack.
 static void pcall_function_from_ref(lua_State* L, lua_Integer ref, const int argc, const int retc)
 {
-    const int top = lua_gettop(L);
+    const int top = lua_gettop(L) - argc;
+    // (NULL if the lua state was not created for a script.)
+    script_state_t* script = script_find_lua(L);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-    if (lua_isfunction(L, -1))
+    if (lua_isfunction(L, -1) && !(script && script->disabled))
     {
+        // (the function goes below its arguments.)
+        lua_rotate(L, -argc-1, 1);
+        const uint64_t start = retro_script_time_usec();
         int result = retro_script_lua_pcall(L, argc, retc);
+        if (script) retro_script_stats_callback(script, RETRO_SCRIPT_CALLBACK_BREAKPOINT, start, result != LUA_OK);
         retro_script_on_uncaught_error(L, result);
         if (result != LUA_OK) goto return_nils;
     }
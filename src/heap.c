@@ -0,0 +1,287 @@
+#include "heap.h"
+#include "script.h"
+#include "script_list.h"
+#include "observer.h"
+#include "context.h"
+#include "util.h"
+
+#include <stdint.h>
+
+// blocks are rounded up to a multiple of this.
+#define HEAP_GRANULARITY 16
+
+// blocks larger than this are allocated with malloc directly.
+#define HEAP_MAX_SMALL_SIZE 512
+
+#define HEAP_CLASS_COUNT (HEAP_MAX_SMALL_SIZE / HEAP_GRANULARITY)
+
+// size of each arena chunk small blocks are carved out of.
+#define HEAP_CHUNK_SIZE (16 * 1024)
+
+// keeps chunk data aligned to HEAP_GRANULARITY.
+#define HEAP_CHUNK_HEADER_SIZE HEAP_GRANULARITY
+
+// large blocks are allocated at least this big, so that any of them can become
+// a chunk holding one small block; see shrink_in_place.
+#define HEAP_MIN_LARGE_SIZE (HEAP_CHUNK_HEADER_SIZE + HEAP_MAX_SMALL_SIZE)
+
+typedef struct heap_chunk
+{
+    struct heap_chunk* next;
+} heap_chunk;
+
+typedef struct heap_block
+{
+    struct heap_block* next;
+} heap_block;
+
+struct retro_script_heap
+{
+    size_t limit;
+    size_t live;
+    size_t peak;
+    uint64_t alloc_count;
+    uint64_t realloc_count;
+    uint64_t free_count;
+    uint64_t failed_count;
+
+    // free lists for each size class.
+    heap_block* free[HEAP_CLASS_COUNT];
+
+    // all chunks, so they can be released together.
+    heap_chunk* chunks;
+
+    // unused tail of the most recent chunk.
+    char* bump;
+    char* bump_end;
+
+    // see retro_script_heap_owner
+    struct script_state* owner;
+};
+
+typedef struct heap_state
+{
+    size_t default_limit;
+} heap_state;
+
+CONTEXT_STATE(heap_state, heaps, NULL, NULL)
+
+// returns the size class for the given size, or -1 if not a small size.
+static FORCEINLINE int size_class(size_t size)
+{
+    if (size == 0 || size > HEAP_MAX_SMALL_SIZE) return -1;
+    return (int)((size - 1) / HEAP_GRANULARITY);
+}
+
+static FORCEINLINE size_t class_size(int c)
+{
+    return (size_t)(c + 1) * HEAP_GRANULARITY;
+}
+
+static void* small_alloc(retro_script_heap_t* heap, int c)
+{
+    // reuse a free block if there is one
+    heap_block* block = heap->free[c];
+    if (block)
+    {
+        heap->free[c] = block->next;
+        return block;
+    }
+
+    // otherwise carve from the current chunk
+    const size_t size = class_size(c);
+    if (heap->bump + size > heap->bump_end)
+    {
+        // the unused tail of the old chunk is abandoned (at most HEAP_MAX_SMALL_SIZE bytes).
+        heap_chunk* chunk = (heap_chunk*)malloc(HEAP_CHUNK_SIZE);
+        if (!chunk) return NULL;
+        chunk->next = heap->chunks;
+        heap->chunks = chunk;
+        heap->bump = (char*)chunk + HEAP_CHUNK_HEADER_SIZE;
+        heap->bump_end = (char*)chunk + HEAP_CHUNK_SIZE;
+    }
+
+    void* p = heap->bump;
+    heap->bump += size;
+    return p;
+}
+
+static FORCEINLINE void small_free(retro_script_heap_t* heap, int c, void* ptr)
+{
+    heap_block* block = (heap_block*)ptr;
+    block->next = heap->free[c];
+    heap->free[c] = block;
+}
+
+static FORCEINLINE size_t large_size(size_t size)
+{
+    return (size < HEAP_MIN_LARGE_SIZE) ? HEAP_MIN_LARGE_SIZE : size;
+}
+
+// shrinks a block to a small size without allocating, for when there is no memory
+// for a new block. (lua assumes shrinking never fails.)
+static void* shrink_in_place(retro_script_heap_t* heap, void* ptr, int oc, size_t nsize)
+{
+    // a small block keeps its larger class; its tail is unused until it is freed.
+    if (oc >= 0) return ptr;
+
+    // a large block becomes a chunk of its own, holding just the small block.
+    char* out = (char*)ptr + HEAP_CHUNK_HEADER_SIZE;
+    memmove(out, ptr, nsize);
+    heap_chunk* chunk = (heap_chunk*)ptr;
+    chunk->next = heap->chunks;
+    heap->chunks = chunk;
+    return out;
+}
+
+retro_script_heap_t* retro_script_heap_create(size_t limit)
+{
+    retro_script_heap_t* heap = alloc(retro_script_heap_t);
+    if (!heap) return NULL;
+    memset(heap, 0, sizeof(*heap));
+    heap->limit = limit;
+    return heap;
+}
+
+void retro_script_heap_destroy(retro_script_heap_t* heap)
+{
+    if (!heap) return;
+    heap_chunk* chunk = heap->chunks;
+    while (chunk)
+    {
+        heap_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(heap);
+}
+
+struct script_state** retro_script_heap_owner(retro_script_heap_t* heap)
+{
+    return &heap->owner;
+}
+
+void retro_script_heap_set_limit(retro_script_heap_t* heap, size_t limit)
+{
+    heap->limit = limit;
+}
+
+void retro_script_heap_get_stats(retro_script_heap_t const* heap, struct retro_script_memory_stats* stats)
+{
+    stats->live_bytes = heap->live;
+    stats->peak_bytes = heap->peak;
+    stats->limit_bytes = heap->limit;
+    stats->alloc_count = heap->alloc_count;
+    stats->realloc_count = heap->realloc_count;
+    stats->free_count = heap->free_count;
+    stats->failed_count = heap->failed_count;
+}
+
+void retro_script_heap_reset_stats(retro_script_heap_t* heap)
+{
+    heap->peak = heap->live;
+    heap->alloc_count = 0;
+    heap->realloc_count = 0;
+    heap->free_count = 0;
+    heap->failed_count = 0;
+}
+
+size_t retro_script_heap_get_default_limit()
+{
+    return heaps()->default_limit;
+}
+
+void* retro_script_heap_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    retro_script_heap_t* heap = (retro_script_heap_t*)ud;
+
+    // if ptr is NULL, osize encodes the type of object being allocated.
+    if (!ptr) osize = 0;
+
+    if (nsize == 0)
+    {
+        if (ptr)
+        {
+            const int c = size_class(osize);
+            if (c >= 0) small_free(heap, c, ptr);
+            else free(ptr);
+            heap->live -= osize;
+            heap->free_count++;
+        }
+        return NULL;
+    }
+
+    // enforce limit. (lua assumes shrinking never fails, so only growth is checked.)
+    if (nsize > osize && heap->limit && heap->live + (nsize - osize) > heap->limit)
+    {
+        heap->failed_count++;
+        return NULL;
+    }
+
+    const int oc = size_class(osize);
+    const int nc = size_class(nsize);
+    void* out;
+
+    if (ptr && oc == nc && oc >= 0)
+    {
+        // block already has room.
+        out = ptr;
+    }
+    else if (nc < 0 && (!ptr || oc < 0))
+    {
+        // large to large. (if shrinking fails, the block is still big enough.)
+        out = realloc(ptr, large_size(nsize));
+        if (!out)
+        {
+            if (nsize >= osize) return NULL;
+            out = ptr;
+        }
+    }
+    else
+    {
+        // moving between size classes, or between small and large.
+        out = (nc >= 0) ? small_alloc(heap, nc) : malloc(large_size(nsize));
+        if (!out)
+        {
+            if (!ptr || nsize >= osize) return NULL;
+            out = shrink_in_place(heap, ptr, oc, nsize);
+        }
+        else if (ptr)
+        {
+            memcpy(out, ptr, (osize < nsize) ? osize : nsize);
+            if (oc >= 0) small_free(heap, oc, ptr);
+            else free(ptr);
+        }
+    }
+
+    if (ptr) heap->realloc_count++;
+    else heap->alloc_count++;
+    heap->live = heap->live - osize + nsize;
+    if (heap->live > heap->peak) heap->peak = heap->live;
+    return out;
+}
+
+RETRO_SCRIPT_API void retro_script_set_memory_limit(retro_script_id_t id, size_t limit)
+{
+    if (id == 0)
+    {
+        heaps()->default_limit = limit;
+        return;
+    }
+
+    retro_script_observers_wait();
+    script_state_t* script = script_find(id);
+    if (script && script->heap)
+    {
+        retro_script_heap_set_limit(script->heap, limit);
+    }
+}
+
+RETRO_SCRIPT_API bool retro_script_get_memory_stats(retro_script_id_t id, struct retro_script_memory_stats* stats)
+{
+    retro_script_observers_wait();
+    script_state_t* script = script_find(id);
+    if (!script || !script->heap || !stats) return false;
+    retro_script_heap_get_stats(script->heap, stats);
+    return true;
+}
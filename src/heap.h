@@ -0,0 +1,38 @@
+#pragma once
+
+/* A per-script allocator for lua.
+ * Small blocks are carved out of arena chunks and recycled through
+ * size-class free lists; larger blocks fall through to malloc.
+ * All chunks are released at once when the heap is destroyed.
+ */
+
+#include "libretro_script.h"
+
+#include <stddef.h>
+
+typedef struct retro_script_heap retro_script_heap_t;
+struct script_state;
+
+// returns NULL if not enough memory.
+// limit is in bytes; 0 means unlimited.
+retro_script_heap_t* retro_script_heap_create(size_t limit);
+
+// frees all memory owned by the heap.
+// the lua state using this heap must be closed first.
+void retro_script_heap_destroy(retro_script_heap_t*);
+
+void retro_script_heap_set_limit(retro_script_heap_t*, size_t limit);
+void retro_script_heap_get_stats(retro_script_heap_t const*, struct retro_script_memory_stats*);
+
+// resets counters and the peak, e.g. when the heap is reused for another script.
+void retro_script_heap_reset_stats(retro_script_heap_t*);
+
+// the slot holding the script whose lua state uses the heap (or NULL), which the
+// state's threads find it through; see script_find_lua.
+struct script_state** retro_script_heap_owner(retro_script_heap_t*);
+
+// the default limit given to heaps of newly-loaded scripts.
+size_t retro_script_heap_get_default_limit();
+
+// lua_Alloc implementation; ud must be a retro_script_heap_t*.
+void* retro_script_heap_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
@@ -0,0 +1,59 @@
+#include "hook.h"
+#include "watchdog.h"
+#include "profiler.h"
+#include "jobs.h"
+#include "script_list.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+
+static void dispatch_hook(lua_State* L, lua_Debug* ar)
+{
+    script_state_t* script = script_find_lua(L);
+    if (!script) return;
+    
+    if (ar->event == LUA_HOOKLINE)
+    {
+        retro_script_profiler_line(script, L, ar);
+        return;
+    }
+    
+    const int count = lua_gethookcount(L);
+    retro_script_profiler_count(script, L, count);
+    
+    // (a job which is preempted has kept within its budget.)
+    if (retro_script_jobs_count(L, count)) return;
+    
+    // (last, as this may raise an error.)
+    retro_script_watchdog_count(script, L, count);
+}
+
+// the smaller of two hook counts, where 0 means not needed.
+static uint32_t min_count(uint32_t a, uint32_t b)
+{
+    return (b && (!a || b < a)) ? b : a;
+}
+
+void retro_script_hook_install(script_state_t* script, lua_State* L)
+{
+    uint32_t count = retro_script_watchdog_hook_count(script);
+    count = min_count(count, retro_script_profiler_hook_count(script));
+    count = min_count(count, retro_script_jobs_hook_count(L));
+    
+    int mask = count ? LUA_MASKCOUNT : 0;
+    if (retro_script_profiler_hook_lines(script)) mask |= LUA_MASKLINE;
+    
+    if (mask == 0)
+    {
+        if (lua_gethook(L) == dispatch_hook) lua_sethook(L, NULL, 0, 0);
+    }
+    else if (lua_gethook(L) != dispatch_hook || lua_gethookmask(L) != mask || lua_gethookcount(L) != (int)count)
+    {
+        lua_sethook(L, dispatch_hook, mask, (int)count);
+    }
+}
+
+bool retro_script_hook_counting(lua_State* L)
+{
+    return lua_gethook(L) == dispatch_hook && (lua_gethookmask(L) & LUA_MASKCOUNT);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+/* Lua has only one hook per thread, so the watchdog, profiler and job preemption share it.
+ * The hook runs as often as the most demanding of them needs, and each is told
+ * how many instructions have run since it was last called.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+struct lua_State;
+
+// installs (or removes) the hook on L, a thread belonging to the script,
+// according to what the watchdog, profiler and jobs currently need.
+void retro_script_hook_install(script_state_t*, struct lua_State* L);
+
+// true if L has the hook installed with a count.
+bool retro_script_hook_counting(struct lua_State* L);
@@ -0,0 +1,27 @@
+#include "libretro_script.h"
+#include "script_list.h"
+#include "deferred.h"
+#include "jobs.h"
+#include "gc.h"
+#include "observer.h"
+#include "trace.h"
+#include "util.h"
+
+RETRO_SCRIPT_API bool retro_script_idle(uint32_t budget_usec)
+{
+    const uint64_t deadline = retro_script_time_usec() + budget_usec;
+    TRACE_BEGIN("idle", NULL, 0);
+    script_defer_free(true);
+    
+    // most urgent first; each stops once the deadline passes, so the rest are skipped.
+    const bool done = retro_script_run_deferred_idle(deadline)
+        && retro_script_gc_idle(deadline)
+        && retro_script_jobs_idle(deadline);
+    
+    // (the log writer would otherwise write these out soon anyway.)
+    if (retro_script_before_deadline(deadline)) retro_script_log_flush();
+    
+    script_defer_free(false);
+    TRACE_END("idle");
+    return done;
+}
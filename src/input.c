@@ -0,0 +1,318 @@
+#include "input.h"
+#include "script.h"
+#include "script_list.h"
+#include "observer.h"
+#include "context.h"
+#include "core.h"
+#include "util.h"
+
+#include <string.h>
+
+// ids RETRO_DEVICE_ID_JOYPAD_B to RETRO_DEVICE_ID_JOYPAD_R3.
+#define JOYPAD_BUTTONS 16
+
+typedef struct input_port
+{
+    // buttons held or released by retro.set_input.
+    uint16_t held;
+    uint16_t released;
+    
+    // buttons with a turbo pattern; those in turbo_always fire even while not held.
+    uint16_t turbo;
+    uint16_t turbo_always;
+    uint16_t turbo_on[JOYPAD_BUTTONS];
+    uint16_t turbo_off[JOYPAD_BUTTONS];
+    uint64_t turbo_start[JOYPAD_BUTTONS];
+    
+    // the script which set each button's override, and the one which last queued input.
+    retro_script_id_t owner[JOYPAD_BUTTONS];
+    retro_script_id_t queue_owner;
+    
+    // per-frame button states, which replace the front-end's.
+    uint16_t* queue;
+    size_t queue_head;
+    size_t queue_count;
+    size_t queue_capacity;
+    
+    // resolved for the current frame; this is all the shim reads.
+    bool active;
+    bool queued;
+    uint16_t queued_buttons;
+    uint16_t force_on;
+    uint16_t force_off;
+} input_port;
+
+typedef struct overrides_state
+{
+    uint64_t frame;
+    input_port ports[RETRO_SCRIPT_INPUT_PORTS];
+} overrides_state;
+
+static void overrides_destroy(void* state)
+{
+    for (size_t i = 0; i < RETRO_SCRIPT_INPUT_PORTS; ++i)
+    {
+        free(((overrides_state*)state)->ports[i].queue);
+    }
+}
+
+CONTEXT_STATE(overrides_state, overrides, NULL, overrides_destroy)
+
+static void port_resolve(const overrides_state* state, input_port* port)
+{
+    port->force_on = port->held;
+    port->force_off = port->released;
+    for (int id = 0; id < JOYPAD_BUTTONS && port->turbo >> id; ++id)
+    {
+        const uint16_t bit = 1 << id;
+        if (!(port->turbo & bit)) continue;
+        
+        // (a pattern starts the next time the core runs.)
+        const uint64_t start = port->turbo_start[id];
+        const uint64_t elapsed = (state->frame > start) ? state->frame - start : 0;
+        if (elapsed % ((uint32_t)port->turbo_on[id] + port->turbo_off[id]) < port->turbo_on[id])
+        {
+            if (port->turbo_always & bit) port->force_on |= bit;
+        }
+        else
+        {
+            port->force_off |= bit;
+        }
+    }
+    port->active = port->queued || port->force_on || port->force_off;
+}
+
+int16_t retro_script_input_state(unsigned port, unsigned device, unsigned index, unsigned id)
+{
+    if (port < RETRO_SCRIPT_INPUT_PORTS && (device & RETRO_DEVICE_MASK) == RETRO_DEVICE_JOYPAD)
+    {
+        const input_port* p = &overrides()->ports[port];
+        if (p->active)
+        {
+            if (id == RETRO_DEVICE_ID_JOYPAD_MASK)
+            {
+                const uint16_t buttons = p->queued
+                    ? p->queued_buttons
+                    : (uint16_t)frontend_callbacks.retro_input_state(port, device, index, id);
+                return (int16_t)((buttons & ~p->force_off) | p->force_on);
+            }
+            if (id < JOYPAD_BUTTONS)
+            {
+                const uint16_t bit = 1 << id;
+                if (p->force_on & bit) return 1;
+                if (p->force_off & bit) return 0;
+                if (p->queued) return !!(p->queued_buttons & bit);
+            }
+        }
+    }
+    return frontend_callbacks.retro_input_state(port, device, index, id);
+}
+
+void retro_script_input_frame_begin()
+{
+    overrides_state* state = overrides();
+    state->frame++;
+    for (size_t i = 0; i < RETRO_SCRIPT_INPUT_PORTS; ++i)
+    {
+        input_port* port = &state->ports[i];
+        port->queued = port->queue_count > 0;
+        if (port->queued)
+        {
+            port->queued_buttons = port->queue[port->queue_head++];
+            if (--port->queue_count == 0) port->queue_head = 0;
+        }
+        port_resolve(state, port);
+    }
+}
+
+static void clear_buttons(input_port* port, uint16_t mask)
+{
+    port->held &= ~mask;
+    port->released &= ~mask;
+    port->turbo &= ~mask;
+    port->turbo_always &= ~mask;
+}
+
+static void clear_queue(input_port* port)
+{
+    port->queue_head = 0;
+    port->queue_count = 0;
+    port->queued = false;
+}
+
+void retro_script_input_release(retro_script_id_t id)
+{
+    overrides_state* state = overrides();
+    for (size_t i = 0; i < RETRO_SCRIPT_INPUT_PORTS; ++i)
+    {
+        input_port* port = &state->ports[i];
+        uint16_t owned = 0;
+        for (int button = 0; button < JOYPAD_BUTTONS; ++button)
+        {
+            if (port->owner[button] == id) owned |= 1 << button;
+        }
+        clear_buttons(port, owned);
+        if (port->queue_count && port->queue_owner == id) clear_queue(port);
+        port_resolve(state, port);
+    }
+}
+
+static input_port* check_port(lua_State* L, int arg)
+{
+    const lua_Integer port = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, port >= 0 && port < RETRO_SCRIPT_INPUT_PORTS, arg, "port out of range");
+    return &overrides()->ports[port];
+}
+
+static int check_button(lua_State* L, int arg)
+{
+    const lua_Integer id = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, id >= 0 && id < JOYPAD_BUTTONS, arg, "not a joypad button");
+    return (int)id;
+}
+
+// lua args: port, id, pressed (boolean or number; nil to clear)
+int retro_script_luafunc_set_input(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.set_input");
+    input_port* port = check_port(L, 1);
+    const int id = check_button(L, 2);
+    const uint16_t bit = 1 << id;
+    bool pressed = false;
+    if (!lua_isnoneornil(L, 3))
+    {
+        pressed = lua_isboolean(L, 3) ? lua_toboolean(L, 3) : luaL_checkinteger(L, 3) != 0;
+    }
+    
+    clear_buttons(port, bit);
+    if (!lua_isnoneornil(L, 3))
+    {
+        if (pressed) port->held |= bit;
+        else port->released |= bit;
+        port->owner[id] = script_find_lua(L)->id;
+    }
+    port_resolve(overrides(), port);
+    return 0;
+}
+
+// lua args: port, id, on frames (nil to clear), off frames, "held" or "always"
+int retro_script_luafunc_set_turbo(lua_State* L)
+{
+    static const char* const modes[] = { "held", "always", NULL };
+    retro_script_observer_check(L, "retro.set_turbo");
+    overrides_state* state = overrides();
+    input_port* port = check_port(L, 1);
+    const int id = check_button(L, 2);
+    const uint16_t bit = 1 << id;
+    if (lua_isnoneornil(L, 3))
+    {
+        clear_buttons(port, bit);
+        port_resolve(state, port);
+        return 0;
+    }
+    
+    const lua_Integer on = luaL_checkinteger(L, 3);
+    const lua_Integer off = luaL_optinteger(L, 4, on);
+    luaL_argcheck(L, on >= 1 && on <= UINT16_MAX, 3, "frames out of range");
+    luaL_argcheck(L, off >= 1 && off <= UINT16_MAX, 4, "frames out of range");
+    const bool always = luaL_checkoption(L, 5, "held", modes) == 1;
+    
+    clear_buttons(port, bit);
+    port->turbo |= bit;
+    if (always) port->turbo_always |= bit;
+    port->turbo_on[id] = (uint16_t)on;
+    port->turbo_off[id] = (uint16_t)off;
+    port->turbo_start[id] = state->frame + 1;
+    port->owner[id] = script_find_lua(L)->id;
+    port_resolve(state, port);
+    return 0;
+}
+
+// makes room to append n frames to the queue.
+static bool queue_reserve(input_port* port, size_t n)
+{
+    if (port->queue_head + port->queue_count + n <= port->queue_capacity) return true;
+    if (port->queue_head)
+    {
+        memmove(port->queue, port->queue + port->queue_head, port->queue_count * sizeof(uint16_t));
+        port->queue_head = 0;
+        if (port->queue_count + n <= port->queue_capacity) return true;
+    }
+    
+    size_t capacity = port->queue_capacity ? port->queue_capacity * 2 : 64;
+    if (capacity < port->queue_count + n) capacity = port->queue_count + n;
+    uint16_t* queue = (uint16_t*)realloc(port->queue, capacity * sizeof(uint16_t));
+    if (!queue) return false;
+    port->queue = queue;
+    port->queue_capacity = capacity;
+    return true;
+}
+
+// a frame's buttons are either a mask (as for RETRO_DEVICE_ID_JOYPAD_MASK) or a list of ids.
+static uint16_t check_frame(lua_State* L, int idx, lua_Integer frame)
+{
+    if (lua_isinteger(L, idx))
+    {
+        const lua_Integer mask = lua_tointeger(L, idx);
+        if (mask < 0 || mask > UINT16_MAX) luaL_error(L, "frame %d: button mask out of range", (int)frame);
+        return (uint16_t)mask;
+    }
+    if (!lua_istable(L, idx)) luaL_error(L, "frame %d: expected a button mask or a list of buttons", (int)frame);
+    
+    uint16_t buttons = 0;
+    const lua_Integer len = (lua_Integer)lua_rawlen(L, idx);
+    for (lua_Integer i = 1; i <= len; ++i)
+    {
+        lua_rawgeti(L, idx, i);
+        const lua_Integer id = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : -1;
+        if (id < 0 || id >= JOYPAD_BUTTONS) luaL_error(L, "frame %d: not a joypad button", (int)frame);
+        buttons |= 1 << id;
+        lua_pop(L, 1);
+    }
+    return buttons;
+}
+
+// lua args: port, list of frames
+//      ret: number of frames queued on the port
+int retro_script_luafunc_queue_input(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.queue_input");
+    input_port* port = check_port(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    const lua_Integer n = (lua_Integer)lua_rawlen(L, 2);
+    if (n > 0 && !queue_reserve(port, (size_t)n)) return luaL_error(L, "not enough memory");
+    
+    // (only committed once every frame is known to be valid.)
+    uint16_t* tail = port->queue + port->queue_head + port->queue_count;
+    for (lua_Integer i = 1; i <= n; ++i)
+    {
+        lua_rawgeti(L, 2, i);
+        tail[i - 1] = check_frame(L, 3, i);
+        lua_pop(L, 1);
+    }
+    if (n > 0)
+    {
+        port->queue_count += (size_t)n;
+        port->queue_owner = script_find_lua(L)->id;
+    }
+    lua_pushinteger(L, (lua_Integer)port->queue_count);
+    return 1;
+}
+
+// lua args: port (or nil for all ports)
+int retro_script_luafunc_clear_input(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.clear_input");
+    overrides_state* state = overrides();
+    input_port* only = lua_isnoneornil(L, 1) ? NULL : check_port(L, 1);
+    for (size_t i = 0; i < RETRO_SCRIPT_INPUT_PORTS; ++i)
+    {
+        input_port* port = &state->ports[i];
+        if (only && port != only) continue;
+        clear_buttons(port, 0xFFFF);
+        clear_queue(port);
+        port_resolve(state, port);
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/* Input overrides: the core is given a shim in place of the front-end's input_state callback,
+ * through which scripts can hold or release joypad buttons (retro.set_input), give them
+ * a turbo pattern (retro.set_turbo), or queue per-frame button states (retro.queue_input).
+ * Overrides are resolved into masks once per frame, so the shim never enters lua.
+ */
+
+#include "libretro_script.h"
+
+#include <lua_5.4.3.h>
+
+// ports which can be overridden; other ports are passed through.
+#define RETRO_SCRIPT_INPUT_PORTS 8
+
+// passed to the core as its input_state callback.
+int16_t retro_script_input_state(unsigned port, unsigned device, unsigned index, unsigned id);
+
+// called each frame just before the core runs, advancing queued input and turbo patterns.
+void retro_script_input_frame_begin();
+
+// removes the overrides set by the given script.
+void retro_script_input_release(retro_script_id_t);
+
+// lua functions
+int retro_script_luafunc_set_input(lua_State* L);
+int retro_script_luafunc_set_turbo(lua_State* L);
+int retro_script_luafunc_queue_input(lua_State* L);
+int retro_script_luafunc_clear_input(lua_State* L);
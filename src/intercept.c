@@ -5,7 +5,20 @@
 #include "script_list.h"
 #include "memmap.h"
 #include "hc_hooks.h"
+#include "gc.h"
+#include "deferred.h"
+#include "timers.h"
+#include "jobs.h"
+#include "bus.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "rate.h"
+#include "input.h"
+#include "reload.h"
+#include "observer.h"
 #include "core.h"
+#include "context.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -17,16 +30,33 @@
 #define INTERCEPT(name) RETRO_SCRIPT_DECLT(name) retro_script_intercept_##name(RETRO_SCRIPT_DECLT(name) f)
 #define INTERCEPT_HANDLER(name) _interceptor_##name
 
-struct core_t core;
-struct frontend_callbacks_t frontend_callbacks;
-
-enum
+typedef enum
 {
+    RS_DEINIT, // retro-script de-init'd 
     RS_INIT, // retro-script init'd, but core not yet init'd
     CORE_INIT, // core init'd
     CORE_DEINIT, // core deinit'd (may be skipped if frontend does not deinit core)
-    RS_DEINIT // retro-script de-init'd 
-} state = RS_DEINIT;
+} intercept_lifecycle;
+
+typedef struct intercept_state
+{
+    // (see core.h for the macros which access these.)
+    struct core_t core_functions;
+    struct frontend_callbacks_t callbacks;
+    intercept_lifecycle state;
+} intercept_state;
+
+CONTEXT_STATE(intercept_state, intercept, NULL, NULL)
+
+struct core_t* retro_script_core()
+{
+    return &intercept()->core_functions;
+}
+
+struct frontend_callbacks_t* retro_script_callbacks()
+{
+    return &intercept()->callbacks;
+}
 
 // how many core_on_init/deinit can be registered
 #define MAX_INIT_FUNCTIONS 8
@@ -56,7 +86,7 @@ uint32_t retro_script_init()
     retro_script_debug_force_include();
     #endif
     
-    if (state == RS_DEINIT)
+    if (intercept()->state == RS_DEINIT)
     {
         memset(&core, 0, sizeof(core));
         memset(&frontend_callbacks, 0, sizeof(frontend_callbacks));
@@ -74,13 +104,22 @@ uint32_t retro_script_init()
         core_on_init_fn[i]();
     }
     
-    state = RS_INIT;
+    intercept()->state = RS_INIT;
     return RETRO_SCRIPT_API_VERSION;
 }
 
+RETRO_SCRIPT_API uint32_t retro_script_context_init(retro_script_context_t* context)
+{
+    retro_script_context_t* previous = retro_script_context_bound;
+    retro_script_context_bound = context;
+    const uint32_t version = retro_script_init();
+    retro_script_context_bound = previous;
+    return version;
+}
+
 void retro_script_deinit()
 {
-    if (state != RS_DEINIT)
+    if (intercept()->state != RS_DEINIT)
     {
         for (size_t i = 0; i < retro_script_core_deinit_count; ++i)
         {
@@ -89,20 +128,49 @@ void retro_script_deinit()
         retro_script_clear_memory_map();
     }
     
-    state = RS_DEINIT;
+    intercept()->state = RS_DEINIT;
 }
 
 static void INTERCEPT_HANDLER(retro_run)()
 {
+    PROBE0(frame_begin);
+    TRACE_BEGIN("frame", NULL, 0);
+    
+    // (observers from the last frame may still be running.)
+    retro_script_observers_wait();
+    script_defer_free(true);
+    retro_script_reload_poll();
+    retro_script_rate_frame_begin();
+    const uint64_t frame_start = retro_script_time_usec();
+    retro_script_timers_advance();
     SCRIPT_ITERATE(script_state)
     {
-        retro_script_execute_cb(script_state, script_state->refs.on_run_begin);
+        if (!script_state->disabled) retro_script_execute_cb(script_state, script_state->refs.on_run_begin);
     }
+    retro_script_input_frame_begin();
+    TRACE_BEGIN("retro_run", NULL, 0);
+    retro_script_stats_core_begin();
     core.retro_run();
+    retro_script_stats_core_end();
+    TRACE_END("retro_run");
+    retro_script_observers_snapshot();
     SCRIPT_ITERATE(script_state)
     {
-        retro_script_execute_cb(script_state, script_state->refs.on_run_end);
+        if (!script_state->disabled && !script_state->observer) retro_script_execute_cb(script_state, script_state->refs.on_run_end);
     }
+    retro_script_bus_deliver();
+    retro_script_run_deferred(frame_start);
+    retro_script_jobs_run(frame_start);
+    retro_script_gc_frame_step();
+    
+    // scripts unloaded during the frame are freed here.
+    script_defer_free(false);
+    retro_script_stats_frame_end(frame_start);
+    TRACE_END("frame");
+    PROBE0(frame_end);
+    
+    // observers run on worker threads, overlapping whatever the front-end does until the next frame.
+    retro_script_observers_dispatch();
 }
 
 static bool retro_environment(unsigned int cmd, void* data)
@@ -131,9 +199,9 @@ static void INTERCEPT_HANDLER(retro_set_environment)(retro_environment_t cb)
 
 static void INTERCEPT_HANDLER(retro_init)()
 {
-    assert(state == RS_INIT);
+    assert(intercept()->state == RS_INIT);
     core.retro_init();
-    state = CORE_INIT;
+    intercept()->state = CORE_INIT;
 }
 
 static void INTERCEPT_HANDLER(retro_set_input_poll)(retro_input_poll_t cb)
@@ -144,8 +212,9 @@ static void INTERCEPT_HANDLER(retro_set_input_poll)(retro_input_poll_t cb)
 
 static void INTERCEPT_HANDLER(retro_set_input_state)(retro_input_state_t cb)
 {
+    // the core is given the shim, which applies scripts' input overrides.
     frontend_callbacks.retro_input_state = cb;
-    core.retro_set_input_state(cb);
+    core.retro_set_input_state(retro_script_input_state);
 }
 
 INTERCEPT(retro_set_environment) { return (core.retro_set_environment = f), INTERCEPT_HANDLER(retro_set_environment); }
@@ -155,4 +224,24 @@ INTERCEPT(retro_init)            { return (core.retro_init = f), INTERCEPT_HANDL
 INTERCEPT(retro_deinit)          { return (core.retro_deinit = f), f; }
 INTERCEPT(retro_run)             { return (core.retro_run = f), INTERCEPT_HANDLER(retro_run); }
 INTERCEPT(retro_set_input_poll)  { return (core.retro_set_input_poll = f), INTERCEPT_HANDLER(retro_set_input_poll); }
-INTERCEPT(retro_set_input_state) { return (core.retro_set_input_state = f), INTERCEPT_HANDLER(retro_set_input_state); }
\ No newline at end of file
+INTERCEPT(retro_set_input_state) { return (core.retro_set_input_state = f), INTERCEPT_HANDLER(retro_set_input_state); }
+
+// the same, but for the given context.
+#define CONTEXT_INTERCEPT(name) \
+    RETRO_SCRIPT_DECLT(name) retro_script_context_intercept_##name(retro_script_context_t* context, RETRO_SCRIPT_DECLT(name) f) \
+    { \
+        retro_script_context_t* previous = retro_script_context_bound; \
+        retro_script_context_bound = context; \
+        RETRO_SCRIPT_DECLT(name) handler = retro_script_intercept_##name(f); \
+        retro_script_context_bound = previous; \
+        return handler; \
+    }
+
+CONTEXT_INTERCEPT(retro_set_environment)
+CONTEXT_INTERCEPT(retro_get_memory_data)
+CONTEXT_INTERCEPT(retro_get_memory_size)
+CONTEXT_INTERCEPT(retro_init)
+CONTEXT_INTERCEPT(retro_deinit)
+CONTEXT_INTERCEPT(retro_run)
+CONTEXT_INTERCEPT(retro_set_input_poll)
+CONTEXT_INTERCEPT(retro_set_input_state)
@@ -0,0 +1,243 @@
+#include "jobs.h"
+#include "deferred.h"
+#include "script_list.h"
+#include "observer.h"
+#include "context.h"
+#include "hook.h"
+#include "watchdog.h"
+#include "trace.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+
+typedef struct script_job
+{
+    script_state_t* script;
+    lua_State* co;
+    int ref; // registry ref to the coroutine
+    int on_done_ref; // registry ref to completion callback, or LUA_NOREF.
+    struct script_job* next;
+} script_job;
+
+typedef struct jobs_state
+{
+    script_job* jobs;
+    
+    // the job to run first on the next frame.
+    script_job* cursor;
+    
+    // coroutine of the job currently running, and the instructions left in its slice.
+    lua_State* running;
+    int64_t remaining;
+    
+    uint32_t job_slice;
+} jobs_state;
+
+static void jobs_state_init(void* state)
+{
+    ((jobs_state*)state)->job_slice = 100000;
+}
+
+CONTEXT_STATE(jobs_state, jobs, jobs_state_init, NULL)
+
+bool retro_script_jobs_count(lua_State* L, int count)
+{
+    // (coroutines created by the job inherit its hook, but only the job itself is preempted.)
+    jobs_state* state = jobs();
+    if (L != state->running) return false;
+    state->remaining -= count;
+    if (state->remaining > 0 || !lua_isyieldable(L)) return false;
+    
+    // (from a hook, this returns; the job yields once the hook does.)
+    lua_yield(L, 0);
+    return true;
+}
+
+uint32_t retro_script_jobs_hook_count(lua_State* L)
+{
+    return (L == jobs()->running) ? jobs()->job_slice : 0;
+}
+
+static void job_free(script_job* job)
+{
+    luaL_unref(job->script->L, LUA_REGISTRYINDEX, job->ref);
+    luaL_unref(job->script->L, LUA_REGISTRYINDEX, job->on_done_ref);
+    free(job);
+}
+
+static void job_remove(script_job* job)
+{
+    jobs_state* state = jobs();
+    script_job** entry = &state->jobs;
+    while (*entry != job) entry = &(*entry)->next;
+    *entry = job->next;
+    if (state->cursor == job) state->cursor = job->next;
+}
+
+// returns true if the job is complete.
+static bool job_resume(script_job* job)
+{
+    jobs_state* state = jobs();
+    lua_State* L = job->script->L;
+    lua_State* co = job->co;
+    int nres;
+    
+    state->running = co;
+    state->remaining = state->job_slice;
+    retro_script_hook_install(job->script, co);
+    
+    // each slice is held to the script's callback budget, as for any other call.
+    TRACE_BEGIN("job", "script", job->script->id);
+    retro_script_watchdog_arm(job->script, job->script->watchdog.callback_budget);
+    int status = lua_resume(co, L, 0, &nres);
+    status = retro_script_watchdog_disarm(job->script, status);
+    TRACE_END("job");
+    state->running = NULL;
+#ifdef RETRO_SCRIPT_LUAJIT
+    // (LuaJIT's hook is shared by all threads, so it is put back as the script has it.)
+    retro_script_hook_install(job->script, L);
+#endif
+    
+    if (status == LUA_YIELD)
+    {
+        lua_pop(co, nres);
+        return false;
+    }
+    else if (status != LUA_OK)
+    {
+        retro_script_on_coroutine_error(L, co, status);
+    }
+    else if (job->on_done_ref != LUA_NOREF)
+    {
+        // pass results to on_done.
+        lua_rawgeti(L, LUA_REGISTRYINDEX, job->on_done_ref);
+        lua_xmove(co, L, nres);
+        int result = retro_script_lua_pcall(L, nres, 0);
+        retro_script_on_uncaught_error(L, result);
+        lua_settop(L, 0);
+    }
+    return true;
+}
+
+// gives each job one slice, from the cursor, until the deadline.
+// returns the number of slices run.
+static size_t jobs_round(uint64_t deadline, bool at_least_one)
+{
+    jobs_state* state = jobs();
+    size_t count = 0;
+    for (script_job* job = state->jobs; job; job = job->next) count++;
+    
+    script_job* job = state->cursor ? state->cursor : state->jobs;
+    size_t slices = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        // at least one job runs each frame, so none are starved indefinitely.
+        if ((slices || !at_least_one) && !retro_script_before_deadline(deadline)) break;
+        
+        script_job* next = job->next ? job->next : state->jobs;
+        if (!job->script->disabled && !retro_script_observer_busy(job->script))
+        {
+            slices++;
+            if (job_resume(job))
+            {
+                if (next == job) next = NULL;
+                job_remove(job);
+                job_free(job);
+            }
+        }
+        job = next;
+    }
+    
+    state->cursor = job;
+    return slices;
+}
+
+void retro_script_jobs_run(uint64_t frame_start)
+{
+    jobs_round(retro_script_frame_deadline(frame_start), true);
+}
+
+bool retro_script_jobs_idle(uint64_t deadline)
+{
+    while (jobs()->jobs)
+    {
+        if (!retro_script_before_deadline(deadline)) return false;
+        
+        // (there's nothing to do if every job's script is disabled, or is an observer still running.)
+        if (!jobs_round(deadline, false)) break;
+    }
+    for (script_job* job = jobs()->jobs; job; job = job->next)
+    {
+        if (!job->script->disabled && retro_script_observer_busy(job->script)) return false;
+    }
+    return true;
+}
+
+void retro_script_jobs_clear(script_state_t* script)
+{
+    jobs_state* state = jobs();
+    script_job** entry = &state->jobs;
+    while (*entry)
+    {
+        script_job* job = *entry;
+        if (job->script == script)
+        {
+            // (a script in the shared lua state must unref; otherwise the state is being discarded.)
+            if (script->shared.enabled)
+            {
+                luaL_unref(script->L, LUA_REGISTRYINDEX, job->ref);
+                luaL_unref(script->L, LUA_REGISTRYINDEX, job->on_done_ref);
+            }
+            *entry = job->next;
+            if (state->cursor == job) state->cursor = job->next;
+            free(job);
+        }
+        else
+        {
+            entry = &job->next;
+        }
+    }
+}
+
+void retro_script_jobs_transfer(script_state_t* from, script_state_t* to)
+{
+    jobs_state* state = jobs();
+    for (script_job* job = state->jobs; job; job = job->next)
+    {
+        if (job->script == from) job->script = to;
+    }
+}
+
+// lua args: fn, [on_done]
+//      ret: coroutine
+int retro_script_luafunc_job(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.job");
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    
+    script_job* job = alloc(script_job);
+    if (!job) return luaL_error(L, "unable to allocate job");
+    
+    job->script = script_find_lua(L);
+    job->on_done_ref = lua_isnil(L, 2) ? LUA_NOREF : luaL_ref(L, LUA_REGISTRYINDEX);
+    job->co = script_newthread(L);
+    lua_pushvalue(L, 1);
+    lua_xmove(L, job->co, 1);
+    lua_pushvalue(L, -1);
+    job->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    // append, so jobs run in the order they were created.
+    script_job** entry = &jobs()->jobs;
+    while (*entry) entry = &(*entry)->next;
+    job->next = NULL;
+    *entry = job;
+    
+    return 1;
+}
+
+RETRO_SCRIPT_API void retro_script_set_job_slice(uint32_t instructions)
+{
+    jobs()->job_slice = instructions ? instructions : 1;
+}
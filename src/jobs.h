@@ -0,0 +1,35 @@
+#pragma once
+
+/* Background jobs (retro.job) are coroutines which are preempted by a
+ * count hook (see hook.c) after a fixed number of instructions, then resumed on
+ * the next frame with spare time, until they complete.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+struct lua_State;
+
+// gives each job one slice, for as long as the frame deadline allows.
+// frame_start is the time the frame began, from retro_script_time_usec.
+void retro_script_jobs_run(uint64_t frame_start);
+
+// gives jobs slices until the deadline (from retro_script_time_usec).
+// returns false if the deadline passed with jobs still running.
+bool retro_script_jobs_idle(uint64_t deadline);
+
+// removes all jobs belonging to the given script.
+void retro_script_jobs_clear(script_state_t*);
+
+// gives all jobs belonging to one script to another.
+void retro_script_jobs_transfer(script_state_t* from, script_state_t* to);
+
+// called from the hook on L every count instructions. if L is the running job
+// and its slice is used up, yields it and returns true.
+bool retro_script_jobs_count(struct lua_State* L, int count);
+
+// how often the hook needs to run on L for preemption, or 0 if not at all.
+uint32_t retro_script_jobs_hook_count(struct lua_State* L);
+
+// lua functions
+int retro_script_luafunc_job(struct lua_State* L);
@@ -0,0 +1,292 @@
+#include "log.h"
+#include "script_list.h"
+#include "thread.h"
+#include "core.h"
+#include "util.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// number of messages the ring holds. must be a power of two.
+#define LOG_RING_SIZE 1024
+
+// longer messages are truncated.
+#define LOG_MESSAGE_MAX 240
+
+// the writer wakes this often to drain the ring, or sooner if it fills up.
+#define LOG_WRITER_MSEC 20
+
+typedef struct log_slot
+{
+    // (see log_push for how the sequence number is used.)
+    atomic_size_t sequence;
+    retro_script_id_t id;
+    retro_script_log_level_t level;
+    uint32_t len;
+    char text[LOG_MESSAGE_MAX];
+} log_slot;
+
+static log_slot ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos; // (only accessed with the mutex held.)
+static atomic_uint_fast64_t dropped;
+static uint64_t dropped_reported;
+
+static atomic_int min_level = RETRO_SCRIPT_LOG_DEBUG;
+static bool route_print = false;
+
+// the mutex guards the consumer side of the ring, and the outputs.
+static retro_script_mutex_t mutex;
+static retro_script_cond_t wake;
+static retro_script_thread_t writer;
+static bool writer_running = false;
+static atomic_bool writer_started = false;
+static FILE* file = NULL;
+static retro_script_log_cb callback = NULL;
+
+INITIALIZER(log_init)
+{
+    for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+    {
+        atomic_init(&ring[i].sequence, i);
+    }
+    retro_script_mutex_init(&mutex);
+    retro_script_cond_init(&wake);
+}
+
+static const char* level_name(retro_script_log_level_t level)
+{
+    switch (level)
+    {
+    case RETRO_SCRIPT_LOG_DEBUG: return "DEBUG";
+    case RETRO_SCRIPT_LOG_INFO: return "INFO";
+    case RETRO_SCRIPT_LOG_WARN: return "WARN";
+    case RETRO_SCRIPT_LOG_ERROR: return "ERROR";
+    default: return "?";
+    }
+}
+
+// bounded multi-producer queue (after Dmitry Vyukov's).
+// a slot's sequence number equals the position it may next be written at,
+// or that position + 1 once written and ready to be read.
+static bool log_push(retro_script_id_t id, retro_script_log_level_t level, const char* msg, size_t len)
+{
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    log_slot* slot;
+    for (;;)
+    {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        const size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // full.
+            return false;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+    
+    if (len > LOG_MESSAGE_MAX) len = LOG_MESSAGE_MAX;
+    memcpy(slot->text, msg, len);
+    slot->len = (uint32_t)len;
+    slot->id = id;
+    slot->level = level;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    
+    // wake the writer early if the ring is filling up.
+    if (((pos + 1) & (LOG_RING_SIZE / 2 - 1)) == 0) retro_script_cond_signal(&wake);
+    return true;
+}
+
+static void output(retro_script_id_t id, retro_script_log_level_t level, const char* msg, size_t len)
+{
+    if (callback)
+    {
+        callback(id, level, msg);
+    }
+    else
+    {
+        fprintf(file ? file : stdout, "[%s] retro-script %u: %.*s\n", level_name(level), id, (int)len, msg);
+    }
+}
+
+// writes out every message in the ring. the mutex must be locked.
+static void drain()
+{
+    bool wrote = false;
+    for (;;)
+    {
+        log_slot* slot = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != dequeue_pos + 1) break;
+        
+        char text[LOG_MESSAGE_MAX + 1];
+        memcpy(text, slot->text, slot->len);
+        text[slot->len] = 0;
+        output(slot->id, slot->level, text, slot->len);
+        wrote = true;
+        
+        atomic_store_explicit(&slot->sequence, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+        dequeue_pos++;
+    }
+    
+    const uint64_t total_dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (total_dropped != dropped_reported)
+    {
+        char text[64];
+        const int len = snprintf(text, sizeof(text), "%llu log messages dropped (ring full)", (unsigned long long)(total_dropped - dropped_reported));
+        output(0, RETRO_SCRIPT_LOG_WARN, text, len);
+        dropped_reported = total_dropped;
+        wrote = true;
+    }
+    
+    if (wrote && !callback) fflush(file ? file : stdout);
+}
+
+static void writer_main(void* ud)
+{
+    retro_script_mutex_lock(&mutex);
+    while (writer_running)
+    {
+        drain();
+        retro_script_cond_wait(&wake, &mutex, LOG_WRITER_MSEC);
+    }
+    drain();
+    retro_script_mutex_unlock(&mutex);
+}
+
+// (called with the mutex locked.)
+static void start_writer()
+{
+    if (writer_running) return;
+    writer_running = true;
+    if (!retro_script_thread_create(&writer, writer_main, NULL))
+    {
+        writer_running = false;
+    }
+}
+
+bool retro_script_log_write(retro_script_id_t id, retro_script_log_level_t level, const char* msg, size_t len)
+{
+    if ((int)level < atomic_load_explicit(&min_level, memory_order_relaxed)) return false;
+    if (!log_push(id, level, msg, len))
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    
+    // (the first message starts the writer.)
+    if (!atomic_load_explicit(&writer_started, memory_order_relaxed))
+    {
+        retro_script_mutex_lock(&mutex);
+        start_writer();
+        atomic_store(&writer_started, writer_running);
+        retro_script_mutex_unlock(&mutex);
+    }
+    return true;
+}
+
+bool retro_script_log_routes_print()
+{
+    return route_print;
+}
+
+// formats the arguments from index first onward like print does, and logs them.
+static int log_args(lua_State* L, retro_script_log_level_t level, int first)
+{
+    char text[LOG_MESSAGE_MAX];
+    size_t len = 0;
+    const int n = lua_gettop(L);
+    for (int i = first; i <= n; ++i)
+    {
+        size_t arglen;
+        const char* s = luaL_tolstring(L, i, &arglen);
+        if (i > first && len < LOG_MESSAGE_MAX) text[len++] = '\t';
+        if (arglen > LOG_MESSAGE_MAX - len) arglen = LOG_MESSAGE_MAX - len;
+        memcpy(text + len, s, arglen);
+        len += arglen;
+        lua_pop(L, 1);
+    }
+    
+    script_state_t* script = script_find_lua(L);
+    retro_script_log_write(script ? script->id : 0, level, text, len);
+    return 0;
+}
+
+int retro_script_luafunc_log(lua_State* L)
+{
+    static const char* const levels[] = { "debug", "info", "warn", "error", NULL };
+    const int level = luaL_checkoption(L, 1, NULL, levels);
+    return log_args(L, (retro_script_log_level_t)level, 2);
+}
+
+int retro_script_luafunc_log_print(lua_State* L)
+{
+    return log_args(L, RETRO_SCRIPT_LOG_INFO, 1);
+}
+
+RETRO_SCRIPT_API void retro_script_set_log_level(retro_script_log_level_t level)
+{
+    atomic_store(&min_level, (int)level);
+}
+
+RETRO_SCRIPT_API bool retro_script_set_log_file(const char* path)
+{
+    FILE* f = NULL;
+    if (path)
+    {
+        f = fopen(path, "a");
+        if (!f) return false;
+    }
+    
+    retro_script_mutex_lock(&mutex);
+    drain();
+    if (file) fclose(file);
+    file = f;
+    retro_script_mutex_unlock(&mutex);
+    return true;
+}
+
+RETRO_SCRIPT_API void retro_script_set_log_callback(retro_script_log_cb cb)
+{
+    retro_script_mutex_lock(&mutex);
+    drain();
+    callback = cb;
+    retro_script_mutex_unlock(&mutex);
+}
+
+RETRO_SCRIPT_API void retro_script_set_print_to_log(bool enabled)
+{
+    route_print = enabled;
+}
+
+RETRO_SCRIPT_API void retro_script_log_flush()
+{
+    retro_script_mutex_lock(&mutex);
+    drain();
+    retro_script_mutex_unlock(&mutex);
+}
+
+ON_DEINIT()
+{
+    retro_script_mutex_lock(&mutex);
+    const bool was_running = writer_running;
+    writer_running = false;
+    atomic_store(&writer_started, false);
+    retro_script_cond_signal(&wake);
+    retro_script_mutex_unlock(&mutex);
+    if (was_running) retro_script_thread_join(writer);
+    
+    retro_script_mutex_lock(&mutex);
+    drain();
+    retro_script_mutex_unlock(&mutex);
+}
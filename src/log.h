@@ -0,0 +1,23 @@
+#pragma once
+
+/* Buffered logging for scripts.
+ * Messages are formatted on the calling thread into a lock-free ring,
+ * which a background thread drains to stdout, a file, or a front-end callback.
+ */
+
+#include "libretro_script.h"
+
+#include <lua_5.4.3.h>
+
+// queues a message. returns false if it was dropped because the ring is full
+// (or the message is below the minimum level).
+bool retro_script_log_write(retro_script_id_t, retro_script_log_level_t, const char* msg, size_t len);
+
+// true if print should be replaced with retro_script_luafunc_log_print.
+bool retro_script_log_routes_print();
+
+// retro.log(level, ...)
+int retro_script_luafunc_log(lua_State* L);
+
+// replacement for print, logging at the info level.
+int retro_script_luafunc_log_print(lua_State* L);
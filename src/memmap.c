@@ -1,63 +1,155 @@
 #include "memmap.h"
+#include "context.h"
+#include "probes.h"
 #include "util.h"
 
-static char** addrspaces;
-static struct retro_memory_map memmap;
+typedef struct memmap_state
+{
+    char** addrspaces;
+    struct retro_memory_map memmap;
+    
+    // a copy of the mapped memory; see retro_script_memory_snapshot_take.
+    struct retro_memory_map snapshot;
+    char* snapshot_data;
+    size_t snapshot_capacity;
+} memmap_state;
+
+static void free_snapshot(memmap_state* maps);
+static void free_memmap(memmap_state* maps);
+
+static void memmap_state_destroy(void* state)
+{
+    free_memmap((memmap_state*)state);
+    free_snapshot((memmap_state*)state);
+}
+
+CONTEXT_STATE(memmap_state, maps, NULL, memmap_state_destroy)
+
+// whether this thread reads from the snapshot.
+static THREAD_LOCAL bool use_snapshot = false;
 
-static void free_memmap()
+static void free_snapshot(memmap_state* maps)
 {
-    if (addrspaces)
+    if (maps->snapshot.descriptors) free((void*)maps->snapshot.descriptors);
+    if (maps->snapshot_data) free(maps->snapshot_data);
+    memset(&maps->snapshot, 0, sizeof(maps->snapshot));
+    maps->snapshot_data = NULL;
+    maps->snapshot_capacity = 0;
+}
+
+static void free_memmap(memmap_state* maps)
+{
+    if (maps->addrspaces)
     {
-        for (char** addrspace = addrspaces; addrspace && *addrspace; ++addrspace)
+        for (char** addrspace = maps->addrspaces; addrspace && *addrspace; ++addrspace)
         {
             free(*addrspace);
         }
         
-        free(addrspaces);
+        free(maps->addrspaces);
+        maps->addrspaces = NULL;
     }
-    if (memmap.num_descriptors)
+    if (maps->memmap.num_descriptors)
     {
-        free((void*)memmap.descriptors);
+        free((void*)maps->memmap.descriptors);
     }
+    memset(&maps->memmap, 0, sizeof(maps->memmap));
 }
 
 char const* const* retro_script_list_memory_addrspaces()
 {
-    if (addrspaces)
+    memmap_state* state = maps();
+    if (state->addrspaces)
     {
-        return (char const* const*) addrspaces;
+        return (char const* const*) state->addrspaces;
     }
     else
     {
         // (pointer to NULL indicates empty list.)
-        return (char const* const*) &addrspaces;
+        return (char const* const*) &state->addrspaces;
     }
 }
 
 void retro_script_clear_memory_map()
 {
-    free_memmap();
+    free_memmap(maps());
+    free_snapshot(maps());
+}
+
+bool retro_script_memory_snapshot_take()
+{
+    memmap_state* state = maps();
+    struct retro_memory_map const* memmap = &state->memmap;
+    struct retro_memory_map* snapshot = &state->snapshot;
+    
+    // descriptors for memory which can change are copied, along with the memory.
+    size_t size = 0;
+    for (size_t i = 0; i < memmap->num_descriptors; ++i)
+    {
+        struct retro_memory_descriptor const* descriptor = &memmap->descriptors[i];
+        if (descriptor->ptr && !(descriptor->flags & RETRO_MEMDESC_CONST)) size += descriptor->len;
+    }
+    
+    if (!snapshot->descriptors && memmap->num_descriptors)
+    {
+        snapshot->descriptors = malloc_array(struct retro_memory_descriptor, memmap->num_descriptors);
+        if (!snapshot->descriptors) return false;
+    }
+    if (size > state->snapshot_capacity)
+    {
+        char* data = realloc(state->snapshot_data, size);
+        if (!data) return false;
+        state->snapshot_data = data;
+        state->snapshot_capacity = size;
+    }
+    
+    size_t used = 0;
+    struct retro_memory_descriptor* descriptors = (struct retro_memory_descriptor*)snapshot->descriptors;
+    for (size_t i = 0; i < memmap->num_descriptors; ++i)
+    {
+        descriptors[i] = memmap->descriptors[i];
+        if (descriptors[i].ptr && !(descriptors[i].flags & RETRO_MEMDESC_CONST))
+        {
+            memcpy(state->snapshot_data + used, (char*)descriptors[i].ptr + descriptors[i].offset, descriptors[i].len);
+            descriptors[i].ptr = state->snapshot_data + used;
+            descriptors[i].offset = 0;
+            used += descriptors[i].len;
+        }
+        
+        // (so writes to the snapshot fail.)
+        descriptors[i].flags |= RETRO_MEMDESC_CONST;
+    }
+    snapshot->num_descriptors = memmap->num_descriptors;
+    return true;
+}
+
+void retro_script_memory_use_snapshot(bool use)
+{
+    use_snapshot = use;
 }
 
 bool retro_script_set_memory_map(struct retro_memory_map* core_memmap)
 {
     if (core_memmap)
     {
-        free_memmap();
-        memmap.num_descriptors = core_memmap->num_descriptors;
-        memmap.descriptors = malloc_array(struct retro_memory_descriptor, memmap.num_descriptors);
+        memmap_state* state = maps();
+        struct retro_memory_map* memmap = &state->memmap;
+        free_memmap(state);
+        free_snapshot(state);
+        memmap->num_descriptors = core_memmap->num_descriptors;
+        memmap->descriptors = malloc_array(struct retro_memory_descriptor, memmap->num_descriptors);
         
-        memcpy((void*)memmap.descriptors, core_memmap->descriptors, sizeof(struct retro_memory_descriptor) * memmap.num_descriptors);
+        memcpy((void*)memmap->descriptors, core_memmap->descriptors, sizeof(struct retro_memory_descriptor) * memmap->num_descriptors);
         
         // copy addrspace to static store.
-        addrspaces = malloc_array(char*, memmap.num_descriptors + 1);
-        memset(addrspaces, 0, sizeof(char*) * (memmap.num_descriptors + 1));
-        for (size_t i = 0; i < memmap.num_descriptors; ++i)
+        state->addrspaces = malloc_array(char*, memmap->num_descriptors + 1);
+        memset(state->addrspaces, 0, sizeof(char*) * (memmap->num_descriptors + 1));
+        for (size_t i = 0; i < memmap->num_descriptors; ++i)
         {
-            struct retro_memory_descriptor* descriptor = (struct retro_memory_descriptor*)&memmap.descriptors[i];
+            struct retro_memory_descriptor* descriptor = (struct retro_memory_descriptor*)&memmap->descriptors[i];
             
             char** addrspace;
-            for (addrspace = addrspaces; addrspace && *addrspace; ++addrspace)
+            for (addrspace = state->addrspaces; addrspace && *addrspace; ++addrspace)
             {
                 if ((*addrspace == descriptor->addrspace) || strcmp(*addrspace, descriptor->addrspace) == 0)
                 {
@@ -83,9 +175,11 @@ bool retro_script_set_memory_map(struct retro_memory_map* core_memmap)
 
 struct retro_memory_descriptor* retro_script_memory_find_descriptor_at_address(size_t emulated_address, size_t* offset)
 {
-    for (size_t i = 0; i < memmap.num_descriptors; ++i)
+    memmap_state* state = maps();
+    struct retro_memory_map const* map = use_snapshot ? &state->snapshot : &state->memmap;
+    for (size_t i = 0; i < map->num_descriptors; ++i)
     {
-        struct retro_memory_descriptor* descriptor = (struct retro_memory_descriptor*)&memmap.descriptors[i];
+        struct retro_memory_descriptor* descriptor = (struct retro_memory_descriptor*)&map->descriptors[i];
         size_t addr = emulated_address & ~descriptor->disconnect;
         if (addr < descriptor->start) continue;
         addr -= descriptor->start;
@@ -94,6 +188,7 @@ struct retro_memory_descriptor* retro_script_memory_find_descriptor_at_address(s
         return descriptor;
     }
     
+    PROBE1(memmap_miss, emulated_address);
     return NULL;
 }
 
@@ -124,7 +219,7 @@ char* retro_script_memory_access(size_t emulated_address)
 
 #define SYS_IS_BIGENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
 
-static char readbuff[8];
+static THREAD_LOCAL char readbuff[8];
 static FORCEINLINE char* readmem_chunk(size_t emulated_address, size_t count, bool flip)
 {
     for (size_t i = 0; i < count; ++i)
@@ -10,6 +10,13 @@ char const* const* retro_script_list_memory_addrspaces();
 struct retro_memory_descriptor* retro_script_memory_find_descriptor_at_address(size_t emulated_address, size_t* offset);
 char* retro_script_memory_access(size_t emulated_address);
 
+// copies the mapped memory which is not const, for reading later (e.g. on another thread).
+// returns false if not enough memory.
+bool retro_script_memory_snapshot_take();
+
+// if set, reads on the calling thread are from the last snapshot, and writes fail.
+void retro_script_memory_use_snapshot(bool);
+
 // these all return false if an error occurred, true if successful.
 bool retro_script_memory_read_char(size_t emulated_address, char* out);
 bool retro_script_memory_read_byte(size_t emulated_address, unsigned char* out);
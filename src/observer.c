@@ -0,0 +1,292 @@
+#include "observer.h"
+#include "script_list.h"
+#include "memmap.h"
+#include "thread.h"
+#include "gc.h"
+#include "bus.h"
+#include "core.h"
+#include "context.h"
+#include "util.h"
+
+#include <stdatomic.h>
+
+// workers wake this often to check whether they should stop.
+#define OBSERVER_POLL_MSEC 100
+
+typedef struct observer_state
+{
+    uint32_t thread_count;
+    
+    retro_script_mutex_t mutex;
+    retro_script_cond_t work_ready;
+    retro_script_cond_t work_done;
+    
+    retro_script_thread_t* workers;
+    uint32_t worker_count;
+    bool stopping;
+    
+    // observers to run this frame.
+    script_state_t** batch;
+    size_t batch_count;
+    size_t batch_capacity;
+    atomic_size_t batch_next;
+    
+    // incremented for each batch.
+    uint64_t generation;
+    
+    // the generation when the workers were started; they wait for the one after.
+    uint64_t start_generation;
+    
+    // workers still running the current batch.
+    uint32_t pending;
+    
+    bool busy;
+    bool snapshot_ok;
+} observer_state;
+
+static void observer_state_init(void* p)
+{
+    observer_state* state = (observer_state*)p;
+    state->thread_count = 2;
+    retro_script_mutex_init(&state->mutex);
+    retro_script_cond_init(&state->work_ready);
+    retro_script_cond_init(&state->work_done);
+}
+
+static void stop_workers(observer_state* state);
+
+static void observer_state_destroy(void* p)
+{
+    observer_state* state = (observer_state*)p;
+    stop_workers(state);
+    free(state->batch);
+    retro_script_mutex_destroy(&state->mutex);
+    retro_script_cond_destroy(&state->work_ready);
+    retro_script_cond_destroy(&state->work_done);
+}
+
+CONTEXT_STATE(observer_state, observers, observer_state_init, observer_state_destroy)
+
+static THREAD_LOCAL bool in_observer = false;
+
+bool retro_script_in_observer()
+{
+    return in_observer;
+}
+
+void retro_script_observer_check(lua_State* L, const char* what)
+{
+    if (in_observer) luaL_error(L, "%s is not available to observer scripts", what);
+}
+
+bool retro_script_observer_may_write(lua_State* L)
+{
+    if (in_observer) return false;
+    const script_state_t* script = script_find_lua(L);
+    return !(script && script->observer);
+}
+
+// runs observers from the batch until none are left. (on any thread.)
+static void run_batch(observer_state* state)
+{
+    in_observer = true;
+    retro_script_memory_use_snapshot(true);
+    size_t i;
+    while ((i = atomic_fetch_add(&state->batch_next, 1)) < state->batch_count)
+    {
+        script_state_t* script = state->batch[i];
+        retro_script_bus_deliver_to(script);
+        retro_script_execute_cb(script, script->refs.on_run_end);
+        retro_script_gc_observer_step(script);
+    }
+    retro_script_memory_use_snapshot(false);
+    in_observer = false;
+}
+
+// ud: the context the worker runs observers for.
+static void worker_main(void* ud)
+{
+    retro_script_context_make_current((retro_script_context_t*)ud);
+    observer_state* state = observers();
+    retro_script_mutex_lock(&state->mutex);
+    uint64_t seen = state->start_generation;
+    for (;;)
+    {
+        while (!state->stopping && state->generation == seen)
+        {
+            retro_script_cond_wait(&state->work_ready, &state->mutex, OBSERVER_POLL_MSEC);
+        }
+        if (state->stopping) break;
+        seen = state->generation;
+        retro_script_mutex_unlock(&state->mutex);
+        
+        run_batch(state);
+        
+        retro_script_mutex_lock(&state->mutex);
+        if (--state->pending == 0) retro_script_cond_broadcast(&state->work_done);
+    }
+    retro_script_mutex_unlock(&state->mutex);
+}
+
+static void stop_workers(observer_state* state)
+{
+    retro_script_observers_wait();
+    
+    retro_script_mutex_lock(&state->mutex);
+    state->stopping = true;
+    retro_script_cond_broadcast(&state->work_ready);
+    retro_script_mutex_unlock(&state->mutex);
+    
+    for (uint32_t i = 0; i < state->worker_count; ++i)
+    {
+        retro_script_thread_join(state->workers[i]);
+    }
+    free(state->workers);
+    state->workers = NULL;
+    state->worker_count = 0;
+    state->stopping = false;
+}
+
+static bool start_workers(observer_state* state)
+{
+    if (state->worker_count > 0) return true;
+    state->workers = malloc_array(retro_script_thread_t, state->thread_count);
+    if (!state->workers) return false;
+    
+    state->start_generation = state->generation;
+    void* ud = retro_script_context();
+    while (state->worker_count < state->thread_count && retro_script_thread_create(&state->workers[state->worker_count], worker_main, ud))
+    {
+        state->worker_count++;
+    }
+    return state->worker_count > 0;
+}
+
+void retro_script_observers_wait()
+{
+    observer_state* state = observers();
+    
+    // (an observer cannot wait for itself.)
+    if (!state->busy || in_observer) return;
+    
+    retro_script_mutex_lock(&state->mutex);
+    while (state->pending > 0)
+    {
+        retro_script_cond_wait(&state->work_done, &state->mutex, OBSERVER_POLL_MSEC);
+    }
+    retro_script_mutex_unlock(&state->mutex);
+    state->busy = false;
+}
+
+bool retro_script_observer_busy(const script_state_t* script)
+{
+    observer_state* state = observers();
+    if (!script->observer || !state->busy || in_observer) return false;
+    
+    retro_script_mutex_lock(&state->mutex);
+    const bool running = state->pending > 0;
+    retro_script_mutex_unlock(&state->mutex);
+    if (!running)
+    {
+        state->busy = false;
+        return false;
+    }
+    
+    // (only scripts in the batch are touched by the workers.)
+    for (size_t i = 0; i < state->batch_count; ++i)
+    {
+        if (state->batch[i] == script) return true;
+    }
+    return false;
+}
+
+void retro_script_observers_snapshot()
+{
+    observer_state* state = observers();
+    state->snapshot_ok = false;
+    SCRIPT_ITERATE(script)
+    {
+        if (script->observer && !script->disabled)
+        {
+            state->snapshot_ok = retro_script_memory_snapshot_take();
+            return;
+        }
+    }
+}
+
+void retro_script_observers_dispatch()
+{
+    observer_state* state = observers();
+    if (!state->snapshot_ok) return;
+    state->snapshot_ok = false;
+    
+    state->batch_count = 0;
+    SCRIPT_ITERATE(script)
+    {
+        if (!script->observer || script->disabled) continue;
+        if (script->refs.on_run_end == LUA_NOREF && !retro_script_bus_pending(script)) continue;
+        if (state->batch_count >= state->batch_capacity)
+        {
+            const size_t capacity = state->batch_capacity ? state->batch_capacity * 2 : 8;
+            script_state_t** resized = realloc(state->batch, sizeof(script_state_t*) * capacity);
+            if (!resized) break;
+            state->batch = resized;
+            state->batch_capacity = capacity;
+        }
+        state->batch[state->batch_count++] = script;
+    }
+    if (state->batch_count == 0) return;
+    atomic_store(&state->batch_next, 0);
+    
+    // without workers, observers run here instead.
+    if (state->thread_count == 0 || !start_workers(state))
+    {
+        run_batch(state);
+        return;
+    }
+    
+    retro_script_mutex_lock(&state->mutex);
+    state->pending = state->worker_count;
+    state->generation++;
+    retro_script_cond_broadcast(&state->work_ready);
+    retro_script_mutex_unlock(&state->mutex);
+    state->busy = true;
+}
+
+int retro_script_luafunc_set_observer(lua_State* L)
+{
+    script_state_t* script = script_find_lua(L);
+    const bool enabled = lua_isnoneornil(L, 1) || lua_toboolean(L, 1);
+    if (!script) return 0;
+    if (enabled && script->shared.enabled)
+    {
+        return luaL_error(L, "scripts in a shared lua state cannot be observers");
+    }
+    
+    script->observer = enabled;
+    if (enabled)
+    {
+        // the debugger acts on the live core, so is not available to observers.
+        retro_script_push_retro_table(script);
+        lua_pushnil(L);
+        lua_setfield(L, -2, "hc");
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+RETRO_SCRIPT_API void retro_script_set_observer_threads(uint32_t count)
+{
+    stop_workers(observers());
+    observers()->thread_count = count;
+}
+
+ON_DEINIT()
+{
+    observer_state* state = observers();
+    stop_workers(state);
+    free(state->batch);
+    state->batch = NULL;
+    state->batch_count = 0;
+    state->batch_capacity = 0;
+}
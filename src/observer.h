@@ -0,0 +1,39 @@
+#pragma once
+
+/* Observer scripts only read memory. Their on_run_end callbacks run on
+ * worker threads against a snapshot of memory taken after the core runs,
+ * while the front-end carries on with the frame; they are waited for at
+ * the start of the next frame (or before a script is modified).
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+#include <lua_5.4.3.h>
+
+// true on a thread running observer callbacks.
+bool retro_script_in_observer();
+
+// raises a lua error if called from an observer callback.
+// (for functions which modify state shared between scripts.)
+void retro_script_observer_check(lua_State* L, const char* what);
+
+// false when called from any callback of an observer script, including those run on the
+// main thread (e.g. on_run_begin), so that their memory writes fail.
+bool retro_script_observer_may_write(lua_State* L);
+
+// waits for observer callbacks from the previous frame to finish.
+void retro_script_observers_wait();
+
+// true while the script's on_run_end callback from the previous frame may still be running on a
+// worker, in which case its lua state must be left alone. (see retro_script_idle.)
+bool retro_script_observer_busy(const script_state_t*);
+
+// snapshots memory for observers, if there are any. call after the core runs.
+void retro_script_observers_snapshot();
+
+// starts observers' on_run_end callbacks. call at the end of the frame.
+void retro_script_observers_dispatch();
+
+// retro.set_observer([enabled])
+int retro_script_luafunc_set_observer(lua_State* L);
@@ -0,0 +1,403 @@
+#include "pack.h"
+#include "script_list.h"
+#include "util.h"
+
+#include <stdbool.h>
+
+// tables nested deeper than this are assumed to be cyclic.
+#define PACK_MAX_DEPTH 128
+
+// a buffer larger than this is freed after use rather than kept.
+#define PACK_KEEP_CAPACITY (1 << 20)
+
+typedef struct pack_writer
+{
+    lua_State* L;
+    char* data;
+    size_t len;
+    size_t capacity;
+    const char* error;
+    int bad_type; // the type which could not be packed, if any.
+} pack_writer;
+
+static bool reserve(pack_writer* w, size_t n)
+{
+    if (w->len + n <= w->capacity) return true;
+    size_t capacity = w->capacity ? w->capacity : 256;
+    while (capacity < w->len + n) capacity *= 2;
+    char* data = (char*)realloc(w->data, capacity);
+    if (!data)
+    {
+        w->error = "not enough memory";
+        return false;
+    }
+    w->data = data;
+    w->capacity = capacity;
+    return true;
+}
+
+// writes a type byte followed by size bytes of v, big-endian.
+static bool write_be(pack_writer* w, uint8_t type, uint64_t v, int size)
+{
+    if (!reserve(w, 1 + size)) return false;
+    char* p = w->data + w->len;
+    *p++ = (char)type;
+    for (int i = size - 1; i >= 0; --i)
+    {
+        *p++ = (char)(v >> (i * 8));
+    }
+    w->len += 1 + size;
+    return true;
+}
+
+static bool write_integer(pack_writer* w, lua_Integer n)
+{
+    if (n >= 0)
+    {
+        if (n < 0x80) return write_be(w, (uint8_t)n, 0, 0);
+        if (n <= UINT8_MAX) return write_be(w, 0xcc, n, 1);
+        if (n <= UINT16_MAX) return write_be(w, 0xcd, n, 2);
+        if (n <= UINT32_MAX) return write_be(w, 0xce, n, 4);
+        return write_be(w, 0xcf, n, 8);
+    }
+    if (n >= -32) return write_be(w, (uint8_t)n, 0, 0);
+    if (n >= INT8_MIN) return write_be(w, 0xd0, (uint64_t)n, 1);
+    if (n >= INT16_MIN) return write_be(w, 0xd1, (uint64_t)n, 2);
+    if (n >= INT32_MIN) return write_be(w, 0xd2, (uint64_t)n, 4);
+    return write_be(w, 0xd3, (uint64_t)n, 8);
+}
+
+static bool write_number(pack_writer* w, lua_Number n)
+{
+    uint64_t bits;
+    double d = (double)n;
+    memcpy(&bits, &d, sizeof(bits));
+    return write_be(w, 0xcb, bits, 8);
+}
+
+static bool write_string(pack_writer* w, const char* s, size_t len)
+{
+    bool ok;
+    if (len < 32) ok = write_be(w, 0xa0 | (uint8_t)len, 0, 0);
+    else if (len <= UINT8_MAX) ok = write_be(w, 0xd9, len, 1);
+    else if (len <= UINT16_MAX) ok = write_be(w, 0xda, len, 2);
+    else if (len <= UINT32_MAX) ok = write_be(w, 0xdb, len, 4);
+    else
+    {
+        w->error = "string too long";
+        return false;
+    }
+    if (!ok || !reserve(w, len)) return false;
+    memcpy(w->data + w->len, s, len);
+    w->len += len;
+    return true;
+}
+
+// fix, 16-bit and 32-bit headers for arrays (fix = 0x90, 0xdc, 0xdd) or maps (0x80, 0xde, 0xdf).
+static bool write_header(pack_writer* w, size_t count, uint8_t fix, uint8_t type16)
+{
+    if (count < 16) return write_be(w, fix | (uint8_t)count, 0, 0);
+    if (count <= UINT16_MAX) return write_be(w, type16, count, 2);
+    if (count <= UINT32_MAX) return write_be(w, type16 + 1, count, 4);
+    w->error = "table too large";
+    return false;
+}
+
+static bool write_value(pack_writer* w, int idx, int depth);
+
+static bool write_table(pack_writer* w, int idx, int depth)
+{
+    lua_State* L = w->L;
+    if (depth >= PACK_MAX_DEPTH)
+    {
+        w->error = "tables nested too deeply (or cyclic)";
+        return false;
+    }
+    if (!lua_checkstack(L, 3))
+    {
+        w->error = "stack overflow";
+        return false;
+    }
+    
+    // it's an array if its keys are exactly 1..n.
+    const lua_Unsigned len = lua_rawlen(L, idx);
+    size_t count = 0;
+    bool is_array = true;
+    lua_pushnil(L);
+    while (lua_next(L, idx))
+    {
+        lua_pop(L, 1);
+        count++;
+        if (is_array)
+        {
+            const lua_Integer k = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : 0;
+            is_array = k >= 1 && (lua_Unsigned)k <= len;
+        }
+    }
+    is_array = is_array && count == len;
+    
+    if (is_array)
+    {
+        if (!write_header(w, count, 0x90, 0xdc)) return false;
+        for (lua_Unsigned i = 1; i <= len; ++i)
+        {
+            lua_rawgeti(L, idx, i);
+            const bool ok = write_value(w, lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+            if (!ok) return false;
+        }
+        return true;
+    }
+    
+    if (!write_header(w, count, 0x80, 0xde)) return false;
+    lua_pushnil(L);
+    while (lua_next(L, idx))
+    {
+        const int top = lua_gettop(L);
+        if (!write_value(w, top - 1, depth + 1) || !write_value(w, top, depth + 1))
+        {
+            lua_pop(L, 2);
+            return false;
+        }
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
+// idx must be absolute.
+static bool write_value(pack_writer* w, int idx, int depth)
+{
+    lua_State* L = w->L;
+    switch (lua_type(L, idx))
+    {
+    case LUA_TNIL:
+        return write_be(w, 0xc0, 0, 0);
+    case LUA_TBOOLEAN:
+        return write_be(w, lua_toboolean(L, idx) ? 0xc3 : 0xc2, 0, 0);
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) return write_integer(w, lua_tointeger(L, idx));
+        return write_number(w, lua_tonumber(L, idx));
+    case LUA_TSTRING:
+    {
+        size_t len;
+        const char* s = lua_tolstring(L, idx, &len);
+        return write_string(w, s, len);
+    }
+    case LUA_TTABLE:
+        return write_table(w, idx, depth);
+    default:
+        w->bad_type = lua_type(L, idx);
+        return false;
+    }
+}
+
+void retro_script_pack_release(script_state_t* script)
+{
+    free(script->pack.data);
+    script->pack.data = NULL;
+    script->pack.capacity = 0;
+}
+
+// lua args: value
+//      ret: string
+int retro_script_luafunc_pack(lua_State* L)
+{
+    luaL_checkany(L, 1);
+    lua_settop(L, 1);
+    script_state_t* script = script_find_lua(L);
+    
+    pack_writer w;
+    w.L = L;
+    w.data = script->pack.data;
+    w.len = 0;
+    w.capacity = script->pack.capacity;
+    w.error = NULL;
+    w.bad_type = LUA_TNONE;
+    const bool ok = write_value(&w, 1, 0);
+    script->pack.data = w.data;
+    script->pack.capacity = w.capacity;
+    
+    // (no lua errors are raised while packing, so the buffer is kept here.)
+    if (ok)
+    {
+        lua_pushlstring(L, w.data, w.len);
+    }
+    if (script->pack.capacity > PACK_KEEP_CAPACITY)
+    {
+        retro_script_pack_release(script);
+    }
+    if (!ok && w.bad_type != LUA_TNONE)
+    {
+        return luaL_error(L, "cannot pack a value of type %s", lua_typename(L, w.bad_type));
+    }
+    if (!ok)
+    {
+        return luaL_error(L, "unable to pack: %s", w.error);
+    }
+    return 1;
+}
+
+typedef struct unpack_reader
+{
+    lua_State* L;
+    const uint8_t* start;
+    const uint8_t* p;
+    const uint8_t* end;
+} unpack_reader;
+
+static void need(unpack_reader* r, size_t n)
+{
+    if ((size_t)(r->end - r->p) < n)
+    {
+        luaL_error(r->L, "unable to unpack: data ends unexpectedly at position %d", (int)(r->p - r->start) + 1);
+    }
+}
+
+static uint64_t read_be(unpack_reader* r, int size)
+{
+    need(r, size);
+    uint64_t v = 0;
+    for (int i = 0; i < size; ++i)
+    {
+        v = (v << 8) | *r->p++;
+    }
+    return v;
+}
+
+static void read_value(unpack_reader* r, int depth);
+
+static void read_string(unpack_reader* r, size_t len)
+{
+    need(r, len);
+    lua_pushlstring(r->L, (const char*)r->p, len);
+    r->p += len;
+}
+
+static void read_array(unpack_reader* r, size_t count, int depth)
+{
+    lua_State* L = r->L;
+    
+    // (each element takes at least a byte, which limits how much a bad count can allocate.)
+    need(r, count);
+    lua_createtable(L, (int)count, 0);
+    for (size_t i = 1; i <= count; ++i)
+    {
+        read_value(r, depth + 1);
+        lua_rawseti(L, -2, i);
+    }
+}
+
+static void read_map(unpack_reader* r, size_t count, int depth)
+{
+    lua_State* L = r->L;
+    need(r, count * 2);
+    lua_createtable(L, 0, (int)count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        read_value(r, depth + 1);
+        if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+        {
+            luaL_error(L, "unable to unpack: invalid table key at position %d", (int)(r->p - r->start));
+        }
+        read_value(r, depth + 1);
+        lua_rawset(L, -3);
+    }
+}
+
+static void read_value(unpack_reader* r, int depth)
+{
+    lua_State* L = r->L;
+    if (depth >= PACK_MAX_DEPTH)
+    {
+        luaL_error(L, "unable to unpack: tables nested too deeply");
+    }
+    luaL_checkstack(L, 3, "unable to unpack");
+    need(r, 1);
+    const uint8_t type = *r->p++;
+    
+    if (type < 0x80)
+    {
+        lua_pushinteger(L, type);
+    }
+    else if (type >= 0xe0)
+    {
+        lua_pushinteger(L, (int8_t)type);
+    }
+    else if ((type & 0xf0) == 0x80)
+    {
+        read_map(r, type & 0x0f, depth);
+    }
+    else if ((type & 0xf0) == 0x90)
+    {
+        read_array(r, type & 0x0f, depth);
+    }
+    else if ((type & 0xe0) == 0xa0)
+    {
+        read_string(r, type & 0x1f);
+    }
+    else switch (type)
+    {
+    case 0xc0: lua_pushnil(L); break;
+    case 0xc2: lua_pushboolean(L, false); break;
+    case 0xc3: lua_pushboolean(L, true); break;
+        
+    // (binary data is read as a string too.)
+    case 0xc4: case 0xd9: read_string(r, read_be(r, 1)); break;
+    case 0xc5: case 0xda: read_string(r, read_be(r, 2)); break;
+    case 0xc6: case 0xdb: read_string(r, read_be(r, 4)); break;
+        
+    case 0xca:
+    {
+        const uint32_t bits = (uint32_t)read_be(r, 4);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        lua_pushnumber(L, f);
+        break;
+    }
+    case 0xcb:
+    {
+        const uint64_t bits = read_be(r, 8);
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        lua_pushnumber(L, d);
+        break;
+    }
+        
+    // (uint64 values above INT64_MAX wrap around, as lua integers do.)
+    case 0xcc: lua_pushinteger(L, (lua_Integer)read_be(r, 1)); break;
+    case 0xcd: lua_pushinteger(L, (lua_Integer)read_be(r, 2)); break;
+    case 0xce: lua_pushinteger(L, (lua_Integer)read_be(r, 4)); break;
+    case 0xcf: lua_pushinteger(L, (lua_Integer)read_be(r, 8)); break;
+    case 0xd0: lua_pushinteger(L, (int8_t)read_be(r, 1)); break;
+    case 0xd1: lua_pushinteger(L, (int16_t)read_be(r, 2)); break;
+    case 0xd2: lua_pushinteger(L, (int32_t)read_be(r, 4)); break;
+    case 0xd3: lua_pushinteger(L, (int64_t)read_be(r, 8)); break;
+        
+    case 0xdc: read_array(r, read_be(r, 2), depth); break;
+    case 0xdd: read_array(r, read_be(r, 4), depth); break;
+    case 0xde: read_map(r, read_be(r, 2), depth); break;
+    case 0xdf: read_map(r, read_be(r, 4), depth); break;
+        
+    default:
+        luaL_error(L, "unable to unpack: unsupported type byte %d at position %d", (int)type, (int)(r->p - r->start));
+    }
+}
+
+// lua args: string, [position=1]
+//      ret: value, position after it
+int retro_script_luafunc_unpack(lua_State* L)
+{
+    size_t len;
+    const char* s = luaL_checklstring(L, 1, &len);
+    const lua_Integer pos = luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, pos >= 1 && (lua_Unsigned)pos <= len + 1, 2, "position out of range");
+    
+    unpack_reader r;
+    r.L = L;
+    r.start = (const uint8_t*)s;
+    r.p = r.start + pos - 1;
+    r.end = r.start + len;
+    read_value(&r, 0);
+    lua_pushinteger(L, (r.p - r.start) + 1);
+    return 2;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+/* Binary serialization of lua values: retro.pack, retro.unpack.
+ * The format is MessagePack: nil, booleans, integers, floats, strings and tables
+ * (as arrays if their keys are exactly 1..n, otherwise as maps).
+ * Packing uses a buffer kept by the script, so repeated calls don't allocate.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+#include <lua_5.4.3.h>
+
+// frees the script's pack buffer.
+void retro_script_pack_release(script_state_t*);
+
+// lua args: value
+//      ret: string
+int retro_script_luafunc_pack(lua_State* L);
+
+// lua args: string, [position=1]
+//      ret: value, position after it
+int retro_script_luafunc_unpack(lua_State* L);
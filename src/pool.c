@@ -0,0 +1,409 @@
+#include "pool.h"
+#include "script.h"
+#include "script_list.h"
+#include "thread.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+#include <stdio.h>
+
+// registry field holding the snapshot of a pristine state.
+#define POOL_SNAPSHOT "retro_script.pristine"
+
+typedef struct pooled_state
+{
+    lua_State* L;
+    retro_script_heap_t* heap;
+} pooled_state;
+
+// the pool is shared by all contexts; this guards the three below.
+static retro_script_mutex_t mutex;
+static pooled_state* pool = NULL;
+static size_t pool_count = 0;
+static size_t pool_capacity = 4;
+
+INITIALIZER(pool_init_mutex)
+{
+    retro_script_mutex_init(&mutex);
+}
+
+// same as lauxlib's default, which luaL_newstate would have set.
+static int panic(lua_State* L)
+{
+    const char* msg = lua_tostring(L, -1);
+    if (msg == NULL) msg = "error object is not a string";
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg);
+    fflush(stderr);
+    return 0;
+}
+
+// stack slots used while taking a snapshot.
+#define SNAP_TABLES 2
+#define SNAP_METATABLES 3
+#define SNAP_UPVALUES 4
+#define SNAP_PENDING 5
+#define SNAP_SEEN 6
+
+// queues the value at idx to be snapshotted.
+static void snapshot_push(lua_State* L, int idx, lua_Integer* pending)
+{
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, SNAP_PENDING, ++*pending);
+}
+
+// snapshots the value on top of the stack (and pops it), queueing everything it refers to.
+// tables are copied, userdata and tables have their metatable recorded, and functions their upvalues.
+static void snapshot_value(lua_State* L, lua_Integer* pending)
+{
+    const int type = lua_type(L, -1);
+    if (type != LUA_TTABLE && type != LUA_TUSERDATA && type != LUA_TFUNCTION)
+    {
+        lua_pop(L, 1);
+        return;
+    }
+    
+    const int value = lua_gettop(L);
+    lua_pushvalue(L, value);
+    if (lua_rawget(L, SNAP_SEEN) != LUA_TNIL)
+    {
+        lua_settop(L, value - 1);
+        return;
+    }
+    lua_pushvalue(L, value);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, SNAP_SEEN);
+    lua_settop(L, value);
+    
+#ifdef RETRO_SCRIPT_LUAJIT
+    // (functions and userdata have environment tables, which are restored like any other table.)
+    if (type != LUA_TTABLE)
+    {
+        lua_getfenv(L, value);
+        snapshot_push(L, -1, pending);
+        lua_pop(L, 1);
+    }
+#endif
+    
+    if (type == LUA_TFUNCTION)
+    {
+        lua_newtable(L);
+        int n = 0;
+        while (lua_getupvalue(L, value, n + 1))
+        {
+            snapshot_push(L, -1, pending);
+            lua_rawseti(L, -2, ++n);
+        }
+        if (n > 0)
+        {
+            lua_pushvalue(L, value);
+            lua_insert(L, -2);
+            lua_rawset(L, SNAP_UPVALUES);
+        }
+        lua_settop(L, value - 1);
+        return;
+    }
+    
+    if (type == LUA_TTABLE)
+    {
+        lua_pushvalue(L, value);
+        lua_newtable(L);
+        lua_pushnil(L);
+        while (lua_next(L, value))
+        {
+            snapshot_push(L, -2, pending);
+            snapshot_push(L, -1, pending);
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        }
+        lua_rawset(L, SNAP_TABLES);
+    }
+    
+    // (false for none, so that a metatable set later is removed.)
+    lua_pushvalue(L, value);
+    if (lua_getmetatable(L, value)) snapshot_push(L, -1, pending);
+    else lua_pushboolean(L, 0);
+    lua_rawset(L, SNAP_METATABLES);
+    lua_settop(L, value - 1);
+}
+
+// snapshots everything reachable from the registry and the string metatable, so it can be restored later.
+// snapshot: { tables = { [t] = copy of t }, metatables = { [t or userdata] = its metatable, or false },
+//     upvalues = { [f] = { upvalues of f } }, string_mt = metatable for strings }
+static int take_snapshot(lua_State* L)
+{
+    lua_settop(L, 0);
+    lua_newtable(L);
+    for (int i = SNAP_TABLES; i <= SNAP_SEEN; ++i)
+    {
+        lua_newtable(L);
+    }
+    lua_pushvalue(L, SNAP_TABLES);
+    lua_setfield(L, 1, "tables");
+    lua_pushvalue(L, SNAP_METATABLES);
+    lua_setfield(L, 1, "metatables");
+    lua_pushvalue(L, SNAP_UPVALUES);
+    lua_setfield(L, 1, "upvalues");
+    
+    // the snapshot's own tables are left out of it.
+    for (int i = 1; i <= SNAP_SEEN; ++i)
+    {
+        lua_pushvalue(L, i);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, SNAP_SEEN);
+    }
+    lua_pushvalue(L, 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, POOL_SNAPSHOT);
+    
+    lua_Integer pending = 0;
+    lua_pushliteral(L, "");
+    lua_getmetatable(L, -1);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, 1, "string_mt");
+    snapshot_push(L, -1, &pending);
+    lua_settop(L, SNAP_SEEN);
+    
+    // (the registry holds the globals, package.loaded, and the metatables of library userdata.)
+    snapshot_push(L, LUA_REGISTRYINDEX, &pending);
+    while (pending > 0)
+    {
+        lua_rawgeti(L, SNAP_PENDING, pending);
+        lua_pushnil(L);
+        lua_rawseti(L, SNAP_PENDING, pending--);
+        snapshot_value(L, &pending);
+    }
+    lua_settop(L, 0);
+    return 0;
+}
+
+// restores each table in the snapshot from its copy, then metatables and upvalues.
+static int restore_snapshot(lua_State* L)
+{
+    lua_settop(L, 0);
+    if (lua_getfield(L, LUA_REGISTRYINDEX, POOL_SNAPSHOT) != LUA_TTABLE)
+    {
+        return luaL_error(L, "pooled state has no snapshot");
+    }
+    lua_getfield(L, 1, "tables");
+    
+    // tables: 2, table: 3, copy: 4
+    lua_pushnil(L);
+    while (lua_next(L, 2))
+    {
+        // remove fields not in the copy. (clearing fields while traversing is allowed.)
+        lua_pushnil(L);
+        while (lua_next(L, 3))
+        {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            if (lua_rawget(L, 4) == LUA_TNIL)
+            {
+                lua_pushvalue(L, -2);
+                lua_pushnil(L);
+                lua_rawset(L, 3);
+            }
+            lua_pop(L, 1);
+        }
+        
+        // then restore the copied fields.
+        lua_pushnil(L);
+        while (lua_next(L, 4))
+        {
+            lua_pushvalue(L, -2);
+            lua_rotate(L, -2, 1);
+            lua_rawset(L, 3);
+        }
+        lua_pop(L, 1);
+    }
+    lua_settop(L, 1);
+    
+    // metatables: 2, value: 3, metatable: 4
+    lua_getfield(L, 1, "metatables");
+    lua_pushnil(L);
+    while (lua_next(L, 2))
+    {
+        if (!lua_toboolean(L, 4))
+        {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+        }
+        lua_setmetatable(L, 3);
+    }
+    lua_settop(L, 1);
+    
+    // upvalues: 2, function: 3, list: 4
+    lua_getfield(L, 1, "upvalues");
+    lua_pushnil(L);
+    while (lua_next(L, 2))
+    {
+        for (int i = 1; ; ++i)
+        {
+            lua_rawgeti(L, 4, i);
+            if (!lua_setupvalue(L, 3, i)) break;
+        }
+        lua_pop(L, 2);
+    }
+    lua_settop(L, 0);
+    return 0;
+}
+
+static void pristine_metatables(lua_State* L)
+{
+    // metatables for types other than tables and userdata can be set by the debug library.
+    lua_settop(L, 0);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_setmetatable(L, -2);
+    lua_pushboolean(L, 0);
+    lua_pushnil(L);
+    lua_setmetatable(L, -2);
+    lua_pushinteger(L, 0);
+    lua_pushnil(L);
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, NULL);
+    lua_pushnil(L);
+    lua_setmetatable(L, -2);
+    lua_pushcfunction(L, restore_snapshot);
+    lua_pushnil(L);
+    lua_setmetatable(L, -2);
+    lua_pushthread(L);
+    lua_pushnil(L);
+    lua_setmetatable(L, -2);
+    
+    lua_settop(L, 0);
+    lua_getfield(L, LUA_REGISTRYINDEX, POOL_SNAPSHOT);
+    lua_pushliteral(L, "");
+    lua_getfield(L, 1, "string_mt");
+    lua_setmetatable(L, -2);
+    lua_settop(L, 0);
+}
+
+static lua_State* pool_create(retro_script_heap_t** heap)
+{
+    *heap = retro_script_heap_create(0);
+    if (!*heap) return NULL;
+    
+    lua_State* L = lua_newstate(retro_script_heap_lua_alloc, *heap);
+    if (!L)
+    {
+        retro_script_heap_destroy(*heap);
+        return NULL;
+    }
+    lua_atpanic(L, panic);
+    
+    // (new threads copy the main thread's binding, so all find the heap's owner.)
+    script_bind_thread(L, retro_script_heap_owner(*heap));
+    
+    lua_pushcfunction(L, retro_script_lua_open_libs);
+    bool ok = lua_pcall(L, 0, 0, 0) == LUA_OK;
+    lua_pushcfunction(L, take_snapshot);
+    ok = ok && lua_pcall(L, 0, 0, 0) == LUA_OK;
+    lua_settop(L, 0);
+    if (!ok)
+    {
+        lua_close(L);
+        retro_script_heap_destroy(*heap);
+        return NULL;
+    }
+    
+    return L;
+}
+
+lua_State* retro_script_pool_acquire(retro_script_heap_t** heap, size_t memory_limit)
+{
+    lua_State* L = NULL;
+    retro_script_mutex_lock(&mutex);
+    if (pool_count > 0)
+    {
+        pool_count--;
+        L = pool[pool_count].L;
+        *heap = pool[pool_count].heap;
+    }
+    retro_script_mutex_unlock(&mutex);
+    
+    if (!L)
+    {
+        L = pool_create(heap);
+        if (!L) return NULL;
+    }
+    
+    retro_script_heap_set_limit(*heap, memory_limit);
+    return L;
+}
+
+void retro_script_pool_release(lua_State* L, retro_script_heap_t* heap)
+{
+    // (checked again once reset, as the state is reset without holding the lock.)
+    retro_script_mutex_lock(&mutex);
+    const bool full = pool_count >= pool_capacity;
+    retro_script_mutex_unlock(&mutex);
+    if (full) goto close;
+    
+    // finalize the script's objects while its globals still exist, then reset to pristine.
+    // (the hook is kept until then, so that finalizers are held to the script's budget.)
+    retro_script_heap_set_limit(heap, 0);
+    lua_settop(L, 0);
+    lua_gc(L, LUA_GCRESTART);
+    lua_gc(L, LUA_GCCOLLECT);
+    lua_pushcfunction(L, restore_snapshot);
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK) goto close;
+    pristine_metatables(L);
+    lua_gc(L, LUA_GCCOLLECT);
+    lua_gc(L, LUA_GCCOLLECT);
+    lua_settop(L, 0);
+    lua_sethook(L, NULL, 0, 0);
+    
+    retro_script_heap_reset_stats(heap);
+    *retro_script_heap_owner(heap) = NULL;
+    
+    retro_script_mutex_lock(&mutex);
+    if (!pool && pool_capacity) pool = malloc_array(pooled_state, pool_capacity);
+    const bool added = pool && pool_count < pool_capacity;
+    if (added)
+    {
+        pool[pool_count].L = L;
+        pool[pool_count].heap = heap;
+        pool_count++;
+    }
+    retro_script_mutex_unlock(&mutex);
+    if (added) return;
+    
+close:
+    lua_close(L);
+    retro_script_heap_destroy(heap);
+}
+
+RETRO_SCRIPT_API void retro_script_set_state_pool_size(uint32_t count)
+{
+    retro_script_mutex_lock(&mutex);
+    
+    // close any states over the new size.
+    while (pool_count > count)
+    {
+        pool_count--;
+        lua_close(pool[pool_count].L);
+        retro_script_heap_destroy(pool[pool_count].heap);
+    }
+    
+    pooled_state* resized = count ? realloc(pool, sizeof(pooled_state) * count) : NULL;
+    if (count && !resized)
+    {
+        retro_script_mutex_unlock(&mutex);
+        return;
+    }
+    if (!count && pool) free(pool);
+    pool = resized;
+    pool_capacity = count;
+    
+    // pre-build states up to the new size.
+    while (pool_count < pool_capacity)
+    {
+        retro_script_heap_t* heap;
+        lua_State* L = pool_create(&heap);
+        if (!L) break;
+        pool[pool_count].L = L;
+        pool[pool_count].heap = heap;
+        pool_count++;
+    }
+    retro_script_mutex_unlock(&mutex);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+/* A pool of lua states which have their libraries already opened.
+ * States of freed scripts are reset to a snapshot of their pristine
+ * globals and registry, then returned to the pool for reuse.
+ */
+
+#include "libretro_script.h"
+#include "heap.h"
+
+struct lua_State;
+
+// returns a pristine lua state with libraries open, and its heap,
+// either from the pool or newly created. returns NULL if not enough memory.
+struct lua_State* retro_script_pool_acquire(retro_script_heap_t** heap, size_t memory_limit);
+
+// returns the lua state to the pool, or closes it (and destroys its heap) if the pool is full.
+void retro_script_pool_release(struct lua_State* L, retro_script_heap_t* heap);
@@ -0,0 +1,29 @@
+#pragma once
+
+/* Static tracepoints (USDT) for perf, bpftrace, systemtap etc., under the provider "retro_script".
+ * They are compiled out unless built with USDT=1, which needs <sys/sdt.h> (e.g. from systemtap-sdt-dev);
+ * when compiled in, each costs a nop until a tracer attaches. The probes and their arguments:
+ *   frame_begin()                          the intercepted retro_run was called
+ *   frame_end()                            ...and is returning
+ *   callback_entry(script_id, kind)        a retro.on_run_* callback is called (kind is a retro_script_callback_kind_t)
+ *   callback_exit(script_id, kind, status) ...and returned; status is the lua status (0 if ok)
+ *   memmap_miss(address)                   no memory descriptor covers the address
+ *   breakpoint(breakpoint_id)              a breakpoint set by a script fired
+ *   load_begin(script_id, path)            a script is being loaded (or reloaded)
+ *   load_end(script_id, ok)                ...and has finished loading
+ *   unload(script_id)                      a script is unloaded
+ * e.g. bpftrace -e 'usdt:./libretro_script.so:retro_script:callback_entry { @[arg0] = count(); }'
+ */
+
+#ifdef RETRO_SCRIPT_USDT
+#include <sys/sdt.h>
+#define PROBE0(name) DTRACE_PROBE(retro_script, name)
+#define PROBE1(name, a) DTRACE_PROBE1(retro_script, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(retro_script, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(retro_script, name, a, b, c)
+#else
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
@@ -0,0 +1,373 @@
+#include "profiler.h"
+#include "script_list.h"
+#include "hashmap.h"
+#include "hook.h"
+#include "observer.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+#include <stdio.h>
+
+#define PROFILE_DEFAULT_PERIOD 10000
+
+// deeper stacks keep only their innermost frames.
+#define PROFILE_MAX_FRAMES 32
+#define PROFILE_FRAME_MAX 96
+
+typedef struct profile_entry
+{
+    char* name;
+    uint64_t weight;
+} profile_entry;
+
+typedef struct retro_script_profile
+{
+    // the mode the profile was started in, kept once it is stopped.
+    retro_script_profile_mode_t mode;
+    uint32_t period;
+    bool running;
+    
+    // instructions since the last sample.
+    uint64_t pending;
+    uint64_t total;
+    
+    // folded stack, innermost function, and innermost line -> weight.
+    struct retro_script_hashmap* stacks;
+    struct retro_script_hashmap* functions;
+    struct retro_script_hashmap* lines;
+} retro_script_profile;
+
+static void record(struct retro_script_hashmap* map, const char* name, uint64_t weight)
+{
+    // (names with the same hash go at the next free index.)
+    for (size_t index = retro_script_fnv1a(name, strlen(name));; ++index)
+    {
+        profile_entry* entry = (profile_entry*)retro_script_hashmap_get(map, index);
+        if (entry && strcmp(entry->name, name) == 0)
+        {
+            entry->weight += weight;
+            return;
+        }
+        if (entry) continue;
+        
+        entry = (profile_entry*)retro_script_hashmap_add(map, index);
+        if (!entry) return;
+        entry->name = retro_script_strdup(name);
+        entry->weight = weight;
+        if (!entry->name) retro_script_hashmap_remove(map, index);
+        return;
+    }
+}
+
+static int free_entry(size_t index, void* data, void* ud)
+{
+    free(((profile_entry*)data)->name);
+    return 1;
+}
+
+static void map_destroy(struct retro_script_hashmap* map)
+{
+    if (!map) return;
+    retro_script_hashmap_foreach(map, free_entry, NULL);
+    retro_script_hashmap_destroy(map);
+}
+
+void retro_script_profiler_release(script_state_t* script)
+{
+    retro_script_profile* profile = script->profile;
+    if (!profile) return;
+    map_destroy(profile->stacks);
+    map_destroy(profile->functions);
+    map_destroy(profile->lines);
+    free(profile);
+    script->profile = NULL;
+}
+
+// e.g. "update@script.lua:12", "main@script.lua" or "read_byte [C]".
+static void frame_name(lua_Debug* ar, char* out, size_t size)
+{
+    if (*ar->what == 'C')
+    {
+        snprintf(out, size, "%s [C]", ar->name ? ar->name : "?");
+    }
+    else if (*ar->what == 'm')
+    {
+        snprintf(out, size, "main@%s", ar->short_src);
+    }
+    else
+    {
+        snprintf(out, size, "%s@%s:%d", ar->name ? ar->name : "(anonymous)", ar->short_src, ar->linedefined);
+    }
+    
+    // ';' separates frames in the folded format.
+    for (char* c = out; *c; ++c)
+    {
+        if (*c == ';') *c = ',';
+    }
+}
+
+static void profile_sample(retro_script_profile* profile, lua_State* L, uint64_t weight)
+{
+    char frames[PROFILE_MAX_FRAMES][PROFILE_FRAME_MAX];
+    char line[PROFILE_FRAME_MAX] = "";
+    lua_Debug ar;
+    int depth = 0;
+    int level = 0;
+    for (; depth < PROFILE_MAX_FRAMES && lua_getstack(L, level, &ar); ++level)
+    {
+        if (!lua_getinfo(L, "Sln", &ar)) break;
+        frame_name(&ar, frames[depth++], PROFILE_FRAME_MAX);
+        if (!*line && ar.currentline > 0)
+        {
+            snprintf(line, sizeof(line), "%s:%d", ar.short_src, ar.currentline);
+        }
+    }
+    if (depth == 0) return;
+    const bool truncated = lua_getstack(L, level, &ar);
+    
+    // outermost first.
+    char stack[PROFILE_MAX_FRAMES * PROFILE_FRAME_MAX + 16];
+    size_t len = 0;
+    if (truncated)
+    {
+        memcpy(stack, "...", 3);
+        len = 3;
+    }
+    for (int i = depth - 1; i >= 0; --i)
+    {
+        const size_t n = strlen(frames[i]);
+        if (len) stack[len++] = ';';
+        memcpy(stack + len, frames[i], n);
+        len += n;
+    }
+    stack[len] = 0;
+    
+    record(profile->stacks, stack, weight);
+    record(profile->functions, frames[0], weight);
+    if (*line) record(profile->lines, line, weight);
+    profile->total += weight;
+}
+
+void retro_script_profiler_count(script_state_t* script, lua_State* L, int count)
+{
+    retro_script_profile* profile = script->profile;
+    if (!profile || !profile->running || profile->mode != RETRO_SCRIPT_PROFILE_SAMPLE) return;
+    
+    // (the hook may run more often than the sample period, for the watchdog.)
+    profile->pending += count;
+    if (profile->pending < profile->period) return;
+    profile_sample(profile, L, profile->pending);
+    profile->pending = 0;
+}
+
+void retro_script_profiler_line(script_state_t* script, lua_State* L, lua_Debug* ar)
+{
+    retro_script_profile* profile = script->profile;
+    if (!profile || !profile->running || profile->mode != RETRO_SCRIPT_PROFILE_EXACT) return;
+    profile_sample(profile, L, 1);
+}
+
+uint32_t retro_script_profiler_hook_count(script_state_t* script)
+{
+    const retro_script_profile* profile = script->profile;
+    return (profile && profile->running && profile->mode == RETRO_SCRIPT_PROFILE_SAMPLE) ? profile->period : 0;
+}
+
+bool retro_script_profiler_hook_lines(script_state_t* script)
+{
+    const retro_script_profile* profile = script->profile;
+    return profile && profile->running && profile->mode == RETRO_SCRIPT_PROFILE_EXACT;
+}
+
+// starts profiling afresh, or stops (keeping the profile).
+static bool profile_start(script_state_t* script, retro_script_profile_mode_t mode, uint32_t period)
+{
+    if (mode == RETRO_SCRIPT_PROFILE_OFF)
+    {
+        if (script->profile) script->profile->running = false;
+        retro_script_hook_install(script, script->L);
+        return true;
+    }
+    
+    retro_script_profiler_release(script);
+    retro_script_profile* profile = alloc(retro_script_profile);
+    if (!profile) return false;
+    memset(profile, 0, sizeof(retro_script_profile));
+    profile->mode = mode;
+    profile->period = period ? period : PROFILE_DEFAULT_PERIOD;
+    profile->running = true;
+    profile->stacks = retro_script_hashmap_create(sizeof(profile_entry));
+    profile->functions = retro_script_hashmap_create(sizeof(profile_entry));
+    profile->lines = retro_script_hashmap_create(sizeof(profile_entry));
+    script->profile = profile;
+    if (!profile->stacks || !profile->functions || !profile->lines)
+    {
+        retro_script_profiler_release(script);
+        return false;
+    }
+    
+    retro_script_hook_install(script, script->L);
+    return true;
+}
+
+RETRO_SCRIPT_API bool retro_script_set_profiling(retro_script_id_t id, retro_script_profile_mode_t mode, uint32_t sample_period)
+{
+    retro_script_observers_wait();
+    script_state_t* script = script_find(id);
+    return script && profile_start(script, mode, sample_period);
+}
+
+typedef struct folded_writer
+{
+    char* buffer;
+    size_t size;
+    size_t len;
+} folded_writer;
+
+static int write_folded(size_t index, void* data, void* ud)
+{
+    profile_entry* entry = (profile_entry*)data;
+    folded_writer* w = (folded_writer*)ud;
+    const size_t room = (w->len < w->size) ? w->size - w->len : 0;
+    const int n = snprintf(room ? w->buffer + w->len : NULL, room, "%s %llu\n", entry->name, (unsigned long long)entry->weight);
+    if (n > 0) w->len += n;
+    return 0;
+}
+
+RETRO_SCRIPT_API size_t retro_script_get_profile_folded(retro_script_id_t id, char* buffer, size_t size)
+{
+    retro_script_observers_wait();
+    script_state_t* script = script_find(id);
+    if (buffer && size) *buffer = 0;
+    if (!script || !script->profile) return 0;
+    
+    folded_writer w = { buffer, buffer ? size : 0, 0 };
+    retro_script_hashmap_foreach(script->profile->stacks, write_folded, &w);
+    return w.len;
+}
+
+// lua args: [mode="sample"], [period]
+int retro_script_luafunc_profile_start(lua_State* L)
+{
+    static const char* const modes[] = { "sample", "exact", NULL };
+    const int mode = luaL_checkoption(L, 1, "sample", modes);
+    const lua_Integer period = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, period >= 0 && period <= INT32_MAX, 2, "period out of range");
+    
+    script_state_t* script = script_find_lua(L);
+    if (!profile_start(script, mode == 0 ? RETRO_SCRIPT_PROFILE_SAMPLE : RETRO_SCRIPT_PROFILE_EXACT, (uint32_t)period))
+    {
+        return luaL_error(L, "unable to allocate profile");
+    }
+    
+    // (if called from a coroutine, it has its own hook.)
+    if (L != script->L) retro_script_hook_install(script, L);
+    return 0;
+}
+
+int retro_script_luafunc_profile_stop(lua_State* L)
+{
+    script_state_t* script = script_find_lua(L);
+    profile_start(script, RETRO_SCRIPT_PROFILE_OFF, 0);
+    if (L != script->L) retro_script_hook_install(script, L);
+    return 0;
+}
+
+typedef struct entry_list
+{
+    profile_entry** entries;
+    size_t count;
+} entry_list;
+
+static int collect_entry(size_t index, void* data, void* ud)
+{
+    entry_list* list = (entry_list*)ud;
+    if (list->entries) list->entries[list->count] = (profile_entry*)data;
+    list->count++;
+    return 0;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    const uint64_t wa = (*(profile_entry* const*)a)->weight;
+    const uint64_t wb = (*(profile_entry* const*)b)->weight;
+    return (wa < wb) - (wa > wb);
+}
+
+// pushes a userdata holding the map's entries, heaviest first. (a userdata, so it's freed even on error.)
+static entry_list sorted_entries(lua_State* L, struct retro_script_hashmap* map)
+{
+    entry_list list = { NULL, 0 };
+    retro_script_hashmap_foreach(map, collect_entry, &list);
+    list.entries = (profile_entry**)lua_newuserdata(L, sizeof(profile_entry*) * (list.count ? list.count : 1));
+    list.count = 0;
+    retro_script_hashmap_foreach(map, collect_entry, &list);
+    qsort(list.entries, list.count, sizeof(profile_entry*), compare_entries);
+    return list;
+}
+
+// adds the heaviest entries to the buffer.
+static void report_section(luaL_Buffer* b, const entry_list* list, const char* title, uint64_t total, lua_Integer max)
+{
+    luaL_addstring(b, "\n  self  ");
+    luaL_addstring(b, title);
+    luaL_addchar(b, '\n');
+    for (size_t i = 0; i < list->count && (lua_Integer)i < max; ++i)
+    {
+        char line[PROFILE_FRAME_MAX + 32];
+        snprintf(line, sizeof(line), "%5.1f%%  %s\n", 100.0 * list->entries[i]->weight / (total ? total : 1), list->entries[i]->name);
+        luaL_addstring(b, line);
+    }
+}
+
+// args: max entries, profile (light userdata), whether it was running before the report
+//  ret: string
+static int report(lua_State* L)
+{
+    const lua_Integer max = lua_tointeger(L, 1);
+    const retro_script_profile* profile = (const retro_script_profile*)lua_touserdata(L, 2);
+    const bool running = lua_toboolean(L, 3);
+    
+    // (the sorted entries stay on the stack below the buffer while it is in use.)
+    const entry_list functions = sorted_entries(L, profile->functions);
+    const entry_list lines = sorted_entries(L, profile->lines);
+    
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    char header[96];
+    snprintf(header, sizeof(header), "%llu %s %s\n", (unsigned long long)profile->total,
+        profile->mode == RETRO_SCRIPT_PROFILE_EXACT ? "lines" : "instructions",
+        running ? "so far" : "(stopped)");
+    luaL_addstring(&b, header);
+    report_section(&b, &functions, "function", profile->total, max);
+    report_section(&b, &lines, "line", profile->total, max);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+// lua args: [count=10]
+//      ret: string
+int retro_script_luafunc_profile_report(lua_State* L)
+{
+    const lua_Integer max = luaL_optinteger(L, 1, 10);
+    script_state_t* script = script_find_lua(L);
+    retro_script_profile* profile = script->profile;
+    if (!profile)
+    {
+        lua_pushliteral(L, "no profile (see retro.profile_start)");
+        return 1;
+    }
+    
+    // the entries must not change while the report is built, so profiling is paused,
+    // and the report is built protected so that profiling resumes even if it fails.
+    const bool running = profile->running;
+    profile->running = false;
+    lua_pushcfunction(L, report);
+    lua_pushinteger(L, max);
+    lua_pushlightuserdata(L, profile);
+    lua_pushboolean(L, running);
+    const int status = lua_pcall(L, 3, 1, 0);
+    profile->running = running;
+    if (status != LUA_OK) return lua_error(L);
+    return 1;
+}
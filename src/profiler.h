@@ -0,0 +1,36 @@
+#pragma once
+
+/* A per-script profiler. In sample mode, the call stack is recorded every so many
+ * instructions (from the count hook, see hook.c), weighted by the instructions since the last sample;
+ * in exact mode, every line executed is recorded. Records are aggregated by stack, function and line.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+struct lua_State;
+struct lua_Debug;
+
+// called from the count hook, every count instructions.
+void retro_script_profiler_count(script_state_t*, struct lua_State* L, int count);
+
+// called from the line hook.
+void retro_script_profiler_line(script_state_t*, struct lua_State* L, struct lua_Debug* ar);
+
+// how often the profiler needs the count hook to run, or 0 if not at all.
+uint32_t retro_script_profiler_hook_count(script_state_t*);
+
+// true if the profiler needs the line hook.
+bool retro_script_profiler_hook_lines(script_state_t*);
+
+// frees the script's profile.
+void retro_script_profiler_release(script_state_t*);
+
+// retro.profile_start([mode="sample"], [period])
+int retro_script_luafunc_profile_start(struct lua_State* L);
+
+// retro.profile_stop()
+int retro_script_luafunc_profile_stop(struct lua_State* L);
+
+// retro.profile_report([count=10])
+int retro_script_luafunc_profile_report(struct lua_State* L);
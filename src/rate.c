@@ -0,0 +1,144 @@
+#include "rate.h"
+#include "observer.h"
+#include "context.h"
+#include "util.h"
+
+typedef struct rate_entry
+{
+    int ref;
+    int index;
+    uint32_t every;
+    bool presented;
+    
+    // frame it last ran on, or 0 if it has not run.
+    uint64_t last_frame;
+} rate_entry;
+
+struct retro_script_rates
+{
+    rate_entry* entries;
+    size_t count;
+};
+
+typedef struct rate_state
+{
+    uint64_t frame;
+    double speed;
+    
+    // a frame is presented each time this reaches the speed.
+    double credit;
+    bool presented;
+} rate_state;
+
+static void rate_state_init(void* state)
+{
+    ((rate_state*)state)->speed = 1.0;
+}
+
+CONTEXT_STATE(rate_state, rate, rate_state_init, NULL)
+
+void retro_script_rate_frame_begin()
+{
+    rate_state* state = rate();
+    state->frame++;
+    state->credit += 1.0;
+    state->presented = state->credit >= state->speed;
+    if (state->presented) state->credit -= state->speed;
+}
+
+RETRO_SCRIPT_API void retro_script_set_speed_hint(float multiplier)
+{
+    retro_script_observers_wait();
+    rate_state* state = rate();
+    state->speed = (multiplier > 1.0f) ? multiplier : 1.0;
+    state->credit = 0;
+}
+
+void retro_script_rate_check_arg(lua_State* L, int arg, uint32_t* every, bool* presented)
+{
+    *every = 1;
+    *presented = false;
+    switch (lua_type(L, arg))
+    {
+    case LUA_TNONE:
+    case LUA_TNIL:
+        break;
+    case LUA_TNUMBER:
+    {
+        const lua_Integer n = luaL_checkinteger(L, arg);
+        luaL_argcheck(L, n >= 1 && n <= UINT32_MAX, arg, "must be at least 1");
+        *every = (uint32_t)n;
+        break;
+    }
+    default:
+    {
+        static const char* const options[] = { "every", "presented", NULL };
+        *presented = luaL_checkoption(L, arg, NULL, options) == 1;
+        break;
+    }
+    }
+}
+
+static rate_entry* rate_find(script_state_t* script, int ref, int index)
+{
+    struct retro_script_rates* rates = script->rates;
+    for (size_t i = 0; i < rates->count; ++i)
+    {
+        if (rates->entries[i].ref == ref && rates->entries[i].index == index) return &rates->entries[i];
+    }
+    return NULL;
+}
+
+bool retro_script_rate_set(script_state_t* script, int ref, int index, uint32_t every, bool presented)
+{
+    // (callbacks which run every frame need no entry.)
+    if (every <= 1 && !presented) return true;
+    if (!script->rates)
+    {
+        script->rates = alloc(struct retro_script_rates);
+        if (!script->rates) return false;
+        script->rates->entries = NULL;
+        script->rates->count = 0;
+    }
+    
+    struct retro_script_rates* rates = script->rates;
+    rate_entry* entries = (rate_entry*)realloc(rates->entries, sizeof(rate_entry) * (rates->count + 1));
+    if (!entries) return false;
+    rates->entries = entries;
+    
+    rate_entry* entry = &entries[rates->count++];
+    entry->ref = ref;
+    entry->index = index;
+    entry->every = every;
+    entry->presented = presented;
+    entry->last_frame = 0;
+    return true;
+}
+
+bool retro_script_rate_due(script_state_t* script, int ref, int index, int64_t* skipped)
+{
+    *skipped = -1;
+    if (!script->rates) return true;
+    rate_entry* entry = rate_find(script, ref, index);
+    if (!entry) return true;
+    
+    *skipped = 0;
+    const rate_state* state = rate();
+    if (entry->presented && !state->presented) return false;
+    if (entry->last_frame)
+    {
+        const uint64_t elapsed = state->frame - entry->last_frame;
+        if (elapsed < entry->every) return false;
+        *skipped = (elapsed - 1 > UINT32_MAX) ? UINT32_MAX : (int64_t)(elapsed - 1);
+    }
+    entry->last_frame = state->frame;
+    return true;
+}
+
+void retro_script_rate_release(script_state_t* script)
+{
+    if (!script->rates) return;
+    free(script->rates->entries);
+    free(script->rates);
+    script->rates = NULL;
+}
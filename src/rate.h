@@ -0,0 +1,28 @@
+#pragma once
+
+/* Rate policies for retro.on_run_begin and retro.on_run_end callbacks: a callback may run
+ * every frame (the default), every n-th frame, or only on frames the frontend presents,
+ * as worked out from its speed hint. Callbacks with a policy are told how many frames they skipped.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+#include <lua_5.4.3.h>
+
+// called at the start of each frame.
+void retro_script_rate_frame_begin();
+
+// reads a rate policy argument (a number n, "every" or "presented"), if given.
+void retro_script_rate_check_arg(lua_State* L, int arg, uint32_t* every, bool* presented);
+
+// sets the policy of the index-th callback in the script's list ref.
+// returns false if not enough memory.
+bool retro_script_rate_set(script_state_t*, int ref, int index, uint32_t every, bool presented);
+
+// true if the index-th callback in the list should run this frame; if so, skipped is set
+// to the number of frames since it last ran that it was skipped on, or -1 if it has no policy.
+bool retro_script_rate_due(script_state_t*, int ref, int index, int64_t* skipped);
+
+// frees the script's policies.
+void retro_script_rate_release(script_state_t*);
@@ -0,0 +1,769 @@
+#include "reload.h"
+#include "script_list.h"
+#include "timers.h"
+#include "jobs.h"
+#include "bus.h"
+#include "hook.h"
+#include "observer.h"
+#include "heap.h"
+#include "thread.h"
+#include "core.h"
+#include "context.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#define HOT_RELOAD_SUPPORTED
+#endif
+
+// the watcher waits this long after a change before compiling,
+// as editors often write a file in several steps.
+#define RELOAD_DEBOUNCE_USEC 50000
+
+// how often the watcher checks whether it should stop.
+#define RELOAD_POLL_MSEC 50
+
+// tables nested deeper than this are not copied to the reloaded script.
+#define RELOAD_COPY_MAX_DEPTH 64
+
+typedef struct reload_file
+{
+    char* path;
+    char* dir; // directory to watch
+    char* name; // file name within dir
+    int wd; // inotify watch descriptor, or -1
+} reload_file;
+
+typedef struct reload_chunk
+{
+    char* path;
+    char* data;
+    size_t size;
+} reload_chunk;
+
+typedef struct reload_result
+{
+    reload_chunk* chunks;
+    size_t count;
+    char* error; // NULL if compiled successfully.
+} reload_result;
+
+struct retro_script_reload
+{
+    retro_script_id_t id;
+    
+    // the script file is first, followed by required files.
+    reload_file* files;
+    size_t file_count;
+    
+    // set when a file changes.
+    bool changed;
+    uint64_t changed_usec;
+    
+    // set by the watcher once recompiled.
+    bool ready;
+    reload_result result;
+    
+    // precompiled modules, available to require while swapping. (main thread only)
+    reload_result const* swapping;
+    
+    struct retro_script_reload* next;
+};
+
+typedef struct reload_state
+{
+    // guards everything below, and the list, files, and results of each retro_script_reload.
+    retro_script_mutex_t mutex;
+    struct retro_script_reload* watched;
+    bool running;
+    bool stopping;
+    int inotify_fd;
+    retro_script_thread_t watcher;
+} reload_state;
+
+static void reload_state_init(void* p)
+{
+    reload_state* state = (reload_state*)p;
+    retro_script_mutex_init(&state->mutex);
+    state->inotify_fd = -1;
+}
+
+static void stop_watcher();
+
+static void reload_state_destroy(void* p)
+{
+    stop_watcher();
+    retro_script_mutex_destroy(&((reload_state*)p)->mutex);
+}
+
+CONTEXT_STATE(reload_state, reloads, reload_state_init, reload_state_destroy)
+
+static void result_free(reload_result* result)
+{
+    for (size_t i = 0; i < result->count; ++i)
+    {
+        free(result->chunks[i].path);
+        free(result->chunks[i].data);
+    }
+    if (result->chunks) free(result->chunks);
+    if (result->error) free(result->error);
+    memset(result, 0, sizeof(*result));
+}
+
+// must hold mutex.
+static void file_watch(reload_state* state, reload_file* file)
+{
+    #ifdef HOT_RELOAD_SUPPORTED
+    if (state->running && file->wd < 0)
+    {
+        file->wd = inotify_add_watch(state->inotify_fd, file->dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    }
+    #endif
+}
+
+static void track_file(struct retro_script_reload* reload, const char* path)
+{
+    reload_state* state = reloads();
+    retro_script_mutex_lock(&state->mutex);
+    for (size_t i = 0; i < reload->file_count; ++i)
+    {
+        if (strcmp(reload->files[i].path, path) == 0) goto done;
+    }
+    
+    reload_file* files = realloc(reload->files, sizeof(reload_file) * (reload->file_count + 1));
+    if (!files) goto done;
+    reload->files = files;
+    
+    reload_file* file = &files[reload->file_count];
+    char* dir;
+    file->path = retro_script_strdup(path);
+    retro_script_split_path_file(&dir, &file->name, path);
+    file->dir = (dir && !*dir) ? retro_script_strdup(".") : dir;
+    if (dir && file->dir != dir) free(dir);
+    file->wd = -1;
+    if (!file->path || !file->dir || !file->name)
+    {
+        if (file->path) free(file->path);
+        if (file->dir) free(file->dir);
+        if (file->name) free(file->name);
+        goto done;
+    }
+    
+    reload->file_count++;
+    file_watch(state, file);
+    
+done:
+    retro_script_mutex_unlock(&state->mutex);
+}
+
+// package.searchers entry which wraps lua's own file searcher, recording which files are
+// required, and using precompiled bytecode while reloading.
+// upvalues: original searcher, package table
+static int tracking_searcher(lua_State* L)
+{
+    luaL_checkstring(L, 1);
+    
+    // (a shared lua state may have scripts which are not watched.)
+    script_state_t* script = script_find_lua(L);
+    struct retro_script_reload* reload = script ? script->reload : NULL;
+    if (reload && reload->swapping)
+    {
+        lua_getfield(L, lua_upvalueindex(2), "searchpath");
+        lua_pushvalue(L, 1);
+        lua_getfield(L, lua_upvalueindex(2), "path");
+        lua_call(L, 2, 1);
+        const char* path = lua_tostring(L, -1);
+        for (size_t i = 0; path && i < reload->swapping->count; ++i)
+        {
+            reload_chunk const* chunk = &reload->swapping->chunks[i];
+            if (strcmp(chunk->path, path) == 0)
+            {
+                if (luaL_loadbufferx(L, chunk->data, chunk->size, path, "b") != LUA_OK)
+                {
+                    return lua_error(L);
+                }
+                lua_pushstring(L, path);
+                return 2;
+            }
+        }
+        lua_settop(L, 1);
+    }
+    
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 2);
+    if (reload && lua_isfunction(L, -2) && lua_isstring(L, -1))
+    {
+        track_file(reload, lua_tostring(L, -1));
+    }
+    return 2;
+}
+
+static int install_searcher(lua_State* L)
+{
+    // (searchers[2] is lua's searcher for lua files. LuaJIT, like lua 5.1, calls them loaders.)
+#ifdef RETRO_SCRIPT_LUAJIT
+    const char* searchers = "loaders";
+#else
+    const char* searchers = "searchers";
+#endif
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE) != LUA_TTABLE) return 0;
+    if (lua_getfield(L, -1, LUA_LOADLIBNAME) != LUA_TTABLE) return 0;
+    if (lua_getfield(L, -1, searchers) != LUA_TTABLE) return 0;
+    if (lua_rawgeti(L, -1, 2) != LUA_TFUNCTION) return 0;
+    
+    // (a shared lua state may already have it.)
+    if (lua_tocfunction(L, -1) == tracking_searcher) return 0;
+    lua_pushvalue(L, -3);
+    lua_pushcclosure(L, tracking_searcher, 2);
+    lua_rawseti(L, -2, 2);
+    return 0;
+}
+
+bool retro_script_reload_setup(script_state_t* script)
+{
+    if (!script->reload)
+    {
+        // (scripts loaded while hot reload is off are set up once it is turned on.)
+        if (!reloads()->running) return true;
+        
+        struct retro_script_reload* reload = alloc(struct retro_script_reload);
+        if (!reload)
+        {
+            lua_pushstring(script->L, "Unable to allocate reload state");
+            return false;
+        }
+        memset(reload, 0, sizeof(*reload));
+        reload->id = script->id;
+        script->reload = reload;
+        track_file(reload, script->path);
+        
+        reload_state* state = reloads();
+        retro_script_mutex_lock(&state->mutex);
+        reload->next = state->watched;
+        state->watched = reload;
+        retro_script_mutex_unlock(&state->mutex);
+    }
+    
+    lua_pushcfunction(script->L, install_searcher);
+    return lua_pcall(script->L, 0, 0, 0) == LUA_OK;
+}
+
+bool retro_script_reload_swapping(script_state_t* script)
+{
+    return script->reload && script->reload->swapping;
+}
+
+void retro_script_reload_release(script_state_t* script)
+{
+    reload_state* state = reloads();
+    struct retro_script_reload* reload = script->reload;
+    if (!reload) return;
+    script->reload = NULL;
+    
+    retro_script_mutex_lock(&state->mutex);
+    struct retro_script_reload** entry = &state->watched;
+    while (*entry && *entry != reload) entry = &(*entry)->next;
+    if (*entry) *entry = reload->next;
+    retro_script_mutex_unlock(&state->mutex);
+    
+    for (size_t i = 0; i < reload->file_count; ++i)
+    {
+        free(reload->files[i].path);
+        free(reload->files[i].dir);
+        free(reload->files[i].name);
+    }
+    if (reload->files) free(reload->files);
+    result_free(&reload->result);
+    free(reload);
+}
+
+// ---------------------------------------------------------------------------
+// watcher thread
+
+typedef struct dump_buffer
+{
+    char* data;
+    size_t size;
+    size_t capacity;
+} dump_buffer;
+
+static int dump_writer(lua_State* L, const void* p, size_t sz, void* ud)
+{
+    dump_buffer* buffer = (dump_buffer*)ud;
+    if (buffer->size + sz > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->size + sz) capacity *= 2;
+        char* data = realloc(buffer->data, capacity);
+        if (!data) return 1;
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, p, sz);
+    buffer->size += sz;
+    return 0;
+}
+
+// compiles each file to bytecode. (paths are given to the result.)
+static void compile_files(char** paths, size_t count, reload_result* result)
+{
+    result->chunks = malloc_array(reload_chunk, count);
+    if (!result->chunks)
+    {
+        result->error = retro_script_strdup("Unable to allocate reload chunks");
+        goto fail;
+    }
+    
+    lua_State* L = luaL_newstate();
+    if (!L)
+    {
+        result->error = retro_script_strdup("Unable to allocate lua state for compiling");
+        goto fail;
+    }
+    
+    for (size_t i = 0; i < count; ++i)
+    {
+        dump_buffer buffer = { NULL, 0, 0 };
+        if (luaL_loadfile(L, paths[i]) != LUA_OK)
+        {
+            result->error = retro_script_strdup(lua_tostring(L, -1));
+        }
+        else if (lua_dump(L, dump_writer, &buffer, 0) != 0)
+        {
+            result->error = retro_script_strdup("Unable to allocate bytecode");
+        }
+        lua_settop(L, 0);
+        if (result->error)
+        {
+            if (buffer.data) free(buffer.data);
+            lua_close(L);
+            goto fail;
+        }
+        
+        result->chunks[i].path = paths[i];
+        result->chunks[i].data = buffer.data;
+        result->chunks[i].size = buffer.size;
+        paths[i] = NULL;
+        result->count++;
+    }
+    
+    lua_close(L);
+    
+fail:
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (paths[i]) free(paths[i]);
+    }
+}
+
+// compiles one script whose files have changed, if any. returns false if none.
+static bool compile_changed()
+{
+    reload_state* state = reloads();
+    const uint64_t now = retro_script_time_usec();
+    retro_script_id_t id = 0;
+    char** paths = NULL;
+    size_t count = 0;
+    
+    // copy the paths, so that compiling needn't hold the lock.
+    retro_script_mutex_lock(&state->mutex);
+    for (struct retro_script_reload* reload = state->watched; reload; reload = reload->next)
+    {
+        if (reload->changed && now - reload->changed_usec >= RELOAD_DEBOUNCE_USEC)
+        {
+            reload->changed = false;
+            paths = malloc_array(char*, reload->file_count);
+            if (!paths) break;
+            for (size_t i = 0; i < reload->file_count; ++i)
+            {
+                paths[i] = retro_script_strdup(reload->files[i].path);
+            }
+            id = reload->id;
+            count = reload->file_count;
+            break;
+        }
+    }
+    retro_script_mutex_unlock(&state->mutex);
+    if (!paths) return false;
+    
+    reload_result result;
+    memset(&result, 0, sizeof(result));
+    compile_files(paths, count, &result);
+    free(paths);
+    
+    // the script may have been unloaded in the meantime.
+    retro_script_mutex_lock(&state->mutex);
+    struct retro_script_reload* reload = state->watched;
+    while (reload && reload->id != id) reload = reload->next;
+    if (reload)
+    {
+        result_free(&reload->result);
+        reload->result = result;
+        reload->ready = true;
+    }
+    else
+    {
+        result_free(&result);
+    }
+    retro_script_mutex_unlock(&state->mutex);
+    return true;
+}
+
+#ifdef HOT_RELOAD_SUPPORTED
+static void mark_changed(int wd, const char* name)
+{
+    reload_state* state = reloads();
+    const uint64_t now = retro_script_time_usec();
+    retro_script_mutex_lock(&state->mutex);
+    for (struct retro_script_reload* reload = state->watched; reload; reload = reload->next)
+    {
+        for (size_t i = 0; i < reload->file_count; ++i)
+        {
+            if (reload->files[i].wd == wd && strcmp(reload->files[i].name, name) == 0)
+            {
+                reload->changed = true;
+                reload->changed_usec = now;
+            }
+        }
+    }
+    retro_script_mutex_unlock(&state->mutex);
+}
+
+// ud: the context whose scripts are watched.
+static void watcher_main(void* ud)
+{
+    retro_script_context_make_current((retro_script_context_t*)ud);
+    reload_state* state = reloads();
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    
+    while (true)
+    {
+        retro_script_mutex_lock(&state->mutex);
+        const bool stop = state->stopping;
+        retro_script_mutex_unlock(&state->mutex);
+        if (stop) break;
+        
+        struct pollfd pfd = { state->inotify_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, RELOAD_POLL_MSEC) > 0)
+        {
+            ssize_t len;
+            while ((len = read(state->inotify_fd, buffer, sizeof(buffer))) > 0)
+            {
+                for (char* p = buffer; p < buffer + len; )
+                {
+                    const struct inotify_event* event = (const struct inotify_event*)p;
+                    if (event->len) mark_changed(event->wd, event->name);
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+        
+        while (compile_changed());
+    }
+}
+#endif
+
+static void stop_watcher()
+{
+    #ifdef HOT_RELOAD_SUPPORTED
+    reload_state* state = reloads();
+    retro_script_mutex_lock(&state->mutex);
+    if (!state->running)
+    {
+        retro_script_mutex_unlock(&state->mutex);
+        return;
+    }
+    state->stopping = true;
+    retro_script_mutex_unlock(&state->mutex);
+    
+    retro_script_thread_join(state->watcher);
+    
+    retro_script_mutex_lock(&state->mutex);
+    state->running = false;
+    state->stopping = false;
+    close(state->inotify_fd);
+    state->inotify_fd = -1;
+    for (struct retro_script_reload* reload = state->watched; reload; reload = reload->next)
+    {
+        reload->changed = false;
+        for (size_t i = 0; i < reload->file_count; ++i)
+        {
+            reload->files[i].wd = -1;
+        }
+    }
+    retro_script_mutex_unlock(&state->mutex);
+    #endif
+}
+
+static bool start_watcher()
+{
+    #ifdef HOT_RELOAD_SUPPORTED
+    reload_state* state = reloads();
+    if (state->running) return true;
+    
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return false;
+    
+    retro_script_mutex_lock(&state->mutex);
+    state->inotify_fd = fd;
+    state->running = true;
+    for (struct retro_script_reload* reload = state->watched; reload; reload = reload->next)
+    {
+        for (size_t i = 0; i < reload->file_count; ++i)
+        {
+            file_watch(state, &reload->files[i]);
+        }
+    }
+    retro_script_mutex_unlock(&state->mutex);
+    
+    if (!retro_script_thread_create(&state->watcher, watcher_main, retro_script_context()))
+    {
+        retro_script_mutex_lock(&state->mutex);
+        state->running = false;
+        retro_script_mutex_unlock(&state->mutex);
+        close(fd);
+        return false;
+    }
+    
+    // watch scripts already loaded. (modules they have already required are only
+    // watched once they are reloaded.)
+    retro_script_observers_wait();
+    SCRIPT_ITERATE(script)
+    {
+        if (!script->reload && !retro_script_reload_setup(script)) lua_pop(script->L, 1);
+    }
+    return true;
+    #else
+    return false;
+    #endif
+}
+
+ON_DEINIT()
+{
+    stop_watcher();
+}
+
+// ---------------------------------------------------------------------------
+// swapping (main thread)
+
+// pushes retro.state. run protected in the old lua state.
+static int get_old_state(lua_State* L)
+{
+    retro_script_push_retro_table(script_find_lua(L));
+    if (!lua_istable(L, -1)) return 0;
+    lua_getfield(L, -1, "state");
+    return 1;
+}
+
+// copies the value on top of from's stack onto to's stack.
+// only tables, strings, numbers and booleans are copied; anything else becomes nil.
+// visited is an index in to, of a table mapping tables in from to their copies.
+static void copy_value(lua_State* from, lua_State* to, int visited, int depth)
+{
+    luaL_checkstack(to, 4, "copying state");
+    switch (lua_type(from, -1))
+    {
+    case LUA_TBOOLEAN:
+        lua_pushboolean(to, lua_toboolean(from, -1));
+        break;
+    case LUA_TNUMBER:
+        if (lua_isinteger(from, -1)) lua_pushinteger(to, lua_tointeger(from, -1));
+        else lua_pushnumber(to, lua_tonumber(from, -1));
+        break;
+    case LUA_TSTRING:
+        {
+            size_t len;
+            const char* s = lua_tolstring(from, -1, &len);
+            lua_pushlstring(to, s, len);
+        }
+        break;
+    case LUA_TTABLE:
+        {
+            const void* ptr = lua_topointer(from, -1);
+            if (lua_rawgetp(to, visited, ptr) != LUA_TNIL) break;
+            lua_pop(to, 1);
+            
+            // (lua_checkstack does not raise errors in from.)
+            if (depth >= RELOAD_COPY_MAX_DEPTH || !lua_checkstack(from, 3))
+            {
+                lua_pushnil(to);
+                break;
+            }
+            
+            lua_newtable(to);
+            lua_pushvalue(to, -1);
+            lua_rawsetp(to, visited, ptr);
+            
+            lua_pushnil(from);
+            while (lua_next(from, -2))
+            {
+                lua_pushvalue(from, -2);
+                copy_value(from, to, visited, depth + 1);
+                lua_pop(from, 1);
+                copy_value(from, to, visited, depth + 1);
+                lua_pop(from, 1);
+                if (!lua_isnil(to, -2) && !lua_isnil(to, -1)) lua_rawset(to, -3);
+                else lua_pop(to, 2);
+            }
+        }
+        break;
+    default:
+        lua_pushnil(to);
+        break;
+    }
+}
+
+// arg 1: old lua state (light userdata), with the value to copy on top of its stack.
+static int copy_old_state(lua_State* L)
+{
+    lua_State* from = (lua_State*)lua_touserdata(L, 1);
+    lua_newtable(L);
+    copy_value(from, L, 2, 0);
+    return 1;
+}
+
+static void report(retro_script_id_t id, const char* msg)
+{
+    if (msg) retro_script_report_error(id, LUA_ERRSYNTAX, msg);
+}
+
+static void reload_script(script_state_t* script, reload_result const* result)
+{
+    if (result->error || result->count == 0)
+    {
+        report(script->id, result->error);
+        return;
+    }
+    
+    struct retro_script_memory_stats stats;
+    retro_script_heap_get_stats(script->heap, &stats);
+    script_state_t* fresh = script_create(script->path, stats.limit_bytes, script->shared.enabled);
+    if (!fresh)
+    {
+        report(script->id, "Unable to allocate script for reloading");
+        return;
+    }
+    fresh->id = script->id;
+    fresh->setup = script->setup;
+    fresh->reload = script->reload;
+    fresh->watchdog.callback_budget = script->watchdog.callback_budget;
+    fresh->watchdog.load_budget = script->watchdog.load_budget;
+    
+    // load the new script alongside the old one, so that the old one remains if this fails.
+    script->reload->swapping = result;
+    bool ok = retro_script_run_chunk(fresh, result->chunks[0].data, result->chunks[0].size);
+    script->reload->swapping = NULL;
+    if (!ok)
+    {
+        report(script->id, lua_tostring(fresh->L, -1));
+        fresh->reload = NULL;
+        script_destroy(fresh);
+        return;
+    }
+    
+    // copy retro.state from the old script.
+    lua_State* old_L = script->L;
+    lua_State* L = fresh->L;
+    lua_pushcfunction(old_L, get_old_state);
+    if (lua_pcall(old_L, 0, 1, 0) != LUA_OK) lua_pushnil(old_L);
+    lua_pushcfunction(L, copy_old_state);
+    lua_pushlightuserdata(L, old_L);
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+    {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    lua_settop(old_L, 0);
+    
+    // swap lua states, keeping the same id and place in the list.
+    retro_script_timers_clear(script);
+    retro_script_jobs_clear(script);
+    retro_script_bus_clear(script);
+    retro_script_timers_transfer(fresh, script);
+    retro_script_jobs_transfer(fresh, script);
+    retro_script_bus_transfer(fresh, script);
+    
+    script_state_t old = *script;
+    *script = *fresh;
+    script->next = old.next;
+    script->paused = old.paused;
+    script->disabled = old.disabled;
+    script->stats = old.stats;
+    *fresh = old;
+    fresh->next = NULL;
+    fresh->reload = NULL;
+    
+    // every thread of each lua state (coroutines included) finds its script through the binding.
+    *script->binding = script;
+    *fresh->binding = fresh;
+    
+    // keep profiling across the reload, unless the new script started its own profile.
+    if (!script->profile)
+    {
+        script->profile = old.profile;
+        fresh->profile = NULL;
+    }
+    retro_script_hook_install(script, script->L);
+    script_destroy(fresh);
+    
+    // pass the old state to the new script's on_reload callbacks.
+    if (script->refs.on_reload != LUA_NOREF)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, script->refs.on_reload);
+        const int len = lua_rawlen(L, 2);
+        for (int i = 1; i <= len && !script->disabled; ++i)
+        {
+            lua_rawgeti(L, 2, i);
+            lua_pushvalue(L, 1);
+            int status = retro_script_lua_pcall(L, 1, 0);
+            if (status != LUA_OK)
+            {
+                retro_script_on_uncaught_error(L, status);
+                lua_pop(L, 1);
+            }
+        }
+    }
+    lua_settop(L, 0);
+}
+
+void retro_script_reload_poll()
+{
+    reload_state* state = reloads();
+    if (!state->running) return;
+    
+    // collect results first, as reloading a script takes the lock.
+    reload_result results[8];
+    retro_script_id_t ids[8];
+    size_t count = 0;
+    retro_script_mutex_lock(&state->mutex);
+    for (struct retro_script_reload* reload = state->watched; reload && count < 8; reload = reload->next)
+    {
+        if (reload->ready)
+        {
+            reload->ready = false;
+            ids[count] = reload->id;
+            results[count++] = reload->result;
+            memset(&reload->result, 0, sizeof(reload->result));
+        }
+    }
+    retro_script_mutex_unlock(&state->mutex);
+    
+    for (size_t i = 0; i < count; ++i)
+    {
+        script_state_t* script = script_find(ids[i]);
+        if (script && !script->unload_pending) reload_script(script, &results[i]);
+        result_free(&results[i]);
+    }
+}
+
+RETRO_SCRIPT_API bool retro_script_set_hot_reload(bool enabled)
+{
+    if (enabled) return start_watcher();
+    stop_watcher();
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+/* Hot reload: a watcher thread waits for changes to script files (and
+ * any files they require), recompiles them to bytecode in the background,
+ * and the main thread swaps the new script in at the start of a frame.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+// tracks the script's files and prepares its lua state to record required files.
+// also used while reloading, in which case script->reload is already set.
+// returns false on error, leaving the error message on the stack.
+bool retro_script_reload_setup(script_state_t*);
+
+// stops tracking the script's files.
+void retro_script_reload_release(script_state_t*);
+
+// true while the script's new version is being loaded.
+bool retro_script_reload_swapping(script_state_t*);
+
+// swaps in any scripts which have been recompiled since the last call.
+void retro_script_reload_poll();
@@ -8,6 +8,24 @@
 #include "script_list.h"
 #include "error.h"
 #include "memmap.h"
+#include "gc.h"
+#include "watchdog.h"
+#include "error_filter.h"
+#include "timers.h"
+#include "jobs.h"
+#include "reload.h"
+#include "log.h"
+#include "observer.h"
+#include "store.h"
+#include "bus.h"
+#include "pack.h"
+#include "profiler.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "rate.h"
+#include "input.h"
+#include "thread.h"
 #include "core.h"
 #include "util.h"
 
@@ -36,27 +54,16 @@ static int attach_stacktrace(lua_State* L)
         // don't modify non-string error.
         return 1;
     }
-    lua_getglobal(L, LUA_DBLIBNAME);
-    if (!lua_istable(L, -1))
-    {
-        lua_pop(L, 1);
-        lua_pushstring(L, "(unable to attach stacktrace -- no debug lib) ");
-        lua_rotate(L, -2, 1);
-        lua_concat(L, 2);
-        return 1;
-    }
-    lua_getfield(L, -1, "traceback");
-    if (!lua_isfunction(L, -1))
+    
+    // a repeated error is only summarized, so needs no stack trace.
+    script_state_t* script = script_find_lua(L);
+    if (script && retro_script_error_filter_enabled() && retro_script_error_filter_find(script, lua_tostring(L, 1)))
     {
-        lua_pop(L, 2);
-        lua_pushstring(L, "(unable to attach stacktrace -- debug.traceback corrupted or missing) ");
-        lua_rotate(L, -2, 1);
-        lua_concat(L, 2);
         return 1;
     }
-    lua_pushvalue(L, 1); // error
-    lua_pushinteger(L, 2);  // skip fn and traceback
-    lua_call(L, 2, 1);  // debug.traceback()
+    
+    // (same as debug.traceback, but without needing the debug library to be opened.)
+    luaL_traceback(L, L, lua_tostring(L, 1), 1); // skip this function
     return 1;
 }
 
@@ -77,6 +84,8 @@ static const char* lua_status_string(int status)
     case LUA_ERRERR:
         // TODO: double check -- this is an error while handling an error?
         return "HANDLING ERROR";
+    case RETRO_SCRIPT_ERR_BUDGET:
+        return "INSTRUCTION BUDGET EXCEEDED";
     default:
         return "UNKOWN ERROR";
     }
@@ -110,8 +119,6 @@ static const char* get_lua_error_string(lua_State* L)
     }
     else
     {
-        lua_pushstring(L, "Lua error: ");
-        lua_concat(L, 2);
         const char* errmsg = lua_tostring(L, -1);
         if (errmsg)
         {
@@ -127,18 +134,94 @@ static const char* get_lua_error_string(lua_State* L)
 // lua error response (customizable)
 static lua_CFunction lua_on_error = attach_stacktrace;
 static retro_script_lua_uncaught_error_cb lua_on_uncaught_error = print_error_message;
+static retro_script_mutex_t report_mutex;
+
+INITIALIZER(report_mutex_init)
+{
+    retro_script_mutex_init(&report_mutex);
+}
+
+// reports the error on top of the stack, from the script's current callback.
+// returns the error's record, or NULL if not recorded.
+static retro_script_error_record* report_uncaught_error(script_state_t* script, int status)
+{
+    lua_State* L = script->L;
+    const char* msg = get_lua_error_string(L);
+    retro_script_error_record* record = retro_script_error_filter_enabled()
+        ? retro_script_error_filter_add(script, msg)
+        : NULL;
+    
+    if (!lua_on_uncaught_error)
+    {
+        // (nothing to report to.)
+    }
+    else if (!record || record->count == 1)
+    {
+        retro_script_report_error(script->id, status, msg);
+    }
+    else if ((record->count & (record->count - 1)) == 0)
+    {
+        // summarize repeats when the count reaches a power of two.
+        char summary[512];
+        snprintf(summary, sizeof(summary), "%s (repeated %u times)", record->summary, record->count);
+        retro_script_report_error(script->id, status, summary);
+    }
+    
+    if (retro_script_watchdog_record_overrun(script, status == RETRO_SCRIPT_ERR_BUDGET) && lua_on_uncaught_error)
+    {
+        retro_script_report_error(script->id, RETRO_SCRIPT_ERR_BUDGET, "script disabled after repeatedly exceeding its instruction budget");
+    }
+    return record;
+}
 
 void retro_script_on_uncaught_error(lua_State* L, int status)
 {
     if (status == 0) return;
     script_state_t* script = script_find_lua(L);
-    if (lua_on_uncaught_error) lua_on_uncaught_error(script ? script->id : 0, status, get_lua_error_string(L));
+    if (script)
+    {
+        report_uncaught_error(script, status);
+    }
+    else if (lua_on_uncaught_error)
+    {
+        retro_script_report_error(0, status, get_lua_error_string(L));
+    }
+}
+
+void retro_script_report_error(retro_script_id_t id, int status, const char* msg)
+{
+    // (observers may report errors from several threads at once.)
+    if (!lua_on_uncaught_error) return;
+    retro_script_mutex_lock(&report_mutex);
+    lua_on_uncaught_error(id, status, msg);
+    retro_script_mutex_unlock(&report_mutex);
+}
+
+void retro_script_on_coroutine_error(lua_State* L, lua_State* co, int status)
+{
+    // move error to the main thread, attaching the coroutine's stack trace
+    // unless it is a repeat.
+    script_state_t* script = script_find_lua(L);
+    if (script) script->errors.current = co;
+    lua_xmove(co, L, 1);
+    const char* msg = lua_tostring(L, -1);
+    if (msg && !(script && retro_script_error_filter_enabled() && retro_script_error_filter_find(script, msg)))
+    {
+        luaL_traceback(L, co, msg, 0);
+        lua_remove(L, -2);
+    }
+    retro_script_on_uncaught_error(L, status);
+    lua_pop(L, 1);
 }
 
 #define SET_SCRIPT_REF(ref) retro_script_luafunc_set_##ref
-#define DEF_SET_SCRIPT_REF(REF, ALLOW_LIST) \
+#define DEF_SET_SCRIPT_REF(REF, ALLOW_LIST, RATED) \
 static int SET_SCRIPT_REF(REF)(struct lua_State* L) \
 {   \
+    uint32_t every = 1; \
+    bool presented = false; \
+    if (RATED) retro_script_rate_check_arg(L, 2, &every, &presented); \
+    lua_settop(L, 1); \
     script_state_t* script = script_find_lua(L); \
     if (script) \
     {   \
@@ -156,106 +239,227 @@ static int SET_SCRIPT_REF(REF)(struct lua_State* L) \
         else { \
             int idx = lua_rawlen(L, -2) + 1; \
             lua_rawseti(L, -2, idx); \
+            if (RATED && !retro_script_rate_set(script, script->refs.REF, idx, every, presented)) \
+            { \
+                return luaL_error(L, "not enough memory"); \
+            } \
         } \
         lua_pop(L, 1); \
     }   \
     return 0; \
 }   
 
-DEF_SET_SCRIPT_REF(on_run_begin, true);
-DEF_SET_SCRIPT_REF(on_run_end, true);
+DEF_SET_SCRIPT_REF(on_run_begin, true, true);
+DEF_SET_SCRIPT_REF(on_run_end, true, true);
+DEF_SET_SCRIPT_REF(on_run_deferred, true, false);
+DEF_SET_SCRIPT_REF(on_reload, true, false);
+
+// libraries which are only opened when first required,
+// or (if global) when first accessed as a global.
+static const struct
+{
+    const char* name;
+    lua_CFunction open;
+    bool global;
+} lazy_libs[] = {
+    { LUA_IOLIBNAME, luaopen_io, true },
+    { LUA_OSLIBNAME, luaopen_os, true },
+#ifndef RETRO_SCRIPT_LUAJIT
+    { LUA_UTF8LIBNAME, luaopen_utf8, true },
+#endif
+    { LUA_DBLIBNAME, luaopen_debug, true },
+    { LUA_BITLIBNAME, luaopen_bit, false },
+};
+
+// __index metamethod for the global table, opening lazy libraries.
+static int lazy_global(lua_State* L)
+{
+    if (lua_type(L, 2) != LUA_TSTRING) return 0;
+    const char* name = lua_tostring(L, 2);
+    for (size_t i = 0; i < sizeof(lazy_libs) / sizeof(lazy_libs[0]); ++i)
+    {
+        if (lazy_libs[i].global && strcmp(name, lazy_libs[i].name) == 0)
+        {
+            // (sets the global, so this is only called once per library.)
+            luaL_requiref(L, name, lazy_libs[i].open, true);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#define MEMORY_ACCESS_ENDIAN_FUNCS(type, le) \
+    { "read_" #type "_" #le, retro_script_luafunc_memory_read_##type##_##le }, \
+    { "write_" #type "_" #le, retro_script_luafunc_memory_write_##type##_##le }
+
+#define MEMORY_ACCESS_FUNCS(type) \
+    MEMORY_ACCESS_ENDIAN_FUNCS(type, le), \
+    MEMORY_ACCESS_ENDIAN_FUNCS(type, be)
+
+static const luaL_Reg retro_funcs[] = {
+    { "input_poll", retro_script_luafunc_input_poll },
+    { "input_state", retro_script_luafunc_input_state },
+    { "set_input", retro_script_luafunc_set_input },
+    { "set_turbo", retro_script_luafunc_set_turbo },
+    { "queue_input", retro_script_luafunc_queue_input },
+    { "clear_input", retro_script_luafunc_clear_input },
+    
+    { "read_char", retro_script_luafunc_memory_read_char },
+    { "write_char", retro_script_luafunc_memory_write_char },
+    { "read_byte", retro_script_luafunc_memory_read_byte },
+    { "write_byte", retro_script_luafunc_memory_write_byte },
+    
+    MEMORY_ACCESS_FUNCS(int16),
+    MEMORY_ACCESS_FUNCS(uint16),
+    MEMORY_ACCESS_FUNCS(int32),
+    MEMORY_ACCESS_FUNCS(uint32),
+    MEMORY_ACCESS_FUNCS(int64),
+    MEMORY_ACCESS_FUNCS(uint64),
+    MEMORY_ACCESS_FUNCS(float32),
+    MEMORY_ACCESS_FUNCS(float64),
+    
+    { "on_run_begin", SET_SCRIPT_REF(on_run_begin) },
+    { "on_run_end", SET_SCRIPT_REF(on_run_end) },
+    { "on_run_deferred", SET_SCRIPT_REF(on_run_deferred) },
+    { "on_reload", SET_SCRIPT_REF(on_reload) },
+    
+    { "spawn", retro_script_luafunc_spawn },
+    { "wait", retro_script_luafunc_wait },
+    { "after", retro_script_luafunc_after },
+    { "every", retro_script_luafunc_every },
+    { "cancel", retro_script_luafunc_cancel },
+    { "job", retro_script_luafunc_job },
+    { "log", retro_script_luafunc_log },
+    { "set_observer", retro_script_luafunc_set_observer },
+    { "publish", retro_script_luafunc_publish },
+    { "subscribe", retro_script_luafunc_subscribe },
+    { "unsubscribe", retro_script_luafunc_unsubscribe },
+    { "pack", retro_script_luafunc_pack },
+    { "unpack", retro_script_luafunc_unpack },
+    { "profile_start", retro_script_luafunc_profile_start },
+    { "profile_stop", retro_script_luafunc_profile_stop },
+    { "profile_report", retro_script_luafunc_profile_report },
+    { NULL, NULL }
+};
+
+// retro.shared
+static const luaL_Reg shared_funcs[] = {
+    { "set", retro_script_luafunc_shared_set },
+    { "get", retro_script_luafunc_shared_get },
+    { NULL, NULL }
+};
 
 // sets the built-in functions for lua,
 // including the libretro-script functions.
-static void lua_set_libs(lua_State* L, const char* default_package_path)
+// (anything which depends on the core is set by lua_set_core_libs.)
+static void lua_set_libs(lua_State* L)
 {
     // base libs
     luaL_requiref(L, LUA_GNAME, luaopen_base, true);
     luaL_requiref(L, LUA_MATHLIBNAME, luaopen_math, true);
     luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, true);
-    luaL_requiref(L, LUA_IOLIBNAME, luaopen_io, true);
-    luaL_requiref(L, LUA_OSLIBNAME, luaopen_os, true);
     luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, true);
-    luaL_requiref(L, LUA_UTF8LIBNAME, luaopen_utf8, true);
     luaL_requiref(L, LUA_COLIBNAME, luaopen_coroutine, true);
-    luaL_requiref(L, LUA_DBLIBNAME, luaopen_debug, true);
-    luaL_requiref(L, LUA_BITLIBNAME, luaopen_bit, false);
+    luaL_requiref(L, LUA_LOADLIBNAME, luaopen_package, true);
+    lua_settop(L, 0);
+    retro_script_watchdog_open(L);
     
-    // package gets special attention, as we set the path manually.
+#ifdef RETRO_SCRIPT_LUAJIT
+    // (LuaJIT's require looks for preloaders in package.preload, not the registry.)
+    lua_getglobal(L, LUA_LOADLIBNAME);
+    lua_getfield(L, -1, "preload");
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+    lua_settop(L, 0);
+#endif
+    
+    // the rest are opened on demand.
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+    for (size_t i = 0; i < sizeof(lazy_libs) / sizeof(lazy_libs[0]); ++i)
     {
-        luaL_requiref(L, LUA_LOADLIBNAME, luaopen_package, true);
-        if (default_package_path && lua_istable(L, -1))
-        {
-            // set package.path
-            lua_pushstring(L, default_package_path);
-            lua_setfield(L, -2, "path");
-        }
+        lua_pushcfunction(L, lazy_libs[i].open);
+        lua_setfield(L, -2, lazy_libs[i].name);
     }
+    lua_pushglobaltable(L);
+    lua_newtable(L);
+    lua_pushcfunction(L, lazy_global);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
     lua_settop(L, 0);
     
-    // register c functions
-    #define REGISTER_FUNC(name, func) \
-        lua_pushcfunction(L, func); \
-        lua_setfield(L, -2, name)
-    #define REGISTER_SCRIPT_SET_REF(ref) \
-        REGISTER_FUNC(#ref, SET_SCRIPT_REF(ref))
-    
-    #define REGISTER_MEMORY_ACCESS_ENDIAN(type, le) \
-        REGISTER_FUNC("read_" #type "_" #le, retro_script_luafunc_memory_read_##type##_##le); \
-        REGISTER_FUNC("write_" #type "_" #le, retro_script_luafunc_memory_write_##type##_##le); \
-    
-    #define REGISTER_MEMORY_ACCESS(type) \
-        REGISTER_MEMORY_ACCESS_ENDIAN(type, le); \
-        REGISTER_MEMORY_ACCESS_ENDIAN(type, be);
+    // create the 'retro' table, and set it as package.loaded["retro"]
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    luaL_newlib(L, retro_funcs);
+    luaL_newlib(L, shared_funcs);
+    lua_setfield(L, -2, "shared");
+    lua_newtable(L);
+    lua_pushcfunction(L, retro_script_luafunc_constants_index);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, -2, "retro");
+    lua_settop(L, 0);
+}
+
+// used by lua_set_core_libs.
+#define REGISTER_FUNC(name, func) \
+    lua_pushcfunction(L, func); \
+    lua_setfield(L, -2, name)
+
+int retro_script_lua_open_libs(lua_State* L)
+{
+    lua_set_libs(L);
+    return 0;
+}
+
+// sets the parts of the script's environment which depend on the script or the core.
+static void lua_set_core_libs(lua_State* L, const char* default_package_path)
+{
+    // package gets special attention, as we set the path manually.
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    if (default_package_path && lua_getfield(L, -1, LUA_LOADLIBNAME) == LUA_TTABLE)
+    {
+        // set package.path
+        lua_pushstring(L, default_package_path);
+        lua_setfield(L, -2, "path");
+    }
+    lua_settop(L, 1);
     
-    // create a global 'retro' 
+    // retro.hc
+    if (lua_getfield(L, -1, "retro") == LUA_TTABLE && retro_script_hc_get_debugger())
     {
         lua_newtable(L);
         
-        REGISTER_FUNC("input_poll", retro_script_luafunc_input_poll);
-        REGISTER_FUNC("input_state", retro_script_luafunc_input_state);
-        
-        retro_script_luafield_constants(L);
-        
-        REGISTER_FUNC("read_char", retro_script_luafunc_memory_read_char);
-        REGISTER_FUNC("write_char", retro_script_luafunc_memory_write_char);
-        REGISTER_FUNC("read_byte", retro_script_luafunc_memory_read_byte);
-        REGISTER_FUNC("write_byte", retro_script_luafunc_memory_write_byte);
+        REGISTER_FUNC("system_get_description", retro_script_luafunc_hc_system_get_description);
+        REGISTER_FUNC("system_get_memory_regions", retro_script_luafunc_hc_system_get_memory_regions);
+        REGISTER_FUNC("system_get_breakpoints", retro_script_luafunc_hc_system_get_breakpoints);
+        REGISTER_FUNC("system_get_cpus", retro_script_luafunc_hc_system_get_cpus);
+        REGISTER_FUNC("breakpoint_clear", retro_script_luafunc_hc_breakpoint_clear);
         
-        REGISTER_MEMORY_ACCESS(int16);
-        REGISTER_MEMORY_ACCESS(uint16);
-        REGISTER_MEMORY_ACCESS(int32);
-        REGISTER_MEMORY_ACCESS(uint32);
-        REGISTER_MEMORY_ACCESS(int64);
-        REGISTER_MEMORY_ACCESS(uint64);
-        REGISTER_MEMORY_ACCESS(float32);
-        REGISTER_MEMORY_ACCESS(float64);
-        
-        REGISTER_SCRIPT_SET_REF(on_run_begin);
-        REGISTER_SCRIPT_SET_REF(on_run_end);
-        
-        // retro.hc
-        if (retro_script_hc_get_debugger())
-        {
-            lua_newtable(L);
-            
-            REGISTER_FUNC("system_get_description", retro_script_luafunc_hc_system_get_description);
-            REGISTER_FUNC("system_get_memory_regions", retro_script_luafunc_hc_system_get_memory_regions);
-            REGISTER_FUNC("system_get_breakpoints", retro_script_luafunc_hc_system_get_breakpoints);
-            REGISTER_FUNC("system_get_cpus", retro_script_luafunc_hc_system_get_cpus);
-            REGISTER_FUNC("breakpoint_clear", retro_script_luafunc_hc_breakpoint_clear);
-            
-            retro_script_luafield_hc_main_cpu_and_memory(L);
-            
-            lua_setfield(L, -2, "hc");
-        }
+        retro_script_luafield_hc_main_cpu_and_memory(L);
         
-        // set this as package.loaded["retro"]
-        luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
-        lua_rotate(L, -2, 1);
-        lua_setfield(L, -2, "retro");
+        lua_setfield(L, -2, "hc");
     }
     lua_settop(L, 0);
+    
+    // print, if routed to the log. (a shared lua state's print is left alone.)
+    if (retro_script_log_routes_print())
+    {
+        script_state_t* script = script_find_lua(L);
+        if (script && script->shared.enabled) lua_rawgeti(L, LUA_REGISTRYINDEX, script->shared.env);
+        else lua_pushglobaltable(L);
+        lua_pushcfunction(L, retro_script_luafunc_log_print);
+        lua_setfield(L, -2, "print");
+        lua_settop(L, 0);
+    }
+}
+
+// lua_set_core_libs allocates, so it is run protected in case the script's
+// memory limit is reached. arg 1 is the package path (light userdata).
+static int lua_set_core_libs_protected(lua_State* L)
+{
+    const char* default_package_path = (const char*)lua_touserdata(L, 1);
+    lua_settop(L, 0);
+    lua_set_core_libs(L, default_package_path);
+    return 0;
 }
 
 RETRO_SCRIPT_API
@@ -278,71 +482,192 @@ RETRO_SCRIPT_API void retro_script_set_lua_uncaught_error_handler(retro_script_l
 
 int retro_script_lua_pcall(lua_State* L, int argc, int retc)
 {
+    script_state_t* script = script_find_lua(L);
+    retro_script_watchdog_arm(script, script ? script->watchdog.callback_budget : 0);
+    
+    // errors are attributed to the function being called.
+    const void* outer = NULL;
+    if (script)
+    {
+        outer = script->errors.current;
+        script->errors.current = lua_topointer(L, -argc-1);
+    }
+    
+    int result;
     if (lua_on_error == NULL)
     {
-        return lua_pcall(L, argc, retc, 0);
+        result = lua_pcall(L, argc, retc, 0);
     }
     else
     {
         lua_pushcfunction(L, lua_on_error);
         lua_rotate(L, -argc-2, 1);
-        return lua_pcall(L, argc, retc, -argc-2);
+        result = lua_pcall(L, argc, retc, -argc-2);
+    }
+    
+    result = retro_script_watchdog_disarm(script, result);
+    if (script && result == LUA_OK)
+    {
+        retro_script_error_filter_succeeded(script);
+        retro_script_watchdog_succeeded(script);
+        script->errors.current = outer;
+    }
+    // (on error, the function stays current, as the caller then reports the error.)
+    return result;
+}
+
+static const char* const callback_names[] = { "on_run_begin", "on_run_end", "on_run_deferred" };
+
+static retro_script_callback_kind_t callback_kind(script_state_t* script, int ref)
+{
+    if (ref == script->refs.on_run_begin) return RETRO_SCRIPT_CALLBACK_RUN_BEGIN;
+    if (ref == script->refs.on_run_end) return RETRO_SCRIPT_CALLBACK_RUN_END;
+    return RETRO_SCRIPT_CALLBACK_RUN_DEFERRED;
+}
+
+// calls the function on top of the stack, which is the i-th callback of the given reflist,
+// passing the number of frames it was skipped on (only if it has a rate policy, i.e. skipped >= 0),
+// and reporting any error.
+static void execute_cb_top(script_state_t* script, int ref, int i, int64_t skipped)
+{
+    lua_State* L = script->L;
+    const int nargs = skipped >= 0;
+    if (nargs) lua_pushinteger(L, (lua_Integer)skipped);
+    const retro_script_callback_kind_t kind = callback_kind(script, ref);
+    PROBE2(callback_entry, script->id, kind);
+    TRACE_BEGIN(callback_names[kind], "script", script->id);
+    const uint64_t start = retro_script_time_usec();
+    int result = retro_script_lua_pcall(L, nargs, 0);
+    retro_script_stats_callback(script, kind, start, result != LUA_OK);
+    TRACE_END(callback_names[kind]);
+    PROBE3(callback_exit, script->id, kind, result);
+    if (result != LUA_OK)
+    {
+        retro_script_error_record* record = report_uncaught_error(script, result);
+        lua_pop(L, 1);
+        
+        const uint32_t max = retro_script_error_filter_max_consecutive();
+        if (record && max && record->consecutive >= max)
+        {
+            // remove the callback, leaving a placeholder so the others keep their places.
+            lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+            if (lua_istable(L, -1))
+            {
+                lua_pushboolean(L, false);
+                lua_rawseti(L, -2, i);
+            }
+            lua_pop(L, 1);
+            if (lua_on_uncaught_error)
+            {
+                char msg[512];
+                snprintf(msg, sizeof(msg), "callback removed after %u consecutive errors: %s", record->consecutive, record->summary);
+                retro_script_report_error(script->id, result, msg);
+            }
+        }
     }
 }
 
 void retro_script_execute_cb(script_state_t* script, int ref)
 {
-    if (!script || ref == LUA_NOREF || ref == LUA_REFNIL)
+    if (!script || script->disabled || ref == LUA_NOREF || ref == LUA_REFNIL)
     {
         return;
     }
     
     lua_State* L = script->L;
     
+    int64_t skipped;
     lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
     if (lua_isfunction(L, -1))
     {
-        int result = retro_script_lua_pcall(L, 0, 0);
-        if (result != LUA_OK)
-        {
-            if (lua_on_uncaught_error) lua_on_uncaught_error(script->id, result, get_lua_error_string(L));
-            lua_pop(L, 1);
-        }
+        if (retro_script_rate_due(script, ref, 1, &skipped)) execute_cb_top(script, ref, 1, skipped);
     }
     else if (lua_istable(L, -1))
     {
         const int len = lua_rawlen(L, -1);
         const int top = lua_gettop(L);
-        for (int i = 1; i <= len; ++i)
+        for (int i = 1; i <= len && !script->disabled; ++i)
         {
-            lua_rawgeti(L, -1, i);
-            int result = retro_script_lua_pcall(L, 0, 0);
-            if (result != LUA_OK)
-            {
-                if (lua_on_uncaught_error) lua_on_uncaught_error(script->id, result, get_lua_error_string(L));
-                lua_pop(L, 1);
-            }
+            if (!retro_script_rate_due(script, ref, i, &skipped)) continue;
+            
+            // (removed callbacks are left as false.)
+            if (lua_rawgeti(L, -1, i) == LUA_TFUNCTION) execute_cb_top(script, ref, i, skipped);
             lua_settop(L, top);
         }
     }
     lua_settop(L, 0);
 }
 
+int retro_script_cb_count(script_state_t* script, int ref)
+{
+    if (!script || script->disabled || ref == LUA_NOREF || ref == LUA_REFNIL)
+    {
+        return 0;
+    }
+    
+    lua_State* L = script->L;
+    int count = 0;
+    switch (lua_rawgeti(L, LUA_REGISTRYINDEX, ref))
+    {
+    case LUA_TFUNCTION:
+        count = 1;
+        break;
+    case LUA_TTABLE:
+        count = lua_rawlen(L, -1);
+        break;
+    }
+    lua_pop(L, 1);
+    return count;
+}
+
+void retro_script_execute_cb_at(script_state_t* script, int ref, int i)
+{
+    if (!script || script->disabled || ref == LUA_NOREF || ref == LUA_REFNIL)
+    {
+        return;
+    }
+    
+    lua_State* L = script->L;
+    
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    if (lua_istable(L, -1))
+    {
+        lua_rawgeti(L, -1, i);
+    }
+    else if (i != 1)
+    {
+        lua_pushnil(L);
+    }
+    
+    if (lua_isfunction(L, -1))
+    {
+        execute_cb_top(script, ref, i, -1);
+    }
+    lua_settop(L, 0);
+}
+
 RETRO_SCRIPT_API retro_script_id_t retro_script_load_lua(const char* script_path)
 {
     return retro_script_load_lua_special(script_path, NULL);
 }
 
-RETRO_SCRIPT_API retro_script_id_t retro_script_load_lua_special(const char* script_path, retro_script_setup_lua_t frontend_setup)
+void retro_script_push_retro_table(script_state_t* script)
 {
-    script_state_t* script_state = script_alloc(script_path);
-    if (!script_state)
+    lua_State* L = script->L;
+    if (script->shared.enabled)
     {
-        set_error_nofree("Unable to allocate script");
-        return 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, script->shared.retro);
+        return;
     }
-    lua_State* L = script_state->L;
     
+    // package.loaded.retro, as 'retro' is not a global.
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    lua_getfield(L, -1, "retro");
+    lua_remove(L, -2);
+}
+
+char* retro_script_package_path(const char* script_path)
+{
     char* p, *f, *packagepath = NULL;
     retro_script_split_path_file(&p, &f, script_path);
     if (f) free(f);
@@ -350,45 +675,140 @@ RETRO_SCRIPT_API retro_script_id_t retro_script_load_lua_special(const char* scr
     {
         size_t plen = strlen(p);
         packagepath = malloc(plen + 1 + strlen("?.lua"));
-        memcpy(packagepath, p, plen);
-        strcpy(packagepath + plen, "?.lua");
+        if (packagepath)
+        {
+            memcpy(packagepath, p, plen);
+            strcpy(packagepath + plen, "?.lua");
+        }
         free(p);
     }
-    lua_set_libs(L, p ? packagepath : NULL);
-    if (packagepath) free(packagepath);
+    return packagepath;
+}
+
+bool retro_script_run_chunk(script_state_t* script_state, const char* bytecode, size_t size)
+{
+    lua_State* L = script_state->L;
+    const char* script_path = script_state->path;
+    PROBE2(load_begin, script_state->id, script_path);
+    TRACE_BEGIN("load", "script", script_state->id);
     
-    int no_error = 1; // becomes 0 if error.
+    char* packagepath = retro_script_package_path(script_path);
+    lua_pushcfunction(L, lua_set_core_libs_protected);
+    lua_pushlightuserdata(L, packagepath);
+    int no_error = lua_pcall(L, 1, 0, 0) == LUA_OK; // becomes 0 if error.
+    
+    retro_script_watchdog_setup(script_state);
+    if (packagepath) free(packagepath);
+    if (no_error) no_error = retro_script_reload_setup(script_state);
     
     // core can modify lua state.
-    if (core.retro_get_proc_address)
+    if (no_error && core.retro_get_proc_address)
     {
         retro_script_setup_lua_t core_setup = (retro_script_setup_lua_t)core.retro_get_proc_address("retro_script_setup_lua");
         if (core_setup)
         {
-            lua_getglobal(L, "retro");
+            retro_script_push_retro_table(script_state);
             no_error = core_setup(L);
             lua_pop(L, 1);
         }
     }
     
     // front-end can modify lua state
-    if (no_error && frontend_setup)
+    if (no_error && script_state->setup)
     {
-        lua_getglobal(L, "retro");
-        no_error = frontend_setup(L);
+        retro_script_push_retro_table(script_state);
+        no_error = script_state->setup(L);
         lua_pop(L, 1);
     }
     
-    if (no_error) no_error = !luaL_dofile(L, script_path);
+    // run the script, within its load budget.
+    if (no_error)
+    {
+        no_error = (bytecode
+            ? luaL_loadbufferx(L, bytecode, size, script_path, "b")
+            : luaL_loadfile(L, script_path)) == LUA_OK;
+    }
+    if (no_error && script_state->shared.enabled)
+    {
+        // give the script its own _ENV.
+        lua_rawgeti(L, LUA_REGISTRYINDEX, script_state->shared.env);
+        lua_setupvalue(L, -2, 1);
+    }
     if (no_error)
+    {
+        retro_script_watchdog_arm(script_state, script_state->watchdog.load_budget);
+        int result = lua_pcall(L, 0, LUA_MULTRET, 0);
+        no_error = retro_script_watchdog_disarm(script_state, result) == LUA_OK;
+    }
+    if (no_error)
+    {
+        lua_settop(L, 0);
+        if (!script_state->shared.enabled) retro_script_gc_setup(script_state);
+    }
+    TRACE_END("load");
+    PROBE2(load_end, script_state->id, no_error);
+    return no_error;
+}
+
+RETRO_SCRIPT_API bool retro_script_unload(retro_script_id_t id)
+{
+    retro_script_observers_wait();
+    return !script_free(id);
+}
+
+RETRO_SCRIPT_API bool retro_script_set_enabled(retro_script_id_t id, bool enabled)
+{
+    retro_script_observers_wait();
+    script_state_t* script = script_find(id);
+    if (!script || script->unload_pending) return false;
+    
+    script->paused = !enabled;
+    script->disabled = !enabled;
+    
+    // give a script disabled by the watchdog a fresh start.
+    if (enabled)
+    {
+        script->watchdog.overruns = 0;
+        script->watchdog.overrun_callback = NULL;
+    }
+    return true;
+}
+
+RETRO_SCRIPT_API size_t retro_script_list(retro_script_id_t* ids, size_t max)
+{
+    size_t count = 0;
+    SCRIPT_ITERATE(script)
+    {
+        if (script->unload_pending) continue;
+        if (ids && count < max) ids[count] = script->id;
+        count++;
+    }
+    return count;
+}
+
+RETRO_SCRIPT_API retro_script_id_t retro_script_load_lua_special(const char* script_path, retro_script_setup_lua_t frontend_setup)
+{
+    // (the new script may publish or subscribe, which observers must not see mid-frame.)
+    retro_script_observers_wait();
+    script_state_t* script_state = script_alloc(script_path);
+    if (!script_state)
+    {
+        set_error_nofree("Unable to allocate script");
+        return 0;
+    }
+    script_state->setup = frontend_setup;
+    retro_script_watchdog_init(script_state);
+    
+    if (retro_script_run_chunk(script_state, NULL, 0))
     {
         return script_state->id;
     }
     else
     {
+        lua_State* L = script_state->L;
         set_error(lua_tostring(L, -1));
         lua_pop(L, 1);
         script_free(script_state->id);
         return 0;
     }
-}
\ No newline at end of file
+}
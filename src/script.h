@@ -1,22 +1,131 @@
 #pragma once
 
 struct lua_State;
+struct retro_script_heap;
 
 typedef struct script_state
 {
     struct lua_State* L;
+    struct retro_script_heap* heap;
     retro_script_id_t id;
+    
+    // the slot pointing to this script, through which its lua threads find it.
+    // its heap's owner (see heap.h), or for a shared script, a slot of its own (see shared.c).
+    struct script_state** binding;
     struct script_state* next;
     
+    // the script file, and the front-end's setup callback (if any).
+    char* path;
+    retro_script_setup_lua_t setup;
+    
+    // see reload.c; NULL if not watched.
+    struct retro_script_reload* reload;
+    
+    // see shared.c. if enabled, L is a thread in the shared lua state.
+    struct {
+        bool enabled;
+        int thread;
+        int env;
+        int retro;
+    } shared;
+    
+    // callbacks are skipped while set.
+    bool disabled;
+    
+    // set by the front-end with retro_script_set_enabled; implies disabled.
+    bool paused;
+    
+    // see script_defer_free; implies disabled.
+    bool unload_pending;
+    
+    // see observer.c
+    bool observer;
+    
+    // see deferred.c; on_run_deferred callbacks counted at the start of the frame.
+    int deferred_count;
+    
     // lua references.
     // unless otherwise stated, these are 'reflists.'
     // see: retro_script_reflist_lua_variable
     struct {
         int on_run_begin;
         int on_run_end;
+        int on_run_deferred;
+        int on_reload;
     } refs;
+    
+    // see gc.c
+    struct {
+        bool in_cycle;
+        size_t threshold_kb;
+        size_t stepped_kb; // memory in use after the last step
+    } gc;
+    
+    // see watchdog.c
+    struct {
+        uint64_t callback_budget;
+        uint64_t load_budget;
+        int64_t remaining;
+        uint32_t depth;
+        uint32_t overruns;
+        const void* overrun_callback; // (as errors.current)
+        bool limited;
+        bool exceeded;
+    } watchdog;
+    
+    // see error_filter.c
+    struct {
+        struct retro_script_error_record* records;
+        size_t record_count;
+        size_t failing; // records with consecutive errors
+        const void* current; // function or coroutine being run
+    } errors;
+    
+    // see pack.c; reused by each retro.pack.
+    struct {
+        char* data;
+        size_t capacity;
+    } pack;
+    
+    // see profiler.c; NULL unless the script has been profiled.
+    struct retro_script_profile* profile;
+    
+    // see stats.c. (heap_bytes is filled in when read.)
+    struct retro_script_stats stats;
+    
+    // see rate.c; NULL unless a callback has a rate policy.
+    struct retro_script_rates* rates;
 } script_state_t;
 
+// lua_CFunction which opens the standard libraries and builds the retro table.
+// (this does not depend on the script or core, so pooled states are built with it.)
+int retro_script_lua_open_libs(struct lua_State*);
+
+// pushes the script's retro table.
+void retro_script_push_retro_table(script_state_t*);
+
+// returns the package.path for a script, i.e. its directory followed by "?.lua".
+// caller is responsible for freeing. may return NULL.
+char* retro_script_package_path(const char* script_path);
+
+// sets up the script's lua state and runs the script at script->path,
+// or the given precompiled bytecode if not NULL.
+// returns false on error, leaving the error message on the stack.
+bool retro_script_run_chunk(script_state_t*, const char* bytecode, size_t size);
+
 void retro_script_execute_cb(script_state_t*, int ref);
+
+// number of callbacks in the given ref (function or reflist).
+int retro_script_cb_count(script_state_t*, int ref);
+
+// executes only the i-th callback (1-based) in the given ref.
+void retro_script_execute_cb_at(script_state_t*, int ref, int i);
 int retro_script_lua_pcall(struct lua_State*, int argc, int retc);
-void retro_script_on_uncaught_error(struct lua_State* L, int status);
\ No newline at end of file
+void retro_script_on_uncaught_error(struct lua_State* L, int status);
+
+// reports an error which did not come from lua.
+void retro_script_report_error(retro_script_id_t, int status, const char* msg);
+
+// reports the error on top of the stack of coroutine co, which failed
+// after being resumed from L. the error is popped.
+void retro_script_on_coroutine_error(struct lua_State* L, struct lua_State* co, int status);
\ No newline at end of file
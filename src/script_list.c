@@ -1,56 +1,145 @@
 #include "script_list.h"
+#include "heap.h"
+#include "pool.h"
+#include "shared.h"
+#include "error_filter.h"
+#include "observer.h"
+#include "timers.h"
+#include "jobs.h"
+#include "bus.h"
+#include "pack.h"
+#include "profiler.h"
+#include "rate.h"
+#include "input.h"
+#include "reload.h"
+#include "hc_hooks.h"
+#include "context.h"
+#include "probes.h"
+#include "watchdog.h"
 #include "util.h"
 
 #include <lua_5.4.3.h>
-#include <stdio.h>
 
-static script_state_t* script_states = NULL;
+typedef struct script_list_state
+{
+    script_state_t* script_states;
+    
+    // used to accelerate lookups of script_find.
+    script_state_t* script_find_cache;
+    
+    // see script_defer_free
+    bool defer_free;
+    bool free_pending;
+    
+    retro_script_id_t next_id;
+} script_list_state;
 
-// used to accelerate lookups of script_find.
-static script_state_t* script_find_cache = NULL;
+static void script_list_state_init(void* state)
+{
+    ((script_list_state*)state)->next_id = 1;
+}
+
+CONTEXT_STATE(script_list_state, scripts, script_list_state_init, NULL)
 
 script_state_t* script_first()
 {
-    return script_states;
+    return scripts()->script_states;
 }
 
-script_state_t* script_alloc()
+script_state_t* script_create(const char* path, size_t memory_limit, bool shared)
 {
-    static retro_script_id_t next_id = 1;
-    script_state_t** script_state = &script_states;
-    while (*script_state)
+    script_state_t* script = alloc(script_state_t);
+    if (!script) return NULL;
+    
+    // initialize script state
+    memset(script, 0, sizeof(script_state_t));
+    script->path = retro_script_strdup(path);
+    if (!script->path)
     {
-        script_state = &(*script_state)->next;
+        free(script);
+        return NULL;
     }
+    script->refs.on_run_begin = LUA_NOREF;
+    script->refs.on_run_end = LUA_NOREF;
+    script->refs.on_run_deferred = LUA_NOREF;
+    script->refs.on_reload = LUA_NOREF;
     
-    lua_State* L = luaL_newstate();
-    if (!L) return NULL;
+    if (shared)
+    {
+        if (!retro_script_shared_attach(script)) goto fail;
+    }
+    else
+    {
+        script->L = retro_script_pool_acquire(&script->heap, memory_limit);
+        if (!script->L) goto fail;
+        script->binding = retro_script_heap_owner(script->heap);
+        *script->binding = script;
+    }
+    return script;
     
-    *script_state = alloc(script_state_t);
-    if (!*script_state)
+fail:
+    free(script->path);
+    free(script);
+    return NULL;
+}
+
+void script_destroy(script_state_t* script)
+{
+    retro_script_reload_release(script);
+    retro_script_hc_unregister_breakpoints_for(script->L);
+    if (script->shared.enabled)
     {
-        lua_close(L);
-        return NULL;
+        // the lua state lives on, so the script's references in it must be released.
+        retro_script_timers_clear(script);
+        retro_script_jobs_clear(script);
+        retro_script_bus_clear(script);
+        retro_script_shared_detach(script);
+    }
+    else
+    {
+        // finalizers may not return, so they run under the callback budget.
+        retro_script_watchdog_arm(script, script->watchdog.callback_budget);
+        retro_script_pool_release(script->L, script->heap);
+        retro_script_watchdog_abandon(script);
+        
+        // (cleared after, in case finalizers created any.)
+        retro_script_timers_clear(script);
+        retro_script_jobs_clear(script);
+        retro_script_bus_clear(script);
+    }
+    retro_script_error_filter_clear(script);
+    retro_script_pack_release(script);
+    retro_script_profiler_release(script);
+    retro_script_rate_release(script);
+    free(script->path);
+    free(script);
+}
+
+script_state_t* script_alloc(const char* path)
+{
+    script_state_t** script_state = &scripts()->script_states;
+    while (*script_state)
+    {
+        script_state = &(*script_state)->next;
     }
     
-    // initialize script state
-    memset(*script_state, 0, sizeof(script_state_t));
-    (*script_state)->L = L;
-    (*script_state)->id = next_id++;
-    (*script_state)->refs.on_run_begin = LUA_NOREF;
-    (*script_state)->refs.on_run_end = LUA_NOREF;
+    *script_state = script_create(path, retro_script_heap_get_default_limit(), retro_script_shared_is_default());
+    if (!*script_state) return NULL;
+    (*script_state)->id = scripts()->next_id++;
     
     // cache this newly-created script state to accelerate lookup.
-    script_find_cache = *script_state;
+    scripts()->script_find_cache = *script_state;
     return *script_state;
 }
 
 script_state_t* script_find(retro_script_id_t id)
 {
+    script_list_state* list = scripts();
+    
     // check cache first.
-    if (script_find_cache && script_find_cache->id == id)
+    if (list->script_find_cache && list->script_find_cache->id == id)
     {
-        return script_find_cache;
+        return list->script_find_cache;
     }
     
     // search through linkedlist.
@@ -60,9 +149,9 @@ script_state_t* script_find(retro_script_id_t id)
         script = script->next;
     }
     
-    if (script->id && script->id == id)
+    if (script && script->id == id)
     {
-        script_find_cache = script;
+        list->script_find_cache = script;
         return script;
     }
     else
@@ -71,50 +160,80 @@ script_state_t* script_find(retro_script_id_t id)
     }
 }
 
+script_state_t** script_thread_binding(lua_State* L)
+{
+#ifdef RETRO_SCRIPT_LUAJIT
+    // LuaJIT has no extra space, and its states are never shared,
+    // so the binding is the owner of the heap the state allocates from.
+    void* heap;
+    lua_getallocf(L, &heap);
+    return retro_script_heap_owner((retro_script_heap_t*)heap);
+#else
+    // each thread's extra space points to its script's binding.
+    // (new threads copy the main thread's, unless made with script_newthread.)
+    return *(script_state_t***)lua_getextraspace(L);
+#endif
+}
+
+void script_bind_thread(lua_State* L, script_state_t** binding)
+{
+#ifndef RETRO_SCRIPT_LUAJIT
+    *(script_state_t***)lua_getextraspace(L) = binding;
+#endif
+}
+
 script_state_t* script_find_lua(lua_State* L)
 {
-    // check cache first.
-    if (script_find_cache && script_find_cache->L == L)
-    {
-        return script_find_cache;
-    }
+    script_state_t** binding = script_thread_binding(L);
+    return binding ? *binding : NULL;
+}
+
+lua_State* script_newthread(lua_State* L)
+{
+    lua_State* co = lua_newthread(L);
+    script_bind_thread(co, script_thread_binding(L));
+    return co;
+}
+
+// unlinks and destroys the given script.
+static void script_remove(script_state_t** script_state)
+{
+    script_state_t* tmp = *script_state;
+    *script_state = tmp->next;
     
-    // search through linkedlist for lua script.
-    script_state_t* script = script_first();
-    while (script)
+    // clear cached script if it matches tmp.
+    if (tmp == scripts()->script_find_cache)
     {
-        if (script->L == L)
-        {
-            return script;
-        }
-        script = script->next;
+        scripts()->script_find_cache = NULL;
     }
     
-    return NULL;
+    // (not in script_destroy, as a script being reloaded keeps its overrides.)
+    retro_script_input_release(tmp->id);
+    script_destroy(tmp);
 }
 
 bool script_free(retro_script_id_t id)
 {
-    script_state_t** script_state = &script_states;
+    script_state_t** script_state = &scripts()->script_states;
     while (*script_state && (*script_state)->id < id)
     {
         script_state = &(*script_state)->next;
     }
     
-    if (*script_state && (*script_state)->id != id) // note: checking the id again is paranoia.
+    if (*script_state && (*script_state)->id == id && !(*script_state)->unload_pending) // note: checking the id again is paranoia.
     {
-        script_state_t* tmp = *script_state;
-        *script_state = tmp->next;
-        
-        // clear cached script if it matches tmp.
-        if (tmp == script_find_cache)
+        PROBE1(unload, id);
+        if (scripts()->defer_free)
         {
-            script_find_cache = NULL;
+            // the script (or one iterating over scripts) may be running.
+            (*script_state)->unload_pending = true;
+            (*script_state)->disabled = true;
+            scripts()->free_pending = true;
+        }
+        else
+        {
+            script_remove(script_state);
         }
-        
-        lua_close(tmp->L);
-        free(tmp);
-        
         return false;
     }
     else
@@ -123,10 +242,33 @@ bool script_free(retro_script_id_t id)
     }
 }
 
+void script_defer_free(bool defer)
+{
+    script_list_state* list = scripts();
+    list->defer_free = defer;
+    if (defer || !list->free_pending) return;
+    
+    list->free_pending = false;
+    script_state_t** script_state = &list->script_states;
+    while (*script_state)
+    {
+        if ((*script_state)->unload_pending)
+        {
+            script_remove(script_state);
+        }
+        else
+        {
+            script_state = &(*script_state)->next;
+        }
+    }
+}
+
 void script_clear_all()
 {
-    while (script_states)
+    retro_script_observers_wait();
+    while (scripts()->script_states)
     {
-        script_free(script_states->id);
+        script_remove(&scripts()->script_states);
     }
-}
\ No newline at end of file
+    scripts()->free_pending = false;
+}
@@ -4,18 +4,36 @@
 #include "script.h"
 #include <lua_5.4.3.h>
 
-// allocates a new script, but does not initialize it.
+// allocates a new script and adds it to the list, but does not initialize it.
 // returns NULL only if not enough memory to allocate.
-script_state_t* script_alloc();
+script_state_t* script_alloc(const char* path);
+
+// allocates a script which is not in the list and has no id.
+// if shared, the script gets a thread in the shared lua state (see shared.c).
+// returns NULL only if not enough memory to allocate.
+script_state_t* script_create(const char* path, size_t memory_limit, bool shared);
+
+// frees a script which has already been removed from the list (or was never in it).
+void script_destroy(script_state_t*);
 
 // retrieves the script with the given index.
 // returns NULL if no such script.
 script_state_t* script_find(retro_script_id_t);
 
-// retrieves the script with the given Lua state
-// returns NULL if no such script.
+// retrieves the script with the given Lua state (or any of its coroutines).
+// returns NULL if the Lua state does not belong to a script.
 script_state_t* script_find_lua(lua_State* L);
 
+// the binding (see script_state_t) through which the thread's script is found.
+script_state_t** script_thread_binding(lua_State* L);
+
+// sets the binding through which the thread's script is found.
+void script_bind_thread(lua_State* L, script_state_t** binding);
+
+// lua_newthread, except that the new thread belongs to the same script as L.
+// (lua gives new threads the main thread's script, which differs in a shared lua state.)
+lua_State* script_newthread(lua_State* L);
+
 // allows iterating over all scripts
 // returns NULL if no scripts.
 script_state_t* script_first();
@@ -24,6 +42,10 @@ script_state_t* script_first();
 // frees the path and lua state as well.
 bool script_free(retro_script_id_t);
 
+// while set, script_free only disables scripts and marks them to be freed
+// once unset, e.g. so a script cannot be freed while it is running.
+void script_defer_free(bool defer);
+
 // removes all scripts.
 void script_clear_all();
 
@@ -1,11 +1,15 @@
 #include "script_luafuncs.h"
 #include "memmap.h"
+#include "observer.h"
 #include "core.h"
+#include "util.h"
 
 #include <lua_5.4.3.h>
 
 int retro_script_luafunc_input_poll(lua_State* L)
 {
+    // (the front-end's input callbacks are only called from the main thread.)
+    retro_script_observer_check(L, "retro.input_poll");
     if (frontend_callbacks.retro_input_poll)
     {
         frontend_callbacks.retro_input_poll();
@@ -15,6 +19,8 @@ int retro_script_luafunc_input_poll(lua_State* L)
 
 int retro_script_luafunc_input_state(lua_State* L)
 {
+    retro_script_observer_check(L, "retro.input_state");
+    
     // validate args
     int n = lua_gettop(L);
     if (n != 4) return 0; // number of args
@@ -41,83 +47,122 @@ int retro_script_luafunc_input_state(lua_State* L)
     }
 }
 
-void retro_script_luafield_constants(struct lua_State* L)
+typedef struct retro_script_constant
 {
-    // adds the macro twice, once with the RETRO_ prefix cropped.
-    #define REGISTER_INT_MACRO(macro) \
-        lua_pushinteger(L, macro); \
-        lua_setfield(L, -2, #macro); \
-        if (strncmp(#macro, "RETRO_", strlen("RETRO_")) == 0) { \
-            lua_pushinteger(L, macro); \
-            lua_setfield(L, -2, #macro + strlen("RETRO_")); \
-        }
+    const char* name;
+    lua_Integer value;
+} retro_script_constant;
+
+#define CONSTANT_PREFIX "RETRO_"
+#define CONSTANT(macro) { #macro, macro }
+
+// shared by all scripts. sorted by name on startup.
+static retro_script_constant constants[] = {
+    CONSTANT(RETRO_DEVICE_NONE),
+    CONSTANT(RETRO_DEVICE_JOYPAD),
+    CONSTANT(RETRO_DEVICE_MOUSE),
+    CONSTANT(RETRO_DEVICE_KEYBOARD),
+    CONSTANT(RETRO_DEVICE_LIGHTGUN),
+    CONSTANT(RETRO_DEVICE_ANALOG),
+    CONSTANT(RETRO_DEVICE_POINTER),
+    
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_B),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_Y),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_SELECT),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_START),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_UP),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_DOWN),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_LEFT),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_RIGHT),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_A),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_X),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_L),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_R),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_L2),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_R2),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_L3),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_R3),
+    CONSTANT(RETRO_DEVICE_ID_JOYPAD_MASK),
     
-    REGISTER_INT_MACRO(RETRO_DEVICE_NONE);
-    REGISTER_INT_MACRO(RETRO_DEVICE_JOYPAD);
-    REGISTER_INT_MACRO(RETRO_DEVICE_MOUSE);
-    REGISTER_INT_MACRO(RETRO_DEVICE_KEYBOARD);
-    REGISTER_INT_MACRO(RETRO_DEVICE_LIGHTGUN);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ANALOG);
-    REGISTER_INT_MACRO(RETRO_DEVICE_POINTER);
+    CONSTANT(RETRO_DEVICE_INDEX_ANALOG_LEFT),
+    CONSTANT(RETRO_DEVICE_INDEX_ANALOG_RIGHT),
+    CONSTANT(RETRO_DEVICE_INDEX_ANALOG_BUTTON),
+    CONSTANT(RETRO_DEVICE_ID_ANALOG_X),
+    CONSTANT(RETRO_DEVICE_ID_ANALOG_Y),
     
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_B);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_Y);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_SELECT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_START);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_UP);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_DOWN);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_LEFT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_RIGHT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_A);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_X);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_L);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_R);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_L2);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_R2);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_L3);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_R3);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_JOYPAD_MASK);
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_X),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_Y),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_LEFT),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_RIGHT),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_WHEELUP),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_WHEELDOWN),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_MIDDLE),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_HORIZ_WHEELUP),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_HORIZ_WHEELDOWN),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_BUTTON_4),
+    CONSTANT(RETRO_DEVICE_ID_MOUSE_BUTTON_5),
     
-    REGISTER_INT_MACRO(RETRO_DEVICE_INDEX_ANALOG_LEFT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_INDEX_ANALOG_RIGHT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_INDEX_ANALOG_BUTTON);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_ANALOG_X);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_ANALOG_Y);
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_SCREEN_X),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_SCREEN_Y),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_IS_OFFSCREEN),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_TRIGGER),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_RELOAD),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_AUX_A),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_AUX_B),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_START),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_SELECT),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_AUX_C),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_DPAD_UP),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_DPAD_DOWN),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_DPAD_LEFT),
+    CONSTANT(RETRO_DEVICE_ID_LIGHTGUN_DPAD_RIGHT),
     
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_X);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_Y);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_LEFT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_RIGHT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_WHEELUP);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_WHEELDOWN);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_MIDDLE);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_HORIZ_WHEELUP);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_HORIZ_WHEELDOWN);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_BUTTON_4);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_MOUSE_BUTTON_5);
+    CONSTANT(RETRO_DEVICE_ID_POINTER_X),
+    CONSTANT(RETRO_DEVICE_ID_POINTER_Y),
+    CONSTANT(RETRO_DEVICE_ID_POINTER_PRESSED),
+    CONSTANT(RETRO_DEVICE_ID_POINTER_COUNT),
     
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_SCREEN_X);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_SCREEN_Y);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_IS_OFFSCREEN);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_TRIGGER);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_RELOAD);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_AUX_A);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_AUX_B);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_START);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_SELECT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_AUX_C);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_DPAD_UP);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_DPAD_DOWN);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_DPAD_LEFT);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_LIGHTGUN_DPAD_RIGHT);
+    CONSTANT(RETRO_REGION_NTSC),
+    CONSTANT(RETRO_REGION_PAL)
+};
+
+#define CONSTANT_COUNT (sizeof(constants) / sizeof(constants[0]))
+
+static int compare_constants(const void* a, const void* b)
+{
+    return strcmp(((retro_script_constant const*)a)->name, ((retro_script_constant const*)b)->name);
+}
+
+INITIALIZER(sort_constants)
+{
+    qsort(constants, CONSTANT_COUNT, sizeof(retro_script_constant), compare_constants);
+}
+
+int retro_script_luafunc_constants_index(lua_State* L)
+{
+    if (lua_type(L, 2) != LUA_TSTRING) return 0;
     
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_POINTER_X);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_POINTER_Y);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_POINTER_PRESSED);
-    REGISTER_INT_MACRO(RETRO_DEVICE_ID_POINTER_COUNT);
+    // every constant may be accessed with or without the RETRO_ prefix.
+    // (as every name has the prefix, they are also sorted by the names without it.)
+    const size_t prefix_len = strlen(CONSTANT_PREFIX);
+    const char* key = lua_tostring(L, 2);
+    if (strncmp(key, CONSTANT_PREFIX, prefix_len) == 0) key += prefix_len;
     
-    REGISTER_INT_MACRO(RETRO_REGION_NTSC);
-    REGISTER_INT_MACRO(RETRO_REGION_PAL);
+    size_t lo = 0;
+    size_t hi = CONSTANT_COUNT;
+    while (lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int cmp = strcmp(key, constants[mid].name + prefix_len);
+        if (cmp == 0)
+        {
+            lua_pushinteger(L, constants[mid].value);
+            return 1;
+        }
+        if (cmp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return 0;
 }
 
 int retro_script_luafunc_memory_read_char(lua_State* L)
@@ -182,7 +227,7 @@ int retro_script_luafunc_memory_write_char(lua_State* L)
         
         char in = lua_tointeger(L, -1);
         lua_pushinteger(L,
-            retro_script_memory_write_char(addr, in)
+            retro_script_observer_may_write(L) && retro_script_memory_write_char(addr, in)
         );
         
         return 1;
@@ -204,7 +249,7 @@ int retro_script_luafunc_memory_write_byte(lua_State* L)
         
         unsigned char in = lua_tointeger(L, -1);
         lua_pushinteger(L,
-            retro_script_memory_write_byte(addr, in)
+            retro_script_observer_may_write(L) && retro_script_memory_write_byte(addr, in)
         );
         
         return 1;
@@ -246,7 +291,7 @@ int retro_script_luafunc_memory_write_##type##_##le(lua_State* L) \
         if (addr < 0) return 0; \
         ctype in = lua_to##luatype(L, -1); \
         lua_pushinteger(L, \
-            retro_script_memory_write_##type##_##le(addr, in) \
+            retro_script_observer_may_write(L) && retro_script_memory_write_##type##_##le(addr, in) \
         ); \
         return 1; \
     } \
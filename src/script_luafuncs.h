@@ -29,5 +29,5 @@ DECLARE_LUAFUNCS_MEMORY_ACCESS(uint64, uint64_t, integer);
 DECLARE_LUAFUNCS_MEMORY_ACCESS(float32, float, number);
 DECLARE_LUAFUNCS_MEMORY_ACCESS(float64, double, number);
 
-// sets various libretro.h constants
-void retro_script_luafield_constants(struct lua_State* L);
\ No newline at end of file
+// __index metamethod for the retro table, giving various libretro.h constants.
+int retro_script_luafunc_constants_index(lua_State* L);
\ No newline at end of file
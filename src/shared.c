@@ -0,0 +1,279 @@
+#include "shared.h"
+#include "script_list.h"
+#include "pool.h"
+#include "heap.h"
+#include "gc.h"
+#include "reload.h"
+#include "context.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+
+// a script's binding. these last as long as the shared lua state, as a script's
+// coroutines may outlive it; they then point to the host.
+typedef struct shared_binding
+{
+    script_state_t* script;
+    struct shared_binding* next;
+} shared_binding;
+
+typedef struct shared_state
+{
+    bool shared_default;
+    
+    // the shared lua state, and how many scripts use it.
+    script_state_t* host;
+    size_t host_users;
+    shared_binding* bindings;
+} shared_state;
+
+CONTEXT_STATE(shared_state, shared, NULL, NULL)
+
+// coroutine.create, except that the new thread belongs to the script creating it.
+// upvalue: coroutine.create
+static int shared_cocreate(lua_State* L)
+{
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, 1);
+    lua_State* co = lua_tothread(L, -1);
+    if (co) script_bind_thread(co, script_thread_binding(L));
+    return 1;
+}
+
+// coroutine.wrap, likewise. (the wrapper's first upvalue is its thread.)
+// upvalue: coroutine.wrap
+static int shared_cowrap(lua_State* L)
+{
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, 1);
+    if (lua_getupvalue(L, -1, 1))
+    {
+        lua_State* co = lua_tothread(L, -1);
+        if (co) script_bind_thread(co, script_thread_binding(L));
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+// replaces coroutine.create and coroutine.wrap, so that scripts' coroutines (including those
+// created by shared modules) know their script. (the pool restores the originals.)
+static int wrap_coroutines(lua_State* H)
+{
+    if (lua_getglobal(H, LUA_COLIBNAME) != LUA_TTABLE) return 0;
+    lua_getfield(H, -1, "create");
+    lua_pushcclosure(H, shared_cocreate, 1);
+    lua_setfield(H, -2, "create");
+    lua_getfield(H, -1, "wrap");
+    lua_pushcclosure(H, shared_cowrap, 1);
+    lua_setfield(H, -2, "wrap");
+    return 0;
+}
+
+static bool host_create(shared_state* state)
+{
+    script_state_t* host = alloc(script_state_t);
+    if (!host) return false;
+    memset(host, 0, sizeof(script_state_t));
+    
+    host->L = retro_script_pool_acquire(&host->heap, retro_script_heap_get_default_limit());
+    if (!host->L)
+    {
+        free(host);
+        return false;
+    }
+    host->binding = retro_script_heap_owner(host->heap);
+    *host->binding = host;
+    lua_pushcfunction(host->L, wrap_coroutines);
+    if (lua_pcall(host->L, 0, 0, 0) != LUA_OK)
+    {
+        lua_pop(host->L, 1);
+        *host->binding = NULL;
+        retro_script_pool_release(host->L, host->heap);
+        free(host);
+        return false;
+    }
+    host->refs.on_run_begin = LUA_NOREF;
+    host->refs.on_run_end = LUA_NOREF;
+    host->refs.on_run_deferred = LUA_NOREF;
+    host->refs.on_reload = LUA_NOREF;
+    retro_script_gc_setup(host);
+    state->host = host;
+    return true;
+}
+
+static void host_destroy(shared_state* state)
+{
+    retro_script_pool_release(state->host->L, state->host->heap);
+    free(state->host);
+    state->host = NULL;
+    
+    while (state->bindings)
+    {
+        shared_binding* next = state->bindings->next;
+        free(state->bindings);
+        state->bindings = next;
+    }
+}
+
+// require, except that "retro" gives the script's own retro table,
+// and modules are searched for in the script's directory.
+// upvalues: require, retro table, package path
+static int shared_require(lua_State* L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    lua_settop(L, 1);
+    if (strcmp(name, "retro") == 0)
+    {
+        lua_pushvalue(L, lua_upvalueindex(2));
+        return 1;
+    }
+    
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    if (lua_getfield(L, -1, LUA_LOADLIBNAME) != LUA_TTABLE)
+    {
+        return luaL_error(L, "package library is missing");
+    }
+    
+    // a reloaded script loads its modules afresh, rather than getting the old versions.
+    // (other scripts keep whichever version they already have.)
+    if (retro_script_reload_swapping(script_find_lua(L)))
+    {
+        lua_pushnil(L);
+        lua_setfield(L, 2, name);
+    }
+    lua_getfield(L, 3, "path");
+    lua_pushvalue(L, lua_upvalueindex(3));
+    lua_setfield(L, 3, "path");
+    
+    // stack: name, loaded, package, old path
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 1);
+    int status = lua_pcall(L, 1, 2, 0);
+    lua_pushvalue(L, 4);
+    lua_setfield(L, 3, "path");
+    if (status != LUA_OK) return lua_error(L);
+    return 2;
+}
+
+// arg 1: script (light userdata), with its binding set. runs on the host.
+static int attach(lua_State* H)
+{
+    script_state_t* script = (script_state_t*)lua_touserdata(H, 1);
+    
+    lua_State* L = lua_newthread(H);
+    script_bind_thread(L, script->binding);
+    
+    // env: setmetatable({ _G = env }, { __index = _G })
+    lua_newtable(H);
+    lua_newtable(H);
+    lua_pushglobaltable(H);
+    lua_setfield(H, -2, "__index");
+    lua_setmetatable(H, -2);
+    lua_pushvalue(H, -1);
+    lua_setfield(H, -2, "_G");
+    
+    // retro: setmetatable({}, { __index = package.loaded.retro })
+    lua_newtable(H);
+    lua_newtable(H);
+    lua_getfield(H, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    lua_getfield(H, -1, "retro");
+    lua_remove(H, -2);
+    lua_setfield(H, -2, "__index");
+    lua_setmetatable(H, -2);
+    
+    // env.require
+    lua_getglobal(H, "require");
+    lua_pushvalue(H, -2);
+    char* packagepath = retro_script_package_path(script->path);
+    if (packagepath)
+    {
+        lua_pushstring(H, packagepath);
+        free(packagepath);
+    }
+    else
+    {
+        lua_pushliteral(H, "?.lua");
+    }
+    lua_pushcclosure(H, shared_require, 3);
+    lua_setfield(H, -3, "require");
+    
+    // (stack: script, thread, env, retro)
+    script->shared.retro = luaL_ref(H, LUA_REGISTRYINDEX);
+    script->shared.env = luaL_ref(H, LUA_REGISTRYINDEX);
+    script->shared.thread = luaL_ref(H, LUA_REGISTRYINDEX);
+    script->shared.enabled = true;
+    script->L = L;
+    script->heap = shared()->host->heap;
+    return 0;
+}
+
+bool retro_script_shared_attach(script_state_t* script)
+{
+    shared_state* state = shared();
+    if (!state->host && !host_create(state)) return false;
+    
+    shared_binding* binding = alloc(shared_binding);
+    if (!binding)
+    {
+        if (state->host_users == 0) host_destroy(state);
+        return false;
+    }
+    binding->script = script;
+    binding->next = state->bindings;
+    state->bindings = binding;
+    script->binding = &binding->script;
+    
+    lua_State* H = state->host->L;
+    lua_pushcfunction(H, attach);
+    lua_pushlightuserdata(H, script);
+    if (lua_pcall(H, 1, 0, 0) != LUA_OK)
+    {
+        lua_pop(H, 1);
+        binding->script = state->host;
+        if (state->host_users == 0) host_destroy(state);
+        return false;
+    }
+    
+    state->host_users++;
+    return true;
+}
+
+void retro_script_shared_detach(script_state_t* script)
+{
+    shared_state* state = shared();
+    lua_State* H = state->host->L;
+    luaL_unref(H, LUA_REGISTRYINDEX, script->refs.on_run_begin);
+    luaL_unref(H, LUA_REGISTRYINDEX, script->refs.on_run_end);
+    luaL_unref(H, LUA_REGISTRYINDEX, script->refs.on_run_deferred);
+    luaL_unref(H, LUA_REGISTRYINDEX, script->refs.on_reload);
+    luaL_unref(H, LUA_REGISTRYINDEX, script->shared.retro);
+    luaL_unref(H, LUA_REGISTRYINDEX, script->shared.env);
+    luaL_unref(H, LUA_REGISTRYINDEX, script->shared.thread);
+    
+    // the thread and its coroutines may outlive the script.
+    *script->binding = state->host;
+    lua_sethook(script->L, NULL, 0, 0);
+    
+    if (--state->host_users == 0) host_destroy(state);
+}
+
+script_state_t* retro_script_shared_host()
+{
+    return shared()->host;
+}
+
+bool retro_script_shared_is_default()
+{
+    return shared()->shared_default;
+}
+
+RETRO_SCRIPT_API void retro_script_set_shared_vm(bool enabled)
+{
+#ifdef RETRO_SCRIPT_LUAJIT
+    // (LuaJIT has no per-thread extra space to tell the scripts apart.)
+    enabled = false;
+#endif
+    shared()->shared_default = enabled;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+/* Shared-VM mode: scripts may share one lua state, each running on its own
+ * thread with its own _ENV and retro table. Libraries, and modules loaded
+ * with require, are shared between them.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+// true if newly-loaded scripts should share a lua state.
+bool retro_script_shared_is_default();
+
+// gives the script a thread in the shared lua state, creating the state if needed.
+// returns false if not enough memory.
+bool retro_script_shared_attach(script_state_t*);
+
+// releases the script's references in the shared lua state,
+// and the state itself if no scripts remain.
+void retro_script_shared_detach(script_state_t*);
+
+// a script (not in the script list) representing the shared lua state itself,
+// or NULL if there is none. used for collecting garbage.
+script_state_t* retro_script_shared_host();
@@ -0,0 +1,122 @@
+#include "stats.h"
+#include "script_list.h"
+#include "heap.h"
+#include "observer.h"
+#include "context.h"
+#include "util.h"
+
+typedef struct stats_state
+{
+    uint64_t frames;
+    uint64_t frame_usec;
+    uint64_t frame_max_usec;
+    uint64_t core_usec;
+    
+    // breakpoint callbacks run during the core's retro_run are not core time.
+    uint64_t breakpoint_usec;
+    uint64_t core_start;
+    uint64_t core_start_breakpoint_usec;
+} stats_state;
+
+CONTEXT_STATE(stats_state, stats, NULL, NULL)
+
+void retro_script_stats_callback(script_state_t* script, retro_script_callback_kind_t kind, uint64_t start, bool error)
+{
+    const uint64_t usec = retro_script_time_usec() - start;
+    struct retro_script_callback_stats* cb = &script->stats.callbacks[kind];
+    cb->count++;
+    cb->total_usec += usec;
+    if (usec > cb->max_usec) cb->max_usec = usec;
+    if (error) cb->errors++;
+    
+    // (breakpoints only fire on the thread running the core.)
+    if (kind == RETRO_SCRIPT_CALLBACK_BREAKPOINT) stats()->breakpoint_usec += usec;
+}
+
+void retro_script_stats_core_begin()
+{
+    stats_state* state = stats();
+    state->core_start_breakpoint_usec = state->breakpoint_usec;
+    state->core_start = retro_script_time_usec();
+}
+
+void retro_script_stats_core_end()
+{
+    stats_state* state = stats();
+    const uint64_t usec = retro_script_time_usec() - state->core_start;
+    const uint64_t breakpoint_usec = state->breakpoint_usec - state->core_start_breakpoint_usec;
+    state->core_usec += (usec > breakpoint_usec) ? usec - breakpoint_usec : 0;
+}
+
+void retro_script_stats_frame_end(uint64_t frame_start)
+{
+    stats_state* state = stats();
+    const uint64_t usec = retro_script_time_usec() - frame_start;
+    state->frames++;
+    state->frame_usec += usec;
+    if (usec > state->frame_max_usec) state->frame_max_usec = usec;
+}
+
+static void get_stats(script_state_t* script, struct retro_script_stats* out)
+{
+    *out = script->stats;
+    out->heap_bytes = 0;
+    if (script->heap)
+    {
+        struct retro_script_memory_stats memory;
+        retro_script_heap_get_stats(script->heap, &memory);
+        out->heap_bytes = memory.live_bytes;
+    }
+}
+
+RETRO_SCRIPT_API bool retro_script_get_stats(retro_script_id_t id, struct retro_script_stats* out)
+{
+    retro_script_observers_wait();
+    script_state_t* script = script_find(id);
+    if (!script || !out) return false;
+    get_stats(script, out);
+    return true;
+}
+
+RETRO_SCRIPT_API void retro_script_get_global_stats(struct retro_script_global_stats* out)
+{
+    if (!out) return;
+    retro_script_observers_wait();
+    stats_state* state = stats();
+    memset(out, 0, sizeof(*out));
+    out->frames = state->frames;
+    out->frame_usec = state->frame_usec;
+    out->frame_max_usec = state->frame_max_usec;
+    out->core_usec = state->core_usec;
+    out->script_usec = state->frame_usec - state->core_usec;
+    
+    SCRIPT_ITERATE(script)
+    {
+        struct retro_script_stats s;
+        get_stats(script, &s);
+        for (int i = 0; i < RETRO_SCRIPT_CALLBACK_KIND_COUNT; ++i)
+        {
+            struct retro_script_callback_stats* total = &out->scripts.callbacks[i];
+            total->count += s.callbacks[i].count;
+            total->errors += s.callbacks[i].errors;
+            total->total_usec += s.callbacks[i].total_usec;
+            if (s.callbacks[i].max_usec > total->max_usec) total->max_usec = s.callbacks[i].max_usec;
+        }
+        out->scripts.heap_bytes += s.heap_bytes;
+    }
+}
+
+RETRO_SCRIPT_API void retro_script_reset_stats(void)
+{
+    retro_script_observers_wait();
+    stats_state* state = stats();
+    const uint64_t core_start = state->core_start;
+    memset(state, 0, sizeof(stats_state));
+    
+    // (in case this is called while the core is running.)
+    state->core_start = core_start;
+    SCRIPT_ITERATE(script)
+    {
+        memset(&script->stats, 0, sizeof(script->stats));
+    }
+}
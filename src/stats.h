@@ -0,0 +1,19 @@
+#pragma once
+
+/* Runtime statistics for the frontend: time spent in each kind of callback,
+ * per script, and how each frame's time divides between the core and scripts.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+// records a callback which began at start (from retro_script_time_usec) and has just returned.
+// may be called from observer threads, for callbacks other than breakpoints.
+void retro_script_stats_callback(script_state_t*, retro_script_callback_kind_t kind, uint64_t start, bool error);
+
+// called around the core's retro_run.
+void retro_script_stats_core_begin();
+void retro_script_stats_core_end();
+
+// called at the end of the intercepted retro_run.
+void retro_script_stats_frame_end(uint64_t frame_start);
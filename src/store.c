@@ -0,0 +1,327 @@
+#include "store.h"
+#include "observer.h"
+#include "context.h"
+#include "core.h"
+#include "util.h"
+
+#include <limits.h>
+
+#define STORE_INITIAL_BUCKETS 64
+
+typedef struct store_entry
+{
+    uint32_t hash;
+    size_t key_len;
+    retro_script_value value;
+    struct store_entry* next;
+    char key[];
+} store_entry;
+
+typedef struct store_state
+{
+    store_entry** buckets;
+    size_t bucket_count; // power of 2
+    size_t count;
+} store_state;
+
+static void store_clear(store_state* state)
+{
+    for (size_t i = 0; i < state->bucket_count; ++i)
+    {
+        store_entry* entry = state->buckets[i];
+        while (entry)
+        {
+            store_entry* next = entry->next;
+            retro_script_value_free(&entry->value);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(state->buckets);
+    state->buckets = NULL;
+    state->bucket_count = 0;
+    state->count = 0;
+}
+
+static void store_state_destroy(void* state)
+{
+    store_clear((store_state*)state);
+}
+
+CONTEXT_STATE(store_state, store, NULL, store_state_destroy)
+
+static bool store_grow(store_state* state)
+{
+    const size_t bucket_count = state->bucket_count ? state->bucket_count * 2 : STORE_INITIAL_BUCKETS;
+    store_entry** buckets = (store_entry**)calloc(bucket_count, sizeof(store_entry*));
+    if (!buckets) return false;
+    for (size_t i = 0; i < state->bucket_count; ++i)
+    {
+        store_entry* entry = state->buckets[i];
+        while (entry)
+        {
+            store_entry* next = entry->next;
+            store_entry** bucket = &buckets[entry->hash & (bucket_count - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(state->buckets);
+    state->buckets = buckets;
+    state->bucket_count = bucket_count;
+    return true;
+}
+
+// returns the link pointing to the entry for the given key, or to NULL if there is none.
+static store_entry** store_find(store_state* state, const char* key, size_t len, uint32_t hash)
+{
+    store_entry** link = &state->buckets[hash & (state->bucket_count - 1)];
+    for (; *link; link = &(*link)->next)
+    {
+        store_entry* entry = *link;
+        if (entry->hash == hash && entry->key_len == len && memcmp(entry->key, key, len) == 0) break;
+    }
+    return link;
+}
+
+// converts a number, boolean or string. returns false if the value is of another type.
+static bool scalar_from_lua(lua_State* L, int idx, retro_script_value* out)
+{
+    out->is_integer = false;
+    out->len = 0;
+    switch (out->type = lua_type(L, idx))
+    {
+    case LUA_TNIL:
+        return true;
+    case LUA_TBOOLEAN:
+        out->as.b = lua_toboolean(L, idx);
+        return true;
+    case LUA_TNUMBER:
+        if ((out->is_integer = lua_isinteger(L, idx)))
+        {
+            out->as.i = lua_tointeger(L, idx);
+        }
+        else
+        {
+            out->as.n = lua_tonumber(L, idx);
+        }
+        return true;
+    case LUA_TSTRING:
+        // (the caller copies the string.)
+        out->as.s = (char*)lua_tolstring(L, idx, &out->len);
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool retro_script_value_from_lua(lua_State* L, int idx, retro_script_value* out, const char** error)
+{
+    *error = NULL;
+    idx = lua_absindex(L, idx);
+    if (lua_type(L, idx) != LUA_TTABLE)
+    {
+        if (!scalar_from_lua(L, idx, out))
+        {
+            *error = "only numbers, booleans, strings and arrays of these can be stored";
+            return false;
+        }
+        if (out->type == LUA_TSTRING)
+        {
+            const char* s = out->as.s;
+            if (!(out->as.s = malloc_array(char, out->len + 1))) return false;
+            memcpy(out->as.s, s, out->len + 1);
+        }
+        return true;
+    }
+    
+    // the elements and their strings are kept in one allocation, so check them first.
+    const size_t len = lua_rawlen(L, idx);
+    size_t string_bytes = 0;
+    for (size_t i = 1; i <= len; ++i)
+    {
+        const int type = lua_rawgeti(L, idx, i);
+        if (type == LUA_TSTRING)
+        {
+            string_bytes += lua_rawlen(L, -1) + 1;
+        }
+        lua_pop(L, 1);
+        if (type != LUA_TNUMBER && type != LUA_TBOOLEAN && type != LUA_TSTRING)
+        {
+            *error = "arrays may only hold numbers, booleans and strings";
+            return false;
+        }
+    }
+    
+    retro_script_value* elements = (retro_script_value*)malloc(sizeof(retro_script_value) * len + string_bytes + 1);
+    if (!elements) return false;
+    char* strings = (char*)(elements + len);
+    for (size_t i = 0; i < len; ++i)
+    {
+        lua_rawgeti(L, idx, i + 1);
+        scalar_from_lua(L, -1, &elements[i]);
+        if (elements[i].type == LUA_TSTRING)
+        {
+            memcpy(strings, elements[i].as.s, elements[i].len + 1);
+            elements[i].as.s = strings;
+            strings += elements[i].len + 1;
+        }
+        lua_pop(L, 1);
+    }
+    out->type = LUA_TTABLE;
+    out->is_integer = false;
+    out->len = len;
+    out->as.a = elements;
+    return true;
+}
+
+static void scalar_push(lua_State* L, retro_script_value const* value)
+{
+    switch (value->type)
+    {
+    case LUA_TBOOLEAN:
+        lua_pushboolean(L, value->as.b);
+        break;
+    case LUA_TNUMBER:
+        if (value->is_integer)
+        {
+            lua_pushinteger(L, value->as.i);
+        }
+        else
+        {
+            lua_pushnumber(L, value->as.n);
+        }
+        break;
+    case LUA_TSTRING:
+        lua_pushlstring(L, value->as.s, value->len);
+        break;
+    default:
+        lua_pushnil(L);
+        break;
+    }
+}
+
+void retro_script_value_push(lua_State* L, retro_script_value const* value)
+{
+    if (value->type != LUA_TTABLE)
+    {
+        scalar_push(L, value);
+        return;
+    }
+    
+    lua_createtable(L, value->len > INT_MAX ? INT_MAX : (int)value->len, 0);
+    for (size_t i = 0; i < value->len; ++i)
+    {
+        scalar_push(L, &value->as.a[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+void retro_script_value_free(retro_script_value* value)
+{
+    // (an array's strings share its allocation.)
+    if (value->type == LUA_TSTRING)
+    {
+        free(value->as.s);
+    }
+    else if (value->type == LUA_TTABLE)
+    {
+        free(value->as.a);
+    }
+    value->type = LUA_TNIL;
+}
+
+// lua args: key, value (nil to remove)
+int retro_script_luafunc_shared_set(lua_State* L)
+{
+    store_state* state = store();
+    retro_script_observer_check(L, "retro.shared.set");
+    
+    // (observers still running from the frame may be reading the store.)
+    retro_script_observers_wait();
+    
+    size_t len;
+    const char* key = luaL_checklstring(L, 1, &len);
+    luaL_checkany(L, 2);
+    
+    retro_script_value value;
+    const char* error;
+    if (!retro_script_value_from_lua(L, 2, &value, &error))
+    {
+        if (error) return luaL_argerror(L, 2, error);
+        return luaL_error(L, "unable to allocate shared value");
+    }
+    
+    if (!state->buckets && !store_grow(state))
+    {
+        retro_script_value_free(&value);
+        return luaL_error(L, "unable to allocate shared store");
+    }
+    
+    const uint32_t hash = retro_script_fnv1a(key, len);
+    store_entry** link = store_find(state, key, len, hash);
+    store_entry* entry = *link;
+    if (entry)
+    {
+        retro_script_value_free(&entry->value);
+        if (value.type != LUA_TNIL)
+        {
+            entry->value = value;
+            return 0;
+        }
+        
+        *link = entry->next;
+        free(entry);
+        state->count--;
+        return 0;
+    }
+    if (value.type == LUA_TNIL) return 0;
+    
+    entry = (store_entry*)malloc(sizeof(store_entry) + len);
+    if (!entry)
+    {
+        retro_script_value_free(&value);
+        return luaL_error(L, "unable to allocate shared value");
+    }
+    entry->hash = hash;
+    entry->key_len = len;
+    entry->value = value;
+    memcpy(entry->key, key, len);
+    entry->next = *link;
+    *link = entry;
+    
+    // (if this fails, the table just stays more loaded than intended.)
+    if (++state->count > state->bucket_count) store_grow(state);
+    return 0;
+}
+
+// lua args: key
+//      ret: value, or nil
+int retro_script_luafunc_shared_get(lua_State* L)
+{
+    store_state* state = store();
+    size_t len;
+    const char* key = luaL_checklstring(L, 1, &len);
+    if (!state->buckets)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+    
+    store_entry* entry = *store_find(state, key, len, retro_script_fnv1a(key, len));
+    if (entry)
+    {
+        retro_script_value_push(L, &entry->value);
+    }
+    else
+    {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+ON_DEINIT()
+{
+    store_clear(store());
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+/* A key/value store owned by C, shared by all scripts in a context (retro.shared).
+ * Values are copied out of lua when set, and into lua when read, so need no serialization.
+ * Also used by the message bus (bus.c).
+ */
+
+#include "libretro_script.h"
+
+#include <lua_5.4.3.h>
+#include <stdbool.h>
+
+// a number, boolean or string, or a flat array of these.
+typedef struct retro_script_value
+{
+    int type; // LUA_TNIL, LUA_TBOOLEAN, LUA_TNUMBER, LUA_TSTRING or LUA_TTABLE (array)
+    bool is_integer;
+    size_t len; // string length, or array element count.
+    union
+    {
+        bool b;
+        lua_Integer i;
+        lua_Number n;
+        char* s;
+        struct retro_script_value* a;
+    } as;
+} retro_script_value;
+
+// copies the lua value at idx. returns false if it is of a type which cannot be stored,
+// setting *error; or if not enough memory, leaving *error NULL.
+bool retro_script_value_from_lua(lua_State* L, int idx, retro_script_value* out, const char** error);
+
+// pushes a copy of the value.
+void retro_script_value_push(lua_State* L, retro_script_value const*);
+
+void retro_script_value_free(retro_script_value*);
+
+// lua args: key, value (nil to remove)
+int retro_script_luafunc_shared_set(lua_State* L);
+
+// lua args: key
+//      ret: value, or nil
+int retro_script_luafunc_shared_get(lua_State* L);
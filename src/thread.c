@@ -0,0 +1,173 @@
+#include "thread.h"
+#include "util.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+typedef struct thread_start
+{
+    retro_script_thread_fn fn;
+    void* ud;
+} thread_start;
+
+#ifdef _WIN32
+
+static DWORD WINAPI thread_main(LPVOID arg)
+{
+    thread_start start = *(thread_start*)arg;
+    free(arg);
+    start.fn(start.ud);
+    return 0;
+}
+
+bool retro_script_thread_create(retro_script_thread_t* thread, retro_script_thread_fn fn, void* ud)
+{
+    thread_start* start = alloc(thread_start);
+    if (!start) return false;
+    start->fn = fn;
+    start->ud = ud;
+    *thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+    if (!*thread)
+    {
+        free(start);
+        return false;
+    }
+    return true;
+}
+
+void retro_script_thread_join(retro_script_thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+void retro_script_mutex_init(retro_script_mutex_t* mutex)
+{
+    InitializeCriticalSection(mutex);
+}
+
+void retro_script_mutex_destroy(retro_script_mutex_t* mutex)
+{
+    DeleteCriticalSection(mutex);
+}
+
+void retro_script_mutex_lock(retro_script_mutex_t* mutex)
+{
+    EnterCriticalSection(mutex);
+}
+
+void retro_script_mutex_unlock(retro_script_mutex_t* mutex)
+{
+    LeaveCriticalSection(mutex);
+}
+
+void retro_script_cond_init(retro_script_cond_t* cond)
+{
+    InitializeConditionVariable(cond);
+}
+
+void retro_script_cond_destroy(retro_script_cond_t* cond)
+{
+    // (win32 condition variables need no cleanup.)
+}
+
+void retro_script_cond_signal(retro_script_cond_t* cond)
+{
+    WakeConditionVariable(cond);
+}
+
+void retro_script_cond_broadcast(retro_script_cond_t* cond)
+{
+    WakeAllConditionVariable(cond);
+}
+
+void retro_script_cond_wait(retro_script_cond_t* cond, retro_script_mutex_t* mutex, uint32_t msec)
+{
+    SleepConditionVariableCS(cond, mutex, msec);
+}
+
+#else
+
+static void* thread_main(void* arg)
+{
+    thread_start start = *(thread_start*)arg;
+    free(arg);
+    start.fn(start.ud);
+    return NULL;
+}
+
+bool retro_script_thread_create(retro_script_thread_t* thread, retro_script_thread_fn fn, void* ud)
+{
+    thread_start* start = alloc(thread_start);
+    if (!start) return false;
+    start->fn = fn;
+    start->ud = ud;
+    if (pthread_create(thread, NULL, thread_main, start) != 0)
+    {
+        free(start);
+        return false;
+    }
+    return true;
+}
+
+void retro_script_thread_join(retro_script_thread_t thread)
+{
+    pthread_join(thread, NULL);
+}
+
+void retro_script_mutex_init(retro_script_mutex_t* mutex)
+{
+    pthread_mutex_init(mutex, NULL);
+}
+
+void retro_script_mutex_destroy(retro_script_mutex_t* mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+void retro_script_mutex_lock(retro_script_mutex_t* mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+void retro_script_mutex_unlock(retro_script_mutex_t* mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+void retro_script_cond_init(retro_script_cond_t* cond)
+{
+    pthread_cond_init(cond, NULL);
+}
+
+void retro_script_cond_destroy(retro_script_cond_t* cond)
+{
+    pthread_cond_destroy(cond);
+}
+
+void retro_script_cond_signal(retro_script_cond_t* cond)
+{
+    pthread_cond_signal(cond);
+}
+
+void retro_script_cond_broadcast(retro_script_cond_t* cond)
+{
+    pthread_cond_broadcast(cond);
+}
+
+void retro_script_cond_wait(retro_script_cond_t* cond, retro_script_mutex_t* mutex, uint32_t msec)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += msec / 1000;
+    until.tv_nsec += (long)(msec % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, mutex, &until);
+}
+
+#endif
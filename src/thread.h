@@ -0,0 +1,38 @@
+#pragma once
+
+/* Minimal portable threads, mutexes and condition variables (pthreads, or win32).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE retro_script_thread_t;
+typedef CRITICAL_SECTION retro_script_mutex_t;
+typedef CONDITION_VARIABLE retro_script_cond_t;
+#else
+#include <pthread.h>
+typedef pthread_t retro_script_thread_t;
+typedef pthread_mutex_t retro_script_mutex_t;
+typedef pthread_cond_t retro_script_cond_t;
+#endif
+
+typedef void (*retro_script_thread_fn)(void* ud);
+
+// returns false if the thread could not be started.
+bool retro_script_thread_create(retro_script_thread_t*, retro_script_thread_fn, void* ud);
+void retro_script_thread_join(retro_script_thread_t);
+
+void retro_script_mutex_init(retro_script_mutex_t*);
+void retro_script_mutex_destroy(retro_script_mutex_t*);
+void retro_script_mutex_lock(retro_script_mutex_t*);
+void retro_script_mutex_unlock(retro_script_mutex_t*);
+
+void retro_script_cond_init(retro_script_cond_t*);
+void retro_script_cond_destroy(retro_script_cond_t*);
+void retro_script_cond_signal(retro_script_cond_t*);
+void retro_script_cond_broadcast(retro_script_cond_t*);
+
+// waits until signalled or until msec have passed. the mutex must be locked.
+void retro_script_cond_wait(retro_script_cond_t*, retro_script_mutex_t*, uint32_t msec);
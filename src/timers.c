@@ -0,0 +1,352 @@
+#include "timers.h"
+#include "script_list.h"
+#include "watchdog.h"
+#include "observer.h"
+#include "context.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+
+// number of slots in the wheel. timers further in the future than this
+// stay in their slot and are skipped until the wheel comes around again.
+#define WHEEL_SIZE 256
+
+typedef struct script_timer
+{
+    uint32_t id;
+    script_state_t* script;
+    int ref; // registry ref to callback, or to coroutine.
+    bool is_coroutine;
+    bool cancelled;
+    uint32_t period; // 0 for one-shot timers.
+    uint64_t due; // frame number
+    struct script_timer* next;
+} script_timer;
+
+typedef struct timers_state
+{
+    script_timer* wheel[WHEEL_SIZE];
+    
+    // timers which are being fired this frame.
+    script_timer* firing;
+    script_timer* current;
+    
+    uint64_t frame;
+    uint32_t next_timer_id;
+} timers_state;
+
+static void timers_state_init(void* state)
+{
+    ((timers_state*)state)->next_timer_id = 1;
+}
+
+CONTEXT_STATE(timers_state, timers, timers_state_init, NULL)
+
+static void timer_insert(script_timer* timer)
+{
+    timers_state* state = timers();
+    script_timer** slot = &state->wheel[timer->due % WHEEL_SIZE];
+    timer->next = *slot;
+    *slot = timer;
+}
+
+static void timer_free(script_timer* timer)
+{
+    luaL_unref(timer->script->L, LUA_REGISTRYINDEX, timer->ref);
+    free(timer);
+}
+
+// precondition: top of stack is the callback or coroutine.
+// pops it.
+static script_timer* timer_create(lua_State* L, uint32_t delay, uint32_t period, bool is_coroutine)
+{
+    timers_state* state = timers();
+    script_timer* timer = alloc(script_timer);
+    if (!timer)
+    {
+        luaL_error(L, "unable to allocate timer");
+        return NULL;
+    }
+    
+    timer->id = state->next_timer_id++;
+    timer->script = script_find_lua(L);
+    timer->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    timer->is_coroutine = is_coroutine;
+    timer->cancelled = false;
+    timer->period = period;
+    timer->due = state->frame + (delay ? delay : 1);
+    timer_insert(timer);
+    return timer;
+}
+
+// resumes the coroutine co, which belongs to the given script.
+// returns true if the coroutine yielded (and so should be rescheduled),
+// in which case *delay is set to the number of frames it asked to wait.
+static bool resume_coroutine(script_state_t* script, lua_State* co, int argc, uint32_t* delay)
+{
+    lua_State* L = script->L;
+    int nres;
+    
+    retro_script_watchdog_arm(script, script->watchdog.callback_budget);
+    int status = lua_resume(co, L, argc, &nres);
+    status = retro_script_watchdog_disarm(script, status);
+    
+    if (status == LUA_YIELD)
+    {
+        // retro.wait(n) yields n; a plain coroutine.yield() waits one frame.
+        lua_Integer n = (nres > 0 && lua_isinteger(co, -nres)) ? lua_tointeger(co, -nres) : 1;
+        lua_pop(co, nres);
+        *delay = (n < 1) ? 1 : (n > UINT32_MAX) ? UINT32_MAX : (uint32_t)n;
+        return true;
+    }
+    else if (status != LUA_OK)
+    {
+        retro_script_on_coroutine_error(L, co, status);
+    }
+    else
+    {
+        lua_pop(co, nres);
+    }
+    return false;
+}
+
+static void timer_fire(script_timer* timer)
+{
+    timers_state* state = timers();
+    script_state_t* script = timer->script;
+    lua_State* L = script->L;
+    
+    if (script->disabled)
+    {
+        // try again next frame.
+        timer->due = state->frame + 1;
+        timer_insert(timer);
+        return;
+    }
+    
+    lua_rawgeti(L, LUA_REGISTRYINDEX, timer->ref);
+    if (timer->is_coroutine)
+    {
+        lua_State* co = lua_tothread(L, -1);
+        lua_pop(L, 1);
+        uint32_t delay;
+        if (co && resume_coroutine(script, co, 0, &delay) && !timer->cancelled)
+        {
+            timer->due = state->frame + delay;
+            timer_insert(timer);
+            return;
+        }
+    }
+    else
+    {
+        int result = retro_script_lua_pcall(L, 0, 0);
+        if (result != LUA_OK)
+        {
+            retro_script_on_uncaught_error(L, result);
+        }
+        lua_settop(L, 0);
+        
+        if (timer->period && !timer->cancelled)
+        {
+            timer->due = state->frame + timer->period;
+            timer_insert(timer);
+            return;
+        }
+    }
+    
+    timer_free(timer);
+}
+
+void retro_script_timers_advance()
+{
+    timers_state* state = timers();
+    state->frame++;
+    
+    // detach due timers first, as firing them may insert new timers.
+    script_timer** entry = &state->wheel[state->frame % WHEEL_SIZE];
+    script_timer** firing_tail = &state->firing;
+    while (*entry)
+    {
+        script_timer* timer = *entry;
+        if (timer->due <= state->frame)
+        {
+            *entry = timer->next;
+            timer->next = NULL;
+            *firing_tail = timer;
+            firing_tail = &timer->next;
+        }
+        else
+        {
+            entry = &timer->next;
+        }
+    }
+    
+    while (state->firing)
+    {
+        script_timer* timer = state->firing;
+        state->firing = timer->next;
+        if (timer->cancelled)
+        {
+            timer_free(timer);
+        }
+        else
+        {
+            state->current = timer;
+            timer_fire(timer);
+            state->current = NULL;
+        }
+    }
+}
+
+static void clear_list(script_timer** entry, script_state_t* script)
+{
+    while (*entry)
+    {
+        script_timer* timer = *entry;
+        if (timer->script == script)
+        {
+            // (a script in the shared lua state must unref; otherwise the state is being discarded.)
+            if (script->shared.enabled) luaL_unref(script->L, LUA_REGISTRYINDEX, timer->ref);
+            *entry = timer->next;
+            free(timer);
+        }
+        else
+        {
+            entry = &timer->next;
+        }
+    }
+}
+
+void retro_script_timers_clear(script_state_t* script)
+{
+    timers_state* state = timers();
+    for (size_t i = 0; i < WHEEL_SIZE; ++i)
+    {
+        clear_list(&state->wheel[i], script);
+    }
+    clear_list(&state->firing, script);
+}
+
+static void transfer_list(script_timer* timer, script_state_t* from, script_state_t* to)
+{
+    for (; timer; timer = timer->next)
+    {
+        if (timer->script == from) timer->script = to;
+    }
+}
+
+void retro_script_timers_transfer(script_state_t* from, script_state_t* to)
+{
+    timers_state* state = timers();
+    for (size_t i = 0; i < WHEEL_SIZE; ++i)
+    {
+        transfer_list(state->wheel[i], from, to);
+    }
+    transfer_list(state->firing, from, to);
+}
+
+static script_timer* find_in_list(script_timer* timer, uint32_t id)
+{
+    for (; timer; timer = timer->next)
+    {
+        if (timer->id == id) return timer;
+    }
+    return NULL;
+}
+
+static uint32_t check_delay(lua_State* L, int arg)
+{
+    lua_Integer n = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, n >= 1 && n <= UINT32_MAX, arg, "frame count must be positive");
+    return (uint32_t)n;
+}
+
+// lua args: fn, ...
+//      ret: coroutine
+int retro_script_luafunc_spawn(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.spawn");
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    const int argc = lua_gettop(L) - 1;
+    
+    lua_State* co = script_newthread(L);
+    lua_insert(L, 1);
+    lua_xmove(L, co, argc + 1);
+    
+    // run until the first wait.
+    uint32_t delay;
+    if (resume_coroutine(script_find_lua(L), co, argc, &delay))
+    {
+        lua_pushvalue(L, 1);
+        timer_create(L, delay, 0, true);
+    }
+    
+    lua_settop(L, 1);
+    return 1;
+}
+
+// lua args: [frames=1]
+int retro_script_luafunc_wait(lua_State* L)
+{
+    if (!lua_isyieldable(L) || lua_pushthread(L))
+    {
+        return luaL_error(L, "retro.wait must be called from a coroutine started with retro.spawn");
+    }
+    lua_pop(L, 1);
+    
+    lua_Integer n = lua_isnoneornil(L, 1) ? 1 : check_delay(L, 1);
+    lua_settop(L, 0);
+    lua_pushinteger(L, n);
+    return lua_yield(L, 1);
+}
+
+// lua args: frames, callback
+//      ret: timer id
+int retro_script_luafunc_after(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.after");
+    uint32_t delay = check_delay(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    script_timer* timer = timer_create(L, delay, 0, false);
+    lua_pushinteger(L, timer->id);
+    return 1;
+}
+
+// lua args: frames, callback
+//      ret: timer id
+int retro_script_luafunc_every(lua_State* L)
+{
+    retro_script_observer_check(L, "retro.every");
+    uint32_t period = check_delay(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    script_timer* timer = timer_create(L, period, period, false);
+    lua_pushinteger(L, timer->id);
+    return 1;
+}
+
+// lua args: timer id
+//      ret: true if cancelled
+int retro_script_luafunc_cancel(lua_State* L)
+{
+    timers_state* state = timers();
+    retro_script_observer_check(L, "retro.cancel");
+    const uint32_t id = (uint32_t)luaL_checkinteger(L, 1);
+    script_state_t* script = script_find_lua(L);
+    
+    script_timer* timer = (state->current && state->current->id == id) ? state->current : find_in_list(state->firing, id);
+    for (size_t i = 0; !timer && i < WHEEL_SIZE; ++i)
+    {
+        timer = find_in_list(state->wheel[i], id);
+    }
+    
+    const bool found = timer && timer->script == script && !timer->cancelled;
+    if (found)
+    {
+        // freed when next reached in the wheel.
+        timer->cancelled = true;
+    }
+    lua_pushboolean(L, found);
+    return 1;
+}
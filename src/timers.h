@@ -0,0 +1,27 @@
+#pragma once
+
+/* Frame-based scheduling for scripts: retro.spawn, retro.wait, retro.after, retro.every.
+ * Timers are kept in a timer wheel indexed by frame, which is advanced once
+ * per frame by the retro_run interceptor; only timers which are due are touched.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+struct lua_State;
+
+// advances to the next frame, firing any timers which are due.
+void retro_script_timers_advance();
+
+// removes all timers belonging to the given script.
+void retro_script_timers_clear(script_state_t*);
+
+// gives all timers belonging to one script to another.
+void retro_script_timers_transfer(script_state_t* from, script_state_t* to);
+
+// lua functions
+int retro_script_luafunc_spawn(struct lua_State* L);
+int retro_script_luafunc_wait(struct lua_State* L);
+int retro_script_luafunc_after(struct lua_State* L);
+int retro_script_luafunc_every(struct lua_State* L);
+int retro_script_luafunc_cancel(struct lua_State* L);
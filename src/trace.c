@@ -0,0 +1,209 @@
+#include "trace.h"
+#include "libretro_script.h"
+#include "thread.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// events each thread can have waiting to be written. must be a power of two.
+#define TRACE_RING_SIZE 16384
+
+// the writer wakes this often to drain the rings, or sooner if one is filling up.
+#define TRACE_WRITER_MSEC 50
+
+typedef struct trace_event
+{
+    uint64_t time;
+    const char* name;
+    const char* arg_name;
+    uint32_t arg;
+    char phase;
+} trace_event;
+
+// single-producer ring, written by the thread which owns it.
+typedef struct trace_buffer
+{
+    trace_event events[TRACE_RING_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_uint_fast64_t dropped;
+    uint64_t dropped_reported;
+    uint32_t tid;
+    struct trace_buffer* next;
+} trace_buffer;
+
+atomic_bool retro_script_tracing = false;
+
+// buffers are kept until exit, as their threads may still be recording when tracing stops.
+static THREAD_LOCAL trace_buffer* local_buffer = NULL;
+static THREAD_LOCAL bool local_failed = false;
+
+// the mutex guards the list of buffers, their consumer side, and the file.
+static retro_script_mutex_t mutex;
+static retro_script_cond_t wake;
+static retro_script_thread_t writer;
+static bool writer_running = false;
+static trace_buffer* buffers = NULL;
+static uint32_t next_tid = 1;
+static FILE* file = NULL;
+static bool first_event;
+static uint64_t start_time;
+
+INITIALIZER(trace_init)
+{
+    retro_script_mutex_init(&mutex);
+    retro_script_cond_init(&wake);
+}
+
+static trace_buffer* buffer_create()
+{
+    trace_buffer* buffer = (trace_buffer*)calloc(1, sizeof(trace_buffer));
+    if (!buffer) return NULL;
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->tail, 0);
+    atomic_init(&buffer->dropped, 0);
+    
+    retro_script_mutex_lock(&mutex);
+    buffer->tid = next_tid++;
+    buffer->next = buffers;
+    buffers = buffer;
+    retro_script_mutex_unlock(&mutex);
+    return buffer;
+}
+
+void retro_script_trace_record(const char* name, char phase, const char* arg_name, uint32_t arg)
+{
+    trace_buffer* buffer = local_buffer;
+    if (!buffer)
+    {
+        if (local_failed) return;
+        buffer = local_buffer = buffer_create();
+        local_failed = !buffer;
+        if (!buffer) return;
+    }
+    
+    const size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&buffer->tail, memory_order_acquire) >= TRACE_RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    
+    trace_event* event = &buffer->events[head & (TRACE_RING_SIZE - 1)];
+    event->time = retro_script_time_usec();
+    event->name = name;
+    event->arg_name = arg_name;
+    event->arg = arg;
+    event->phase = phase;
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+    
+    // wake the writer early if the ring is filling up.
+    if (((head + 1) & (TRACE_RING_SIZE / 2 - 1)) == 0) retro_script_cond_signal(&wake);
+}
+
+static void write_event(uint32_t tid, const char* name, char phase, uint64_t time, const char* arg_name, uint64_t arg)
+{
+    // (events recorded just as the trace started may predate it.)
+    const unsigned long long ts = (time > start_time) ? time - start_time : 0;
+    fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u", first_event ? "" : ",\n", name, phase, ts, tid);
+    if (arg_name) fprintf(file, ",\"args\":{\"%s\":%llu}", arg_name, (unsigned long long)arg);
+    if (phase == 'i') fputs(",\"s\":\"t\"", file);
+    fputc('}', file);
+    first_event = false;
+}
+
+// writes out every event in the rings. the mutex must be locked.
+static void drain()
+{
+    if (!file) return;
+    for (trace_buffer* buffer = buffers; buffer; buffer = buffer->next)
+    {
+        const size_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+        for (; tail != head; ++tail)
+        {
+            const trace_event* event = &buffer->events[tail & (TRACE_RING_SIZE - 1)];
+            write_event(buffer->tid, event->name, event->phase, event->time, event->arg_name, event->arg);
+        }
+        atomic_store_explicit(&buffer->tail, tail, memory_order_release);
+        
+        const uint64_t dropped = atomic_load_explicit(&buffer->dropped, memory_order_relaxed);
+        if (dropped != buffer->dropped_reported)
+        {
+            write_event(buffer->tid, "events dropped (ring full)", 'i', retro_script_time_usec(), "count", dropped - buffer->dropped_reported);
+            buffer->dropped_reported = dropped;
+        }
+    }
+    fflush(file);
+}
+
+static void writer_main(void* ud)
+{
+    retro_script_mutex_lock(&mutex);
+    while (writer_running)
+    {
+        drain();
+        retro_script_cond_wait(&wake, &mutex, TRACE_WRITER_MSEC);
+    }
+    retro_script_mutex_unlock(&mutex);
+}
+
+static void stop_writer()
+{
+    retro_script_mutex_lock(&mutex);
+    const bool was_running = writer_running;
+    writer_running = false;
+    retro_script_cond_signal(&wake);
+    retro_script_mutex_unlock(&mutex);
+    if (was_running) retro_script_thread_join(writer);
+}
+
+// the trace is shared by every context, so is finished at exit rather than by a core's deinit.
+static void finish_at_exit()
+{
+    if (atomic_load(&retro_script_tracing)) retro_script_set_trace_file(NULL);
+}
+
+RETRO_SCRIPT_API bool retro_script_set_trace_file(const char* path)
+{
+    static bool exit_registered = false;
+    FILE* f = NULL;
+    if (path)
+    {
+        f = fopen(path, "w");
+        if (!f) return false;
+        if (!exit_registered) exit_registered = atexit(finish_at_exit) == 0;
+    }
+    
+    // finish the current trace, if any.
+    atomic_store(&retro_script_tracing, false);
+    stop_writer();
+    retro_script_mutex_lock(&mutex);
+    if (file)
+    {
+        drain();
+        fputs("\n]\n", file);
+        fclose(file);
+        file = NULL;
+    }
+    
+    if (f)
+    {
+        // discard anything left from a previous trace.
+        for (trace_buffer* buffer = buffers; buffer; buffer = buffer->next)
+        {
+            atomic_store(&buffer->tail, atomic_load(&buffer->head));
+            buffer->dropped_reported = atomic_load(&buffer->dropped);
+        }
+        file = f;
+        first_event = true;
+        start_time = retro_script_time_usec();
+        fputs("[\n", file);
+        writer_running = retro_script_thread_create(&writer, writer_main, NULL);
+    }
+    retro_script_mutex_unlock(&mutex);
+    
+    if (f) atomic_store(&retro_script_tracing, true);
+    return true;
+}
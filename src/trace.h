@@ -0,0 +1,22 @@
+#pragma once
+
+/* An opt-in timeline of frames, callbacks, gc steps etc., written in chrome's trace event format.
+ * Each thread records events into its own preallocated ring, which a background thread
+ * drains to the trace file.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+extern atomic_bool retro_script_tracing;
+
+// phase is 'B' (begin) or 'E' (end). name and arg_name (which may be NULL) must outlive the trace.
+void retro_script_trace_record(const char* name, char phase, const char* arg_name, uint32_t arg);
+
+// (cheap enough to leave in while not tracing.)
+#define TRACE_EVENT(name, phase, arg_name, arg) \
+    do { if (atomic_load_explicit(&retro_script_tracing, memory_order_relaxed)) retro_script_trace_record(name, phase, arg_name, arg); } while (0)
+
+#define TRACE_BEGIN(name, arg_name, arg) TRACE_EVENT(name, 'B', arg_name, arg)
+#define TRACE_END(name) TRACE_EVENT(name, 'E', NULL, 0)
@@ -6,6 +6,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef RETRO_SCRIPT_DEBUG
 // we include debug.h to allow gdb access from most files,
@@ -53,6 +54,14 @@
     #endif
 #endif
 
+#ifndef THREAD_LOCAL
+    #if defined(_MSC_VER)
+        #define THREAD_LOCAL __declspec(thread)
+    #else
+        #define THREAD_LOCAL _Thread_local
+    #endif
+#endif
+
 // forceinline seems to be required to prevent linking problems?
 FORCEINLINE char* retro_script_strdup(const char* s)
 {
@@ -86,6 +95,20 @@ FORCEINLINE void retro_script_split_path_file(char** p, char** f, const char *pf
     *p = strndup(pf, slash - pf);
 }
 
+// 32-bit FNV-1a hash of len bytes.
+FORCEINLINE uint32_t retro_script_fnv1a(const char* s, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// monotonic clock, in microseconds.
+uint64_t retro_script_time_usec();
+
 struct lua_State;
 
 // like lua_getfield, but bypasses metatable
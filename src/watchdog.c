@@ -0,0 +1,208 @@
+#include "watchdog.h"
+#include "script_list.h"
+#include "observer.h"
+#include "hook.h"
+#include "context.h"
+#include "util.h"
+
+#include <lua_5.4.3.h>
+
+// the hook runs every this many instructions.
+#define WATCHDOG_GRANULARITY 1000
+
+typedef struct watchdog_state
+{
+    uint64_t default_callback_budget;
+    uint64_t default_load_budget;
+    uint32_t max_overruns;
+} watchdog_state;
+
+static void watchdog_state_init(void* state)
+{
+    ((watchdog_state*)state)->max_overruns = 3;
+}
+
+CONTEXT_STATE(watchdog_state, watchdog, watchdog_state_init, NULL)
+
+void retro_script_watchdog_count(script_state_t* script, lua_State* L, int count)
+{
+    if (script->watchdog.depth == 0)
+    {
+        // not armed. if this thread was left hooking every instruction
+        // after an overrun, restore the usual granularity.
+        retro_script_hook_install(script, L);
+        return;
+    }
+    
+    if (!script->watchdog.limited) return;
+    
+    script->watchdog.remaining -= count;
+    if (script->watchdog.remaining <= 0)
+    {
+        // fire on every instruction from now on, so that the script
+        // cannot simply catch the error and carry on.
+        script->watchdog.exceeded = true;
+        retro_script_hook_install(script, L);
+        luaL_error(L, "instruction budget exceeded");
+    }
+}
+
+uint32_t retro_script_watchdog_hook_count(script_state_t* script)
+{
+    if (!script->watchdog.callback_budget && !script->watchdog.load_budget) return 0;
+    return script->watchdog.exceeded ? 1 : WATCHDOG_GRANULARITY;
+}
+
+void retro_script_watchdog_init(script_state_t* script)
+{
+    script->watchdog.callback_budget = watchdog()->default_callback_budget;
+    script->watchdog.load_budget = watchdog()->default_load_budget;
+}
+
+void retro_script_watchdog_setup(script_state_t* script)
+{
+    retro_script_hook_install(script, script->L);
+}
+
+void retro_script_watchdog_arm(script_state_t* script, uint64_t budget)
+{
+    if (!script) return;
+    if (script->watchdog.depth++ > 0) return;
+    
+    script->watchdog.limited = budget > 0 && retro_script_hook_counting(script->L);
+    script->watchdog.remaining = (int64_t)budget;
+    script->watchdog.exceeded = false;
+}
+
+int retro_script_watchdog_disarm(script_state_t* script, int status)
+{
+    if (!script || script->watchdog.depth == 0) return status;
+    if (--script->watchdog.depth > 0) return status;
+    
+    if (script->watchdog.exceeded)
+    {
+        script->watchdog.exceeded = false;
+        retro_script_hook_install(script, script->L);
+        if (status != LUA_OK && status != LUA_YIELD) return RETRO_SCRIPT_ERR_BUDGET;
+    }
+    return status;
+}
+
+void retro_script_watchdog_abandon(script_state_t* script)
+{
+    script->watchdog.depth = 0;
+    script->watchdog.exceeded = false;
+}
+
+bool retro_script_watchdog_record_overrun(script_state_t* script, bool overrun)
+{
+    if (!overrun) return false;
+    
+    script->watchdog.overruns++;
+    script->watchdog.overrun_callback = script->errors.current;
+    if (watchdog()->max_overruns && script->watchdog.overruns >= watchdog()->max_overruns && !script->disabled)
+    {
+        script->disabled = true;
+        return true;
+    }
+    return false;
+}
+
+void retro_script_watchdog_succeeded(script_state_t* script)
+{
+    if (script->watchdog.overruns && script->watchdog.overrun_callback == script->errors.current)
+    {
+        script->watchdog.overruns = 0;
+        script->watchdog.overrun_callback = NULL;
+    }
+}
+
+RETRO_SCRIPT_API void retro_script_set_instruction_budget(retro_script_id_t id, uint64_t callback_budget, uint64_t load_budget)
+{
+    if (id == 0)
+    {
+        watchdog()->default_callback_budget = callback_budget;
+        watchdog()->default_load_budget = load_budget;
+        return;
+    }
+    
+    retro_script_observers_wait();
+    script_state_t* script = script_find(id);
+    if (script)
+    {
+        script->watchdog.callback_budget = callback_budget;
+        script->watchdog.load_budget = load_budget;
+        retro_script_watchdog_setup(script);
+    }
+}
+
+RETRO_SCRIPT_API void retro_script_set_max_budget_overruns(uint32_t count)
+{
+    watchdog()->max_overruns = count;
+}
+
+// runs the script's finalizer (upvalue 1) in a coroutine of its own. finalizers are
+// called with hooks disabled, so the watchdog could not otherwise stop one which loops.
+static int guarded_gc(lua_State* L)
+{
+    script_state_t* script = script_find_lua(L);
+    if (!script || !retro_script_hook_counting(script->L))
+    {
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_insert(L, 1);
+        lua_call(L, lua_gettop(L) - 1, 0);
+        return 0;
+    }
+    
+    lua_State* co = script_newthread(L);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 1);
+    lua_xmove(L, co, 2);
+    retro_script_hook_install(script, co);
+    
+    int nresults;
+    retro_script_watchdog_arm(script, script->watchdog.callback_budget);
+    const int status = lua_resume(co, L, 1, &nresults);
+    retro_script_watchdog_disarm(script, status);
+    if (status == LUA_YIELD) return luaL_error(L, "attempt to yield from a finalizer");
+    if (status != LUA_OK)
+    {
+        lua_xmove(co, L, 1);
+        return lua_error(L);
+    }
+    return 0;
+}
+
+// setmetatable, wrapping a lua __gc in the metatable with guarded_gc. upvalue 1 is the original.
+static int guarded_setmetatable(lua_State* L)
+{
+    lua_settop(L, 2);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_call(L, 2, 1);
+    
+    // (after the call, so that the metatable is left alone if it raised an error.)
+    if (lua_istable(L, 2))
+    {
+        lua_pushliteral(L, "__gc");
+        if (lua_rawget(L, 2) == LUA_TFUNCTION && !lua_iscfunction(L, -1))
+        {
+            lua_pushliteral(L, "__gc");
+            lua_insert(L, -2);
+            lua_pushcclosure(L, guarded_gc, 1);
+            lua_rawset(L, 2);
+        }
+    }
+    lua_settop(L, 3);
+    return 1;
+}
+
+void retro_script_watchdog_open(lua_State* L)
+{
+    lua_pushglobaltable(L);
+    lua_getfield(L, -1, "setmetatable");
+    lua_pushcclosure(L, guarded_setmetatable, 1);
+    lua_setfield(L, -2, "setmetatable");
+    lua_pop(L, 1);
+}
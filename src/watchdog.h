@@ -0,0 +1,47 @@
+#pragma once
+
+/* Instruction budgets for scripts.
+ * When a script has a budget, a lua count hook is installed on its state (see hook.c);
+ * calls into the script abort once the budget for the call is used up.
+ * Lua finalizers run with hooks disabled, so those set through setmetatable are run in a
+ * coroutine of their own, which is hooked.
+ */
+
+#include "libretro_script.h"
+#include "script.h"
+
+struct lua_State;
+
+// installs or removes the count hook, according to the script's budgets.
+void retro_script_watchdog_setup(script_state_t*);
+
+// called from the count hook, every count instructions. may raise a lua error.
+void retro_script_watchdog_count(script_state_t*, struct lua_State* L, int count);
+
+// how often the watchdog needs the count hook to run, or 0 if not at all.
+uint32_t retro_script_watchdog_hook_count(script_state_t*);
+
+// sets the script's budgets to the defaults.
+void retro_script_watchdog_init(script_state_t*);
+
+// call before entering lua with the given budget (0 for unlimited).
+// nested calls are counted against the outermost budget.
+void retro_script_watchdog_arm(script_state_t*, uint64_t budget);
+
+// call after the lua call returns, with its status.
+// returns RETRO_SCRIPT_ERR_BUDGET in place of the status if the budget was exceeded.
+int retro_script_watchdog_disarm(script_state_t*, int status);
+
+// disarms without touching the script's lua state, for once the state has been released.
+void retro_script_watchdog_abandon(script_state_t*);
+
+// records the outcome of a callback, disabling the script after too many overruns.
+// returns true if the script was disabled.
+bool retro_script_watchdog_record_overrun(script_state_t*, bool overrun);
+
+// call when a callback returns within its budget. if it is the one which last overran,
+// the script's overruns are forgiven, so that only repeated overruns disable it.
+void retro_script_watchdog_succeeded(script_state_t*);
+
+// replaces setmetatable in the state's globals, so that finalizers are held to the budget.
+void retro_script_watchdog_open(struct lua_State* L);